@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "answer_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/nameser.h>
+
+#include "dns_message.h"
+
+// Type of EDNS pseudo record, its TTL field holds flags
+static const uint16_t kOptType = 41;
+static const uint16_t kTruncated = 0x0200;
+static const uint16_t kCheckingDisabled = 0x0010;
+// DO bit of EDNS flags in TTL of OPT
+static const uint32_t kDNSSECOk = 0x8000;
+
+CrAnswerCache::CrAnswerCache(size_t slots)
+    : mask_(0), slots_(nullptr), generation_(0) {
+  // Round up to a power of two so a pair is picked by mask
+  size_t size = 2;
+  while (size < slots)
+    size <<= 1;
+  mask_ = size - 2;
+  slots_.reset(new Slot[size]());
+}
+
+uint32_t CrAnswerCache::Kind(const CrDNSMessage& query,
+                             const CrDNSMessage::RR& question) {
+  if (question.klass != ns_c_in)
+    return kNone;
+
+  uint32_t kind = 1u << 19 | question.type;
+  if ((query.Flags() & kCheckingDisabled) != 0)
+    kind |= 1u << 18;
+  auto additionals = query.Records(CrDNSMessage::kAdditional);
+  CrDNSMessage::RR rr;
+  while (additionals.Next(rr)) {
+    if (rr.type == kOptType) {
+      kind |= 1u << 16;
+      if ((rr.ttl & kDNSSECOk) != 0)
+        kind |= 1u << 17;
+      break;
+    }
+  }
+  return kind;
+}
+
+bool CrAnswerCache::Lookup(const uint8_t* name,
+                           size_t name_size,
+                           uint32_t kind,
+                           uint64_t now,
+                           u8_vec& answer) const {
+  if (name_size == 0 || name_size > kMaxNameSize)
+    return false;
+
+  uint64_t hash = Hash(name, name_size, kind);
+  uint32_t generation = Generation();
+  const Slot* pair = &slots_[Index(hash)];
+  for (size_t i = 0; i < 2; ++i) {
+    const Slot& slot = pair[i];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0 ||
+        slot.hash.load(std::memory_order_relaxed) != hash ||
+        slot.kind.load(std::memory_order_relaxed) != kind ||
+        slot.generation.load(std::memory_order_relaxed) != generation)
+      continue;
+
+    uint64_t stored_at = slot.stored_at.load(std::memory_order_relaxed);
+    uint64_t expire_at = slot.expire_at.load(std::memory_order_relaxed);
+    uint32_t sizes = slot.sizes.load(std::memory_order_relaxed);
+    size_t stored_name_size = sizes >> 16, size = sizes & 0xFFFF;
+    if (expire_at <= now || stored_name_size != name_size ||
+        name_size + size > kWords * 8)
+      continue;
+
+    uint64_t words[kWords];
+    for (size_t j = 0; j < (name_size + size + 7) / 8; ++j) {
+      words[j] = slot.words[j].load(std::memory_order_relaxed);
+    }
+    // Everything read above has to be in before the sequence is checked
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+      continue;
+
+    const char* bytes = (const char*)words;
+    if (::memcmp(bytes, name, name_size) != 0)
+      continue;
+    answer.assign(bytes + name_size, bytes + name_size + size);
+    Age(answer, (uint32_t)((now - stored_at) / 1000));
+    return true;
+  }
+  return false;
+}
+
+bool CrAnswerCache::Store(const uint8_t* name,
+                          size_t name_size,
+                          uint32_t kind,
+                          uint32_t generation,
+                          const uint8_t* data,
+                          size_t size,
+                          uint64_t now) {
+  uint32_t ttl = 0;
+  if (kind == kNone || name_size == 0 || name_size > kMaxNameSize ||
+      size > kMaxAnswerSize || generation != Generation() ||
+      !TTLOf(data, size, ttl))
+    return false;
+
+  uint64_t words[kWords] = {};
+  ::memcpy(words, name, name_size);
+  ::memcpy((char*)words + name_size, data, size);
+
+  uint64_t hash = Hash(name, name_size, kind);
+  size_t index = Index(hash);
+  std::lock_guard<std::mutex> lock(stripes_[(index >> 1) % kStripes]);
+
+  Slot* slot = &slots_[index];
+  auto holds = [hash, kind](const Slot& slot) {
+    return slot.hash.load(std::memory_order_relaxed) == hash &&
+           slot.kind.load(std::memory_order_relaxed) == kind;
+  };
+  if (!holds(slot[0]) &&
+      (holds(slot[1]) || slot[1].expire_at.load(std::memory_order_relaxed) <
+                             slot[0].expire_at.load(std::memory_order_relaxed)))
+    ++slot;
+
+  uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+  slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+  // Readers seeing anything below see the odd sequence as well
+  std::atomic_thread_fence(std::memory_order_release);
+  slot->kind.store(kind, std::memory_order_relaxed);
+  slot->generation.store(generation, std::memory_order_relaxed);
+  slot->hash.store(hash, std::memory_order_relaxed);
+  slot->stored_at.store(now, std::memory_order_relaxed);
+  slot->expire_at.store(now + (uint64_t)ttl * 1000, std::memory_order_relaxed);
+  slot->sizes.store((uint32_t)(name_size << 16 | size),
+                    std::memory_order_relaxed);
+  for (size_t j = 0; j < (name_size + size + 7) / 8; ++j) {
+    slot->words[j].store(words[j], std::memory_order_relaxed);
+  }
+  slot->sequence.store(sequence + 2, std::memory_order_release);
+  return true;
+}
+
+uint64_t CrAnswerCache::Hash(const uint8_t* name,
+                             size_t name_size,
+                             uint32_t kind) {
+  // FNV-1a, the name is already lowercase
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < name_size; ++i) {
+    hash = (hash ^ name[i]) * 1099511628211ull;
+  }
+  return hash ^ ((uint64_t)kind * 0x9e3779b97f4a7c15ull);
+}
+
+// Lowest TTL among records of a successful or NXDOMAIN answer, negative
+// answers are bounded by TTL of SOA in authority section
+bool CrAnswerCache::TTLOf(const uint8_t* data, size_t size, uint32_t& ttl) {
+  CrDNSMessage msg;
+  if (!msg.Parse(data, size) || (msg.Flags() & kTruncated) != 0)
+    return false;
+  uint16_t rcode = msg.Flags() & 0xF;
+  if (rcode != ns_r_noerror && rcode != ns_r_nxdomain)
+    return false;
+
+  bool found = false;
+  ttl = UINT32_MAX;
+  for (int section = CrDNSMessage::kAnswer;
+       section < CrDNSMessage::kSectionMax; ++section) {
+    auto records = msg.Records((CrDNSMessage::Section)section);
+    CrDNSMessage::RR rr;
+    while (records.Next(rr)) {
+      if (rr.type == kOptType)
+        continue;
+      ttl = std::min(ttl, rr.ttl);
+      found = true;
+    }
+    if (records.Failed())
+      return false;
+  }
+  return found && ttl > 0;
+}
+
+void CrAnswerCache::Age(u8_vec& answer, uint32_t seconds) {
+  if (seconds == 0)
+    return;
+
+  CrDNSMessage msg;
+  if (!msg.Parse(answer.data(), answer.size()))
+    return;
+  for (int section = CrDNSMessage::kAnswer;
+       section < CrDNSMessage::kSectionMax; ++section) {
+    auto records = msg.Records((CrDNSMessage::Section)section);
+    CrDNSMessage::RR rr;
+    while (records.Next(rr)) {
+      if (rr.type == kOptType)
+        continue;
+      // TTL sits right before rdlength and rdata
+      uint8_t* p = answer.data() + records.Offset() - rr.rdlength - 6;
+      uint32_t ttl = rr.ttl > seconds ? rr.ttl - seconds : 0;
+      CrDNSMessage::Put16(p, (uint16_t)(ttl >> 16));
+      CrDNSMessage::Put16(p + 2, (uint16_t)ttl);
+    }
+  }
+}
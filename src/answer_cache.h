@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CR_ANSWER_CACHE_H_
+#define _CR_ANSWER_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "crappydns.h"
+#include "dns_message.h"
+
+// Upstream answers shared by every loop, kept until their TTL runs out.
+// Lookups never wait: each slot carries a sequence number which is odd while
+// it is written, a reader copies the slot out and takes it only if the
+// number is still the same, a torn read is a miss. Writers lock the stripe
+// the slot belongs to, so they only wait on each other within a stripe.
+// Every key hashes to a pair of slots, a new answer takes the place of the
+// one expiring sooner. Answers are checked against the trusted net, those
+// stored before it is reloaded belong to an older generation and are gone.
+class CrAnswerCache {
+ public:
+  static const size_t kMaxAnswerSize = 512;
+  // Kind of a query that is never cached
+  static const uint32_t kNone = 0;
+
+  explicit CrAnswerCache(size_t slots);
+  ~CrAnswerCache() {}
+
+  // Answers to a name in class IN differ by type, whether the query has
+  // EDNS, and its DO and CD bits, which decide on DNSSEC records and checks
+  static uint32_t Kind(const CrDNSMessage& query,
+                       const CrDNSMessage::RR& question);
+
+  // Generation an answer is stored under, read it before the trusted net it
+  // is checked against
+  uint32_t Generation() const {
+    return generation_.load(std::memory_order_acquire);
+  }
+  // Drops every answer, for a new trusted net which is already published
+  void Invalidate() { generation_.fetch_add(1, std::memory_order_acq_rel); }
+
+  // Names are keyed in lowercase wire format, as CrDNSMessage::NameToWire
+  // gives them, so any name a query can carry has a key of its own.
+  // Copies a fresh answer into answer, with TTLs lowered by its age
+  bool Lookup(const uint8_t* name,
+              size_t name_size,
+              uint32_t kind,
+              uint64_t now,
+              u8_vec& answer) const;
+  // Keeps a copy of answer for as long as its lowest TTL. Returns false if
+  // it is not cacheable, like a failure, a truncated or oversized one, or
+  // it comes from an older generation.
+  bool Store(const uint8_t* name,
+             size_t name_size,
+             uint32_t kind,
+             uint32_t generation,
+             const uint8_t* data,
+             size_t size,
+             uint64_t now);
+
+ private:
+  static const size_t kMaxNameSize = CrDNSMessage::kMaxWireNameSize + 1;
+  static const size_t kWords = (kMaxNameSize + kMaxAnswerSize + 7) / 8;
+  static const size_t kStripes = 64;
+
+  struct Slot {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint32_t> kind;
+    std::atomic<uint32_t> generation;
+    std::atomic<uint64_t> hash;
+    // In milliseconds of uv_now
+    std::atomic<uint64_t> stored_at;
+    std::atomic<uint64_t> expire_at;
+    // Name size in high 16 bits, answer size in the rest
+    std::atomic<uint32_t> sizes;
+    // Name, then answer right after it
+    std::atomic<uint64_t> words[kWords];
+  };
+
+  // Picks the first slot of a pair
+  size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::atomic<uint32_t> generation_;
+  std::mutex stripes_[kStripes];
+
+  static uint64_t Hash(const uint8_t* name, size_t name_size, uint32_t kind);
+  size_t Index(uint64_t hash) const { return (hash ^ (hash >> 32)) & mask_; }
+  static bool TTLOf(const uint8_t* data, size_t size, uint32_t& ttl);
+  static void Age(u8_vec& answer, uint32_t seconds);
+};
+
+#endif
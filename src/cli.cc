@@ -20,13 +20,19 @@
 #include "crappydns.h"
 
 #include <getopt.h>
+#include <cerrno>
 #include <cstdlib>
+#include <vector>
 
+#include "answer_cache.h"
 #include "hosts/hosts.h"
+#include "net_list.h"
+#include "reloader.h"
 #include "runas.h"
 #include "server.h"
 #include "session.h"
 #include "session_manager.h"
+#include "shard.h"
 #include "trusted_net.h"
 
 void PrintHelpMessage() {
@@ -35,7 +41,14 @@ void PrintHelpMessage() {
   printf(
     "Usage: crappydns [-l LISTEN_ADDR] [-p LISTEN_PORT] [-t TIMEOUT_IN_MS]\n"
     "         [-b POISONED_DNS_LIST] [-g HEALTHY_DNS_LIST] [-v] [-V] [-h]\n"
-    "         [-n TRUSTED_NET_PATH] [-o TRUSTED_NET_PATH] [-a USER]\n"
+    "         [-n TRUSTED_NET_PATH]\n"
+    "         [-o TRUSTED_NET_PATH [-x TRUSTED_NET_PATH]\n"
+    "          [-i TRUSTED_NET_PATH] [-c IMAGE_PATH]]\n"
+    "         [-s HOSTS_PATH [-c IMAGE_PATH]]\n"
+    "         [-a USER] [-R RETRY] [-m MAX_INFLIGHT] [-q MAX_QUEUE] [-r] [-e]\n"
+    "         [-k]\n"
+    "         [-W WAIT_HEALTH_MS] [-F WAIT_FAST_MS] [-L SLO_MS]\n"
+    "         [-T THREADS [-P] [-N]] [-C CACHE_SIZE]\n"
     "A crappy DNS repeater\n"
     "\n"
     "Options:\n"
@@ -43,13 +56,46 @@ void PrintHelpMessage() {
     "\t\t\tDNS address schema: [(udp|tcp)://]i.p.v.4[:port]\n"
     "\t\t\tProctol default to udp, port default to 53\n"
     "-b, --bad-dns <dns>\tComma seperated poisoned remote DNS server list.\n"
-    "-s, --hosts <file>\tPath to hosts file\n"
-    "-n, --trusted-net <file>Path to the file contains trusted net list\n"
-    "-o, --optimize <file>\tOptimize trusted net list, write to stdout and exit\n"
+    "-s, --hosts <file>\tPath to hosts file,\n"
+    "\t\t\tor a binary image compiled by -c\n"
+    "-n, --trusted-net <file>Path to the file contains trusted net list,\n"
+    "\t\t\tor a binary image compiled by -c\n"
+    "-o, --optimize <file>\tOptimize trusted net list, write to stdout and\n"
+    "\t\t\texit, merge lists given more than once\n"
+    "[-x, --exclude <file>]\tWith -o, remove blocks of list from result\n"
+    "[-i, --intersect <file>]\n"
+    "\t\t\tWith -o, keep only blocks also in list\n"
+    "[-c, --compile <file>]\tWith -o, write a binary image of trusted net\n"
+    "\t\t\tinstead, -n maps it without parsing. Without -o,\n"
+    "\t\t\twrite a binary image of hosts given by -s and exit\n"
     "[-p, --port <port>]\tPort number of your local server, default to 53\n"
     "[-l, --listen <addr>]\tListen address of your local server,\n"
     "\t\t\tdefault to 127.0.0.1\n"
     "[-t, --timeout <msec>]\tTimeout for each session, default to 3000\n"
+    "[-W, --wait-health <msec>]\n"
+    "\t\t\tMax time to wait for healthy DNS once a poisoned\n"
+    "\t\t\tanswer is in, default to adapt to observed RTT\n"
+    "[-F, --wait-fast <msec>]\n"
+    "\t\t\tMax time to wait for a trusted poisoned DNS answer\n"
+    "\t\t\tonce a healthy one is in, default to adapt to RTT\n"
+    "[-L, --slo <msec>]\tReturn the best candidate by this latency\n"
+    "[-R, --retry <times>]\tMax UDP retransmissions for each upstream query,\n"
+    "\t\t\tdefault to 2, lossy UDP upstreams switch to TCP\n"
+    "[-m, --max-inflight <num>]\n"
+    "\t\t\tMax in-flight queries per upstream, default to 512\n"
+    "[-q, --max-queue <num>]\tMax queued queries per upstream, default to 256\n"
+    "[-r, --reroute]\t\tReroute overflowed queries instead of dropping\n"
+    "[-e, --early-start]\tAnswer while -n and -s files are still loading,\n"
+    "\t\t\twithout them until they are loaded\n"
+    "[-k, --verify]\t\tCheck the whole of images given by -n and -s\n"
+    "\t\t\tagainst their checksum, on every load\n"
+    "[-T, --threads <num>]\tEvent loops serving requests, each with its own\n"
+    "\t\t\tlistener and upstream sockets, default to 1\n"
+    "[-P, --pin]\t\tWith -T, pin each extra loop to a CPU\n"
+    "[-N, --name-affinity]\tWith -T, serve all queries for a name on the\n"
+    "\t\t\tsame loop, so per loop caches do not overlap\n"
+    "[-C, --cache <num>]\tAnswers kept in a cache shared by all loops,\n"
+    "\t\t\tdefault to 0, which disables it\n"
     "[-a, --run-as <user>]\tRun as another user\n"
     "[-v, --version]\t\tPrint version and exit\n"
     "[-V, --verbose]\t\tVerbose logging, use twice to output more details\n"
@@ -57,6 +103,40 @@ void PrintHelpMessage() {
   // clang-format on
 }
 
+bool LoadNetLists(const std::vector<const char*>& paths, CrNetList& list) {
+  for (const char* path : paths) {
+    if (list.LoadFile(path) != 0) {
+      ERR << "Failed to open " << path << ENDL;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Bounds of numeric options, anything beyond is surely a typo
+// As many as there are DNS IDs
+static const long kMaxInflight = 65536;
+static const long kMaxQueue = 1 << 20;
+static const long kMaxMs = 3600000;
+// Every attempt keeps a socket open until its query is done
+static const long kMaxRetries = 8;
+static const long kMaxThreads = 256;
+static const long kMaxCacheSize = 1 << 22;
+
+// Reads a whole number in [min, max] in any base strtol takes
+template <typename T>
+bool ParseNumber(const char* str, long min, long max, T& value) {
+  char* end = nullptr;
+  errno = 0;
+  long number = strtol(str, &end, 0);
+  if (errno != 0 || end == str || *end != '\0' || number < min ||
+      number > max) {
+    return false;
+  }
+  value = (T)number;
+  return true;
+}
+
 bool ValidateConfig() {
   return !CrConfig::dns_list.empty();
 }
@@ -64,6 +144,10 @@ bool ValidateConfig() {
 char ParseConfig(int argc, char** argv) {
   uint16_t listen_port = 53;
   const char* listen_addr = "127.0.0.1";
+  std::vector<const char*> optimize_paths;
+  std::vector<const char*> exclude_paths;
+  std::vector<const char*> intersect_paths;
+  const char* image_path = nullptr;
 
   opterr = 0;
   int c = 0;
@@ -75,23 +159,45 @@ char ParseConfig(int argc, char** argv) {
       {"trusted-net", required_argument, nullptr, 'n'},
       {"hosts", required_argument, nullptr, 's'},
       {"optimize", required_argument, nullptr, 'o'},
+      {"exclude", required_argument, nullptr, 'x'},
+      {"intersect", required_argument, nullptr, 'i'},
+      {"compile", required_argument, nullptr, 'c'},
       {"listen", required_argument, nullptr, 'l'},
       {"timeout", required_argument, nullptr, 't'},
       {"run-as", required_argument, nullptr, 'a'},
+      {"wait-health", required_argument, nullptr, 'W'},
+      {"wait-fast", required_argument, nullptr, 'F'},
+      {"slo", required_argument, nullptr, 'L'},
+      {"retry", required_argument, nullptr, 'R'},
+      {"max-inflight", required_argument, nullptr, 'm'},
+      {"max-queue", required_argument, nullptr, 'q'},
+      {"reroute", no_argument, nullptr, 'r'},
+      {"early-start", no_argument, nullptr, 'e'},
+      {"verify", no_argument, nullptr, 'k'},
+      {"threads", required_argument, nullptr, 'T'},
+      {"pin", no_argument, nullptr, 'P'},
+      {"name-affinity", no_argument, nullptr, 'N'},
+      {"cache", required_argument, nullptr, 'C'},
       {"version", no_argument, nullptr, 'v'},
       {"verbose", no_argument, nullptr, 'V'},
       {"help", no_argument, nullptr, 'h'},
       {nullptr, no_argument, nullptr, 0}};
 
-  while ((c = getopt_long(argc, argv, "p:b:g:n:s:o:l:t:a:vVh", long_options,
-                          &option_index)) != -1) {
+  while ((c = getopt_long(argc, argv,
+                          "p:b:g:n:s:o:x:i:c:l:t:a:W:F:L:R:m:q:rekT:PNC:vVh",
+                          long_options, &option_index)) != -1) {
     switch (c) {
       case 'o':
-        if (CrConfig::trusted_net.LoadFile(optarg, false) != 0) {
-          exit(-4);
-        }
-        CrConfig::trusted_net.PrintRouteTable();
-        exit(0);
+        optimize_paths.push_back(optarg);
+        break;
+      case 'x':
+        exclude_paths.push_back(optarg);
+        break;
+      case 'i':
+        intersect_paths.push_back(optarg);
+        break;
+      case 'c':
+        image_path = optarg;
         break;
       case 'p':
         listen_port = strtol(optarg, nullptr, 0);
@@ -112,16 +218,10 @@ char ParseConfig(int argc, char** argv) {
         }
         break;
       case 'n':
-        if (CrConfig::trusted_net.LoadFile(optarg) != 0) {
-          ERR << "Failed to open " << optarg << ENDL;
-          exit(-3);
-        }
+        CrConfig::trusted_net_path = optarg;
         break;
       case 's':
-        if (CrConfig::hosts.LoadFile(optarg) != 0) {
-          ERR << "Failed to open " << optarg << ENDL;
-          exit(-4);
-        }
+        CrConfig::hosts_path = optarg;
         break;
       case 'l':
         listen_addr = optarg;
@@ -135,6 +235,61 @@ char ParseConfig(int argc, char** argv) {
       case 'a':
         CrConfig::run_as_user = optarg;
         break;
+      case 'W':
+        if (!ParseNumber(optarg, 0, kMaxMs, CrConfig::wait_health_in_ms)) {
+          return c;
+        }
+        break;
+      case 'F':
+        if (!ParseNumber(optarg, 0, kMaxMs, CrConfig::wait_fast_in_ms)) {
+          return c;
+        }
+        break;
+      case 'L':
+        if (!ParseNumber(optarg, 0, kMaxMs, CrConfig::slo_in_ms)) {
+          return c;
+        }
+        break;
+      case 'R':
+        if (!ParseNumber(optarg, 0, kMaxRetries, CrConfig::udp_retries)) {
+          return c;
+        }
+        break;
+      case 'm':
+        if (!ParseNumber(optarg, 1, kMaxInflight, CrConfig::max_inflight)) {
+          return c;
+        }
+        break;
+      case 'q':
+        if (!ParseNumber(optarg, 0, kMaxQueue, CrConfig::max_queue)) {
+          return c;
+        }
+        break;
+      case 'r':
+        CrConfig::overflow = CrConfig::Overflow::kReroute;
+        break;
+      case 'e':
+        CrConfig::early_start = true;
+        break;
+      case 'k':
+        CrConfig::verify_images = true;
+        break;
+      case 'T':
+        if (!ParseNumber(optarg, 1, kMaxThreads, CrConfig::threads)) {
+          return c;
+        }
+        break;
+      case 'P':
+        CrConfig::pin_threads = true;
+        break;
+      case 'N':
+        CrConfig::name_affinity = true;
+        break;
+      case 'C':
+        if (!ParseNumber(optarg, 0, kMaxCacheSize, CrConfig::cache_size)) {
+          return c;
+        }
+        break;
       case 'v':
         printf("CrappyDNS %s\n", VERSION);
         exit(0);
@@ -152,6 +307,39 @@ char ParseConfig(int argc, char** argv) {
     }
   }
 
+  if (!optimize_paths.empty()) {
+    CrNetList list, exclude, intersect;
+    if (!LoadNetLists(optimize_paths, list) ||
+        !LoadNetLists(exclude_paths, exclude) ||
+        !LoadNetLists(intersect_paths, intersect)) {
+      exit(-4);
+    }
+    if (!intersect_paths.empty()) {
+      list.Intersect(intersect);
+    }
+    list.Subtract(exclude);
+    // Image is loaded in place of a list given by -n, so it keeps reserved
+    // addresses as -n does
+    if (image_path) {
+      list.AddReserved();
+    }
+    CrTrustedNet trusted_net;
+    trusted_net.Build(list);
+
+    if (!image_path) {
+      trusted_net.PrintRouteTable();
+    } else if (trusted_net.SaveImage(image_path) != 0) {
+      ERR << "Failed to write " << image_path << ENDL;
+      exit(-4);
+    }
+    exit(0);
+  }
+
+  // An image is only compiled from a list given by -o or hosts by -s
+  if (image_path && !CrConfig::hosts_path) {
+    return 'c';
+  }
+
   auto cfg_addr_v4 = (struct sockaddr_in*)&CrConfig::listen_addr;
   auto cfg_addr_v6 = (struct sockaddr_in6*)&CrConfig::listen_addr;
   if (UV_EINVAL == uv_ip4_addr(listen_addr, listen_port, cfg_addr_v4) &&
@@ -159,6 +347,48 @@ char ParseConfig(int argc, char** argv) {
     return 'l';
   }
 
+  // Loaded by reloader once the server is up
+  bool compile_hosts = CrConfig::hosts_path && image_path;
+  if (CrConfig::early_start && !compile_hosts)
+    return 0;
+
+  // Trusted net and hosts have nothing in common, so they load side by side
+  std::shared_ptr<CrTrustedNet> trusted_net;
+  std::shared_ptr<CrappyHosts> hosts;
+  int trusted_net_rtn = 0, hosts_rtn = 0;
+  ParallelFor(2, [&](size_t job) {
+    if (job == 0 && CrConfig::trusted_net_path && !compile_hosts) {
+      trusted_net = std::make_shared<CrTrustedNet>();
+      trusted_net_rtn = trusted_net->LoadFile(CrConfig::trusted_net_path);
+    } else if (job == 1 && CrConfig::hosts_path) {
+      hosts = std::make_shared<CrappyHosts>();
+      hosts_rtn = hosts->LoadFile(CrConfig::hosts_path);
+    }
+  });
+
+  if (trusted_net) {
+    if (trusted_net_rtn != 0) {
+      ERR << "Failed to open " << CrConfig::trusted_net_path << ENDL;
+      exit(-3);
+    }
+    CrConfig::trusted_net = trusted_net;
+  }
+
+  if (hosts) {
+    if (hosts_rtn != 0) {
+      ERR << "Failed to open " << CrConfig::hosts_path << ENDL;
+      exit(-4);
+    }
+    if (image_path) {
+      if (hosts->SaveImage(image_path) != 0) {
+        ERR << "Failed to write " << image_path << ENDL;
+        exit(-4);
+      }
+      exit(0);
+    }
+    CrConfig::hosts = hosts;
+  }
+
   return 0;
 }
 
@@ -175,15 +405,35 @@ int main(int argc, char** argv) {
     return -2;
   }
 
+  if (CrConfig::cache_size != 0) {
+    CrConfig::answer_cache =
+        std::make_shared<CrAnswerCache>(CrConfig::cache_size);
+  }
+
   uv_loop = uv_default_loop();
   CrappyServer server(uv_loop);
   CrSessionManager manager(uv_loop, &server);
 
-  int rtn = server.Serve((const struct sockaddr*)&CrConfig::listen_addr, 0);
+  CrShardGroup shards(uv_loop, &manager);
+
+  auto listen_addr = (const struct sockaddr*)&CrConfig::listen_addr;
+  int rtn = server.Serve(listen_addr, 0, CrConfig::threads > 1);
+  if (rtn == 0)
+    rtn = shards.Serve(CrConfig::threads, listen_addr);
   if (rtn != 0) {
+    ERR << "[Server] Failed to listen, " << *(UVError*)&rtn << ENDL;
     return rtn;
   }
 
+  // The kernel keeps spreading queries by address if it fails
+  if (CrConfig::name_affinity && CrConfig::threads > 1) {
+    rtn = server.SteerByName(CrConfig::threads);
+    if (rtn != 0) {
+      WARN << "[Server] Failed to steer queries by name, "
+           << *(UVError*)&rtn << ENDL;
+    }
+  }
+
   INFO << "[Server] Listening at " << *(SockAddr*)&CrConfig::listen_addr
        << ENDL;
 
@@ -200,6 +450,31 @@ int main(int argc, char** argv) {
     INFO << "Running as root" << ENDL;
   }
 
+  rtn = shards.Start(CrConfig::pin_threads);
+  if (rtn != 0) {
+    ERR << "[Server] Failed to start threads, " << *(UVError*)&rtn << ENDL;
+    return rtn;
+  }
+  if (CrConfig::threads > 1) {
+    INFO << "[Server] Serving on " << CrConfig::threads << " threads" << ENDL;
+  }
+
+  uv_signal_t stats_signal;
+  uv_signal_init(uv_loop, &stats_signal);
+  stats_signal.data = &shards;
+  uv_signal_start(
+      &stats_signal,
+      [](uv_signal_t* handle, int signum) {
+        ((CrShardGroup*)handle->data)->ReportStats();
+      },
+      SIGUSR1);
+  uv_unref((uv_handle_t*)&stats_signal);
+
+  CrReloader reloader(uv_loop);
+  reloader.Start();
+  if (CrConfig::early_start)
+    reloader.Reload();
+
   uv_run(uv_loop, UV_RUN_DEFAULT);
   uv_loop_close(uv_loop);
   return 0;
@@ -19,6 +19,7 @@
 
 #include "crappydns.h"
 
+#include "answer_cache.h"
 #include "hosts/hosts.h"
 #include "trusted_net.h"
 
@@ -26,9 +27,27 @@
 bool CrConfig::debug_mode(false);
 bool CrConfig::verbose_mode(false);
 uint64_t CrConfig::timeout_in_ms(3000);
+uint64_t CrConfig::wait_health_in_ms(0);
+uint64_t CrConfig::wait_fast_in_ms(0);
+uint64_t CrConfig::slo_in_ms(0);
+uint8_t CrConfig::udp_retries(2);
+uint32_t CrConfig::max_inflight(512);
+uint32_t CrConfig::max_queue(256);
+CrConfig::Overflow CrConfig::overflow(CrConfig::Overflow::kDrop);
 const char* CrConfig::run_as_user(nullptr);
-CrappyHosts CrConfig::hosts = {};
-CrTrustedNet CrConfig::trusted_net = {};
+const char* CrConfig::hosts_path(nullptr);
+const char* CrConfig::trusted_net_path(nullptr);
+bool CrConfig::early_start(false);
+bool CrConfig::verify_images(false);
+uint32_t CrConfig::threads(1);
+bool CrConfig::pin_threads(false);
+bool CrConfig::name_affinity(false);
+uint32_t CrConfig::cache_size(0);
+std::shared_ptr<CrAnswerCache> CrConfig::answer_cache(nullptr);
+std::shared_ptr<const CrappyHosts> CrConfig::hosts(
+    std::make_shared<CrappyHosts>());
+std::shared_ptr<const CrTrustedNet> CrConfig::trusted_net(
+    std::make_shared<CrTrustedNet>());
 struct sockaddr_storage CrConfig::listen_addr = {};
 std::list<std::shared_ptr<CrDNSServer>> CrConfig::dns_list({});
 
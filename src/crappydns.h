@@ -41,6 +41,7 @@
 #define UDP_BUF_SIZE 640
 #define TCP_BUF_SIZE 1024
 
+class CrAnswerCache;
 class CrappyHosts;
 class CrTrustedNet;
 
@@ -62,15 +63,41 @@ struct CrPacket {
   std::shared_ptr<u8_vec> payload;
   std::shared_ptr<const CrDNSServer> dns_server;
   std::shared_ptr<struct sockaddr_storage> addr;
+  // Session the response belongs to, resolved by the upstream worker
+  uint32_t session_id;
 };
 
 struct CrConfig {
+  enum class Overflow { kDrop, kReroute };
+
   static bool debug_mode;
   static bool verbose_mode;
   static uint64_t timeout_in_ms;
+  static uint64_t wait_health_in_ms;
+  static uint64_t wait_fast_in_ms;
+  static uint64_t slo_in_ms;
+  static uint8_t udp_retries;
+  static uint32_t max_inflight;
+  static uint32_t max_queue;
+  static Overflow overflow;
   static const char* run_as_user;
-  static CrappyHosts hosts;
-  static CrTrustedNet trusted_net;
+  static const char* hosts_path;
+  static const char* trusted_net_path;
+  // Answer at once, with hosts and trusted net published once loaded
+  static bool early_start;
+  // Check the checksum of images given by -n and -s as they are mapped
+  static bool verify_images;
+  // Event loops serving requests, each on a thread of its own
+  static uint32_t threads;
+  static bool pin_threads;
+  // Steer queries for a name to the same loop
+  static bool name_affinity;
+  static uint32_t cache_size;
+  // Shared by every loop, created at startup if cache_size is not 0
+  static std::shared_ptr<CrAnswerCache> answer_cache;
+  // Replaced as a whole on reload, access with std::atomic_load
+  static std::shared_ptr<const CrappyHosts> hosts;
+  static std::shared_ptr<const CrTrustedNet> trusted_net;
   static struct sockaddr_storage listen_addr;
   static std::list<std::shared_ptr<CrDNSServer>> dns_list;
 };
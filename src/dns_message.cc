@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dns_message.h"
+
+#include <cstring>
+
+static const size_t kMaxMessageSize = 65535;
+
+// Reads the label at offset, following compression pointers. Pointers must
+// go strictly backwards so the walk always ends. Returns the label length,
+// 0 at the root, or -1 if the name is malformed.
+static int next_label(const uint8_t* data,
+                      size_t size,
+                      size_t& offset,
+                      const uint8_t*& label) {
+  while (offset < size) {
+    uint8_t len = data[offset];
+    if ((len & 0xC0) == 0xC0) {
+      if (offset + 2 > size)
+        return -1;
+      size_t target = ((len & 0x3F) << 8) | data[offset + 1];
+      if (target >= offset)
+        return -1;
+      offset = target;
+    } else if ((len & 0xC0) != 0) {
+      return -1;
+    } else if (offset + 1 + len > size) {
+      return -1;
+    } else {
+      label = data + offset + 1;
+      offset += 1 + len;
+      return len;
+    }
+  }
+  return -1;
+}
+
+static inline uint8_t to_lower(uint8_t c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+CrDNSMessage::Iterator::Iterator(const CrDNSMessage* msg,
+                                 Section section,
+                                 size_t offset)
+    : msg_(msg),
+      question_(section == kQuestion),
+      failed_(offset == 0),
+      left_(offset == 0 ? 0 : msg->Count(section)),
+      offset_(offset) {}
+
+bool CrDNSMessage::Iterator::Next(RR& rr) {
+  if (left_ == 0)
+    return false;
+
+  size_t offset = offset_;
+  if (!msg_->SkipName(offset))
+    goto malformed;
+  rr.name = (uint16_t)offset_;
+
+  if (question_) {
+    if (offset + 4 > msg_->size_)
+      goto malformed;
+    rr.type = msg_->Get16(offset);
+    rr.klass = msg_->Get16(offset + 2);
+    rr.ttl = 0;
+    rr.rdlength = 0;
+    rr.rdata = nullptr;
+    offset += 4;
+  } else {
+    if (offset + 10 > msg_->size_)
+      goto malformed;
+    rr.type = msg_->Get16(offset);
+    rr.klass = msg_->Get16(offset + 2);
+    rr.ttl = msg_->Get32(offset + 4);
+    rr.rdlength = msg_->Get16(offset + 8);
+    offset += 10;
+    if (offset + rr.rdlength > msg_->size_)
+      goto malformed;
+    rr.rdata = msg_->data_ + offset;
+    offset += rr.rdlength;
+  }
+
+  offset_ = offset;
+  --left_;
+  return true;
+
+malformed:
+  left_ = 0;
+  failed_ = true;
+  return false;
+}
+
+CrDNSMessage::CrDNSMessage() : data_(nullptr), size_(0), section_() {}
+
+bool CrDNSMessage::Parse(const uint8_t* data, size_t size) {
+  data_ = data;
+  size_ = size;
+  ::memset(section_, 0, sizeof(section_));
+  if (size < kHeaderSize || size > kMaxMessageSize)
+    return false;
+  section_[kQuestion] = kHeaderSize;
+  return Locate(kAnswer) != 0;
+}
+
+CrDNSMessage::Iterator CrDNSMessage::Records(Section section) const {
+  return Iterator(this, section, Locate(section));
+}
+
+bool CrDNSMessage::Question(RR& rr) const {
+  return Records(kQuestion).Next(rr);
+}
+
+size_t CrDNSMessage::NameToString(uint16_t name, char* buf, size_t size) const {
+  size_t offset = name, wire_size = 0, len = 0;
+  const uint8_t* label = nullptr;
+  int label_len;
+
+  while ((label_len = next_label(data_, size_, offset, label)) > 0) {
+    wire_size += 1 + label_len;
+    if (wire_size > kMaxWireNameSize)
+      return 0;
+    if (len != 0 && len < size)
+      buf[len++] = '.';
+    for (int i = 0; i < label_len; ++i) {
+      uint8_t c = label[i];
+      // Same escaping as ns_name_ntop
+      if (c == '.' || c == ';' || c == '\\' || c == '(' || c == ')' ||
+          c == '@' || c == '$' || c == '"') {
+        if (len + 2 > size)
+          return 0;
+        buf[len++] = '\\';
+        buf[len++] = (char)c;
+      } else if (c <= 0x20 || c >= 0x7f) {
+        if (len + 4 > size)
+          return 0;
+        buf[len++] = '\\';
+        buf[len++] = (char)('0' + c / 100);
+        buf[len++] = (char)('0' + c / 10 % 10);
+        buf[len++] = (char)('0' + c % 10);
+      } else {
+        if (len + 1 > size)
+          return 0;
+        buf[len++] = (char)c;
+      }
+    }
+  }
+
+  if (label_len < 0)
+    return 0;
+  if (len == 0 && size > 1)
+    buf[len++] = '.';
+  if (len >= size)
+    return 0;
+  buf[len] = '\0';
+  return len;
+}
+
+size_t CrDNSMessage::NameToWire(uint16_t name,
+                                uint8_t* buf,
+                                size_t size) const {
+  size_t offset = name, len = 0;
+  const uint8_t* label = nullptr;
+  int label_len;
+
+  while ((label_len = next_label(data_, size_, offset, label)) > 0) {
+    if (len + 1 + label_len > kMaxWireNameSize || len + 2 + label_len > size)
+      return 0;
+    buf[len++] = (uint8_t)label_len;
+    for (int i = 0; i < label_len; ++i) {
+      buf[len++] = to_lower(label[i]);
+    }
+  }
+
+  if (label_len < 0 || len + 1 > size)
+    return 0;
+  buf[len++] = 0;
+  return len;
+}
+
+bool CrDNSMessage::NameEqual(const CrDNSMessage& lhs,
+                             uint16_t lhs_name,
+                             const CrDNSMessage& rhs,
+                             uint16_t rhs_name) {
+  size_t lhs_offset = lhs_name, rhs_offset = rhs_name, wire_size = 0;
+  const uint8_t *lhs_label = nullptr, *rhs_label = nullptr;
+
+  for (;;) {
+    int lhs_len = next_label(lhs.data_, lhs.size_, lhs_offset, lhs_label);
+    int rhs_len = next_label(rhs.data_, rhs.size_, rhs_offset, rhs_label);
+    if (lhs_len < 0 || lhs_len != rhs_len)
+      return false;
+    if (lhs_len == 0)
+      return true;
+    wire_size += 1 + lhs_len;
+    if (wire_size > kMaxWireNameSize)
+      return false;
+    for (int i = 0; i < lhs_len; ++i) {
+      if (to_lower(lhs_label[i]) != to_lower(rhs_label[i]))
+        return false;
+    }
+  }
+}
+
+bool CrDNSMessage::SkipName(size_t& offset) const {
+  size_t cur = offset;
+  while (cur < size_) {
+    uint8_t len = data_[cur];
+    if ((len & 0xC0) == 0xC0) {
+      if (cur + 2 > size_)
+        return false;
+      offset = cur + 2;
+      return true;
+    } else if ((len & 0xC0) != 0) {
+      return false;
+    } else if (len == 0) {
+      offset = cur + 1;
+      return true;
+    }
+    cur += 1 + len;
+    if (cur - offset > kMaxWireNameSize)
+      return false;
+  }
+  return false;
+}
+
+size_t CrDNSMessage::Locate(Section section) const {
+  if (section_[section] != 0 || section == kQuestion)
+    return section_[section];
+
+  Section prev = (Section)(section - 1);
+  Iterator it = Records(prev);
+  RR rr;
+  while (it.Next(rr)) {
+  }
+  if (!it.Failed())
+    section_[section] = it.offset_;
+  return section_[section];
+}
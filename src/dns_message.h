@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_DNS_MESSAGE_H_
+#define _CR_DNS_MESSAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Bounds checked view over a DNS message in wire format. Nothing is copied
+// or allocated, sections are located on first use and names stay compressed
+// unless they are asked for in presentation format.
+class CrDNSMessage {
+ public:
+  enum Section { kQuestion, kAnswer, kAuthority, kAdditional, kSectionMax };
+
+  static const size_t kHeaderSize = 12;
+  // Longest name in wire format, not counting the root label
+  static const size_t kMaxWireNameSize = 255;
+  // Longest name in presentation format, every byte escaped as \DDD
+  static const size_t kMaxNameSize = 1025;
+
+  // Record in place, questions leave ttl and rdata empty
+  struct RR {
+    uint16_t name;
+    uint16_t type;
+    uint16_t klass;
+    uint32_t ttl;
+    uint16_t rdlength;
+    const uint8_t* rdata;
+  };
+
+  class Iterator {
+   public:
+    // Returns false at the end of section, or on a malformed record
+    bool Next(RR& rr);
+    bool Failed() const { return failed_; }
+    // Offset right after the last record returned
+    size_t Offset() const { return offset_; }
+
+   private:
+    friend class CrDNSMessage;
+    Iterator(const CrDNSMessage* msg, Section section, size_t offset);
+
+    const CrDNSMessage* msg_;
+    bool question_;
+    bool failed_;
+    uint16_t left_;
+    size_t offset_;
+  };
+
+  CrDNSMessage();
+
+  // Checks the header and the question section
+  bool Parse(const uint8_t* data, size_t size);
+
+  const uint8_t* Data() const { return data_; }
+  size_t Size() const { return size_; }
+  uint16_t Id() const { return Get16(0); }
+  uint16_t Flags() const { return Get16(2); }
+  uint16_t Count(Section section) const { return Get16(4 + section * 2); }
+  Iterator Records(Section section) const;
+
+  // First question of the message
+  bool Question(RR& rr) const;
+  // Expands the name at offset into buf, without the trailing dot. Returns
+  // the length written, or 0 if the name is malformed or buf is too small.
+  size_t NameToString(uint16_t name, char* buf, size_t size) const;
+  // Expands the name at offset into buf in lowercase wire format, root label
+  // included. Returns the length written, or 0 if the name is malformed or
+  // buf is too small.
+  size_t NameToWire(uint16_t name, uint8_t* buf, size_t size) const;
+  // Compares two compressed names case insensitively
+  static bool NameEqual(const CrDNSMessage& lhs,
+                        uint16_t lhs_name,
+                        const CrDNSMessage& rhs,
+                        uint16_t rhs_name);
+
+  // Calls fn(type, rdata, rdlength) for every record in the answer section.
+  // This is the hot path of responses, owner names are skipped without being
+  // decoded and no RR is assembled. Returns false if the section is malformed.
+  template <class Fn>
+  bool ScanAnswers(Fn fn) const;
+
+  static void Put16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+  }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  // Offset of each section, 0 if it has not been located yet
+  mutable size_t section_[kSectionMax];
+
+  uint16_t Get16(size_t offset) const {
+    return (uint16_t)((data_[offset] << 8) | data_[offset + 1]);
+  }
+  uint32_t Get32(size_t offset) const {
+    return ((uint32_t)Get16(offset) << 16) | Get16(offset + 2);
+  }
+  bool SkipName(size_t& offset) const;
+  size_t Locate(Section section) const;
+};
+
+template <class Fn>
+bool CrDNSMessage::ScanAnswers(Fn fn) const {
+  size_t offset = Locate(kAnswer);
+  if (offset == 0)
+    return false;
+
+  for (uint16_t left = Count(kAnswer); left > 0; --left) {
+    // Owner names of answers are almost always a pointer to the question
+    if (offset + 2 <= size_ && (data_[offset] & 0xC0) == 0xC0) {
+      offset += 2;
+    } else if (!SkipName(offset)) {
+      return false;
+    }
+    if (offset + 10 > size_)
+      return false;
+    uint16_t type = Get16(offset), rdlength = Get16(offset + 8);
+    offset += 10;
+    if (offset + rdlength > size_)
+      return false;
+    fn(type, data_ + offset, rdlength);
+    offset += rdlength;
+  }
+  return true;
+}
+
+#endif
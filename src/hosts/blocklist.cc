@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "blocklist.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/nameser.h>
+
+const size_t CrBlocklist::kImageTables;
+
+static const uint64_t kHashSeed = 0xCBF29CE484222325ull;
+// Blocked names are not worth asking again soon
+static const uint8_t kTTL[] = {0x00, 0x00, 0x0E, 0x10};
+
+// Answers appended to the question, the owner points to the question name
+static const uint8_t kARecord[] = {
+    0xC0, 0x0C, 0x00, ns_t_a, 0x00, ns_c_in, kTTL[0], kTTL[1], kTTL[2],
+    kTTL[3], 0x00, NS_INADDRSZ, 0x00, 0x00, 0x00, 0x00};
+static const uint8_t kAAAARecord[] = {
+    0xC0, 0x0C, 0x00, ns_t_aaaa, 0x00, ns_c_in, kTTL[0], kTTL[1], kTTL[2],
+    kTTL[3], 0x00, NS_IN6ADDRSZ, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+CrBlocklist::CrBlocklist() : domains_(), blocks_(), block_table_() {}
+
+CrBlocklist::Action CrBlocklist::ActionOf(const char* word, size_t size) {
+  if (size == 8 && ::memcmp(word, "NXDOMAIN", 8) == 0)
+    return Action::kNXDomain;
+  if (size == 5 && ::memcmp(word, "BLOCK", 5) == 0)
+    return Action::kSinkhole;
+  return Action::kPass;
+}
+
+std::shared_ptr<u8_vec> CrBlocklist::Respond(Action action,
+                                             const uint8_t* request,
+                                             size_t question_end,
+                                             uint16_t type) {
+  const uint8_t* record = nullptr;
+  size_t record_size = 0;
+  if (action == Action::kSinkhole && type == ns_t_a) {
+    record = kARecord;
+    record_size = sizeof(kARecord);
+  } else if (action == Action::kSinkhole && type == ns_t_aaaa) {
+    record = kAAAARecord;
+    record_size = sizeof(kAAAARecord);
+  }
+
+  auto resp = std::make_shared<u8_vec>(question_end + record_size);
+  uint8_t* p = resp->data();
+  ::memcpy(p, request, question_end);
+  // Keep ID, opcode and RD of request, drop everything after question
+  p[2] = 0x80 | (request[2] & 0x79);
+  p[3] = 0x80 | (action == Action::kNXDomain ? ns_r_nxdomain : ns_r_noerror);
+  ::memset(p + 4, 0, 8);
+  p[5] = 1;
+  p[7] = record != nullptr ? 1 : 0;
+  if (record != nullptr)
+    ::memcpy(p + question_end, record, record_size);
+  return resp;
+}
+
+void CrBlocklist::Build() {
+  domains_.Build();
+  size_t bits = domains_.Size() * kBitsPerDomain;
+  blocks_.assign(std::max<size_t>(1, (bits + 511) / 512), Block{});
+  domains_.ForEach([this](const char* key, size_t size, uint32_t) {
+    uint64_t hash = kHashSeed;
+    for (size_t i = 0; i < size; ++i) {
+      hash = Step(hash, (uint8_t)key[i]);
+    }
+    Insert(Finish(hash));
+  });
+  blocks_.shrink_to_fit();
+  block_table_ = MakeTable(blocks_);
+}
+
+CrBlocklist::Action CrBlocklist::Match(const CrQName& name) const {
+  if (domains_.Size() == 0 || name.Empty())
+    return Action::kPass;
+
+  char key[CrQName::kMaxSize + 1];
+  size_t size = CrDomainList::Reverse(name, key);
+  uint64_t hash = kHashSeed;
+  for (size_t pos = 0; pos <= size; ++pos) {
+    if (pos == size || key[pos] == '.') {
+      if (Contains(Finish(hash))) {
+        uint32_t value = domains_.Match(name);
+        return value != CrDomainList::kNone ? Action(value) : Action::kPass;
+      }
+    }
+    if (pos < size)
+      hash = Step(hash, (uint8_t)key[pos]);
+  }
+  return Action::kPass;
+}
+
+void CrBlocklist::Save(CrImageWriter& writer) const {
+  domains_.Save(writer);
+  writer.Add(block_table_);
+}
+
+bool CrBlocklist::Map(const CrImage& image, size_t index) {
+  CrTable<Block> blocks;
+  if (!image.Get(index + CrDomainList::kImageTables, blocks) ||
+      blocks.empty() || !domains_.Map(image, index))
+    return false;
+  std::vector<Block>().swap(blocks_);
+  block_table_ = blocks;
+  return true;
+}
+
+uint64_t CrBlocklist::Finish(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void CrBlocklist::Insert(uint64_t hash) {
+  Block& block = blocks_[(hash >> 32) * blocks_.size() >> 32];
+  uint64_t bits = Bits(hash);
+  for (unsigned int i = 0; i < kProbes; ++i) {
+    uint32_t bit = (uint32_t)(bits >> (64 - 9 * (i + 1))) & 0x1FF;
+    block.words[bit >> 6] |= 1ull << (bit & 63);
+  }
+}
+
+bool CrBlocklist::Contains(uint64_t hash) const {
+  const Block& block = block_table_[(hash >> 32) * block_table_.size >> 32];
+  uint64_t bits = Bits(hash);
+  for (unsigned int i = 0; i < kProbes; ++i) {
+    uint32_t bit = (uint32_t)(bits >> (64 - 9 * (i + 1))) & 0x1FF;
+    if ((block.words[bit >> 6] & (1ull << (bit & 63))) == 0)
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_BLOCKLIST_H_
+#define _CR_HOSTS_BLOCKLIST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../crappydns.h"
+#include "../qname.h"
+#include "domain_list.h"
+
+// Domains answered locally without asking any upstream, together with
+// their subdomains. Most names are not blocked, so a name first goes
+// through a blocked bloom filter of domains, where every lookup touches a
+// single cache line, and only a hit is confirmed against the domain list.
+class CrBlocklist {
+ public:
+  // NXDOMAIN wins where both apply
+  enum class Action : uint8_t { kPass, kNXDomain, kSinkhole };
+  static const size_t kImageTables = CrDomainList::kImageTables + 1;
+
+  CrBlocklist();
+
+  // Action of the word which starts a block rule in hosts file, NXDOMAIN
+  // or BLOCK, kPass if word is neither
+  static Action ActionOf(const char* word, size_t size);
+  // Answers the question of request, with NXDOMAIN, or with 0.0.0.0 or ::
+  // to A or AAAA and nothing to other types. question_end is the offset
+  // right after the question.
+  static std::shared_ptr<u8_vec> Respond(Action action,
+                                         const uint8_t* request,
+                                         size_t question_end,
+                                         uint16_t type);
+
+  void Add(const CrQName& name, Action action) {
+    domains_.Add(name, (uint32_t)action);
+  }
+  // Returns number of domains read, or -1 if file can not be opened
+  int LoadFile(const char* path, Action action) {
+    return domains_.LoadFile(path, (uint32_t)action);
+  }
+  void Build();
+  size_t Size() const { return domains_.Size(); }
+  size_t Bytes() const {
+    return domains_.Bytes() + block_table_.size * sizeof(Block);
+  }
+
+  Action Match(const CrQName& name) const;
+
+  // Adds kImageTables tables of what is built to writer, Map takes them
+  // from index on
+  void Save(CrImageWriter& writer) const;
+  bool Map(const CrImage& image, size_t index);
+
+ private:
+  // Filter takes this many bits for a domain and sets this many of them
+  static const size_t kBitsPerDomain = 10;
+  static const unsigned int kProbes = 6;
+
+  struct Block {
+    uint64_t words[8];
+  } __attribute__((aligned(64)));
+
+  CrDomainList domains_;
+  std::vector<Block> blocks_;
+  CrTable<Block> block_table_;
+
+  // Hashes of reversed keys are built a byte at a time, so those of every
+  // domain covering a name come out of a single pass
+  static uint64_t Step(uint64_t hash, uint8_t c) {
+    return (hash ^ c) * 0x100000001B3ull;
+  }
+  static uint64_t Finish(uint64_t hash);
+  // High half of hash picks the block, 9 bits of this for each probe the
+  // bit in it
+  static uint64_t Bits(uint64_t hash) {
+    return hash * 0x9E3779B97F4A7C15ull;
+  }
+  void Insert(uint64_t hash);
+  bool Contains(uint64_t hash) const;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "domain_list.h"
+
+#include <algorithm>
+#include <fstream>
+
+const uint32_t CrDomainList::kNone;
+const size_t CrDomainList::kImageTables;
+
+static int compare_keys(const char* lhs,
+                        size_t lhs_size,
+                        const char* rhs,
+                        size_t rhs_size) {
+  int cmp = ::memcmp(lhs, rhs, std::min(lhs_size, rhs_size));
+  if (cmp != 0)
+    return cmp;
+  return lhs_size < rhs_size ? -1 : lhs_size > rhs_size ? 1 : 0;
+}
+
+// First 8 bytes of key in an integer, keys compare the same way as these
+// as long as they differ
+static uint64_t head_of(const char* key, size_t size) {
+  uint64_t head = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    head <<= 8;
+    if (i < size)
+      head |= (uint8_t)key[i];
+  }
+  return head;
+}
+
+CrDomainList::CrDomainList()
+    : pending_(),
+      pending_offsets_(),
+      pending_values_(),
+      data_(),
+      buckets_(),
+      count_(0),
+      data_table_(),
+      bucket_table_() {}
+
+int CrDomainList::LoadFile(const char* path, uint32_t value) {
+  std::ifstream ifs(path);
+  if (!ifs)
+    return -1;
+
+  int count = 0;
+  CrQName name;
+  auto add = [&](const char* domain, size_t size) {
+    // Domains cover their subdomains anyway
+    if (size > 2 && domain[0] == '*' && domain[1] == '.') {
+      domain += 2;
+      size -= 2;
+    } else if (size > 1 && domain[0] == '.') {
+      domain += 1;
+      size -= 1;
+    }
+    if (name.Assign(domain, size) && !name.Empty()) {
+      Add(name, value);
+      ++count;
+    }
+  };
+
+  std::string line;
+  while (std::getline(ifs, line)) {
+    size_t begin = line.find_first_not_of(" \t");
+    if (begin == std::string::npos || line[begin] == '#' ||
+        line[begin] == '!')
+      continue;
+    size_t end = line.find_last_not_of(" \t\r") + 1;
+
+    // dnsmasq style, option=/domain/.../domain/argument
+    size_t slash = line.find("=/", begin);
+    if (slash != std::string::npos && slash < end) {
+      size_t head = slash + 2, tail;
+      while ((tail = line.find('/', head)) != std::string::npos &&
+             tail < end) {
+        add(line.data() + head, tail - head);
+        head = tail + 1;
+      }
+      continue;
+    }
+
+    // A single domain, or hosts style address followed by domains
+    std::vector<std::pair<size_t, size_t>> tokens;
+    for (size_t head = begin; head < end;) {
+      size_t tail = std::min(line.find_first_of(" \t", head), end);
+      tokens.emplace_back(head, tail - head);
+      head = line.find_first_not_of(" \t", tail);
+      if (head == std::string::npos)
+        break;
+    }
+    for (size_t i = tokens.size() > 1 ? 1 : 0; i < tokens.size(); ++i) {
+      add(line.data() + tokens[i].first, tokens[i].second);
+    }
+  }
+  return count;
+}
+
+void CrDomainList::Add(const CrQName& name, uint32_t value) {
+  char key[CrQName::kMaxSize + 1];
+  size_t size = Reverse(name, key);
+  pending_offsets_.push_back((uint32_t)pending_.size());
+  pending_values_.push_back(value);
+  pending_.append(key, size);
+  pending_.push_back('\0');
+}
+
+void CrDomainList::Build() {
+  size_t pending_count = pending_values_.size();
+  pending_offsets_.push_back((uint32_t)pending_.size());
+  auto key = [this](uint32_t i) {
+    return pending_.data() + pending_offsets_[i];
+  };
+  auto key_size = [this](uint32_t i) {
+    return pending_offsets_[i + 1] - pending_offsets_[i] - 1;
+  };
+
+  // Duplicates end up next to each other, the lowest value first. Most
+  // compares end at heads of keys.
+  struct Sortable {
+    uint64_t head;
+    uint32_t index;
+  };
+  std::vector<Sortable> sortable(pending_count);
+  for (uint32_t i = 0; i < pending_count; ++i) {
+    sortable[i] = Sortable{head_of(key(i), key_size(i)), i};
+  }
+  std::sort(sortable.begin(), sortable.end(),
+            [&](const Sortable& lhs, const Sortable& rhs) {
+              if (lhs.head != rhs.head)
+                return lhs.head < rhs.head;
+              int cmp = compare_keys(key(lhs.index), key_size(lhs.index),
+                                     key(rhs.index), key_size(rhs.index));
+              return cmp != 0 ? cmp < 0
+                              : pending_values_[lhs.index] <
+                                    pending_values_[rhs.index];
+            });
+
+  data_.clear();
+  buckets_.clear();
+  count_ = 0;
+
+  // Kept domains which are a prefix of current one, every domain covering
+  // current one is among them as it comes right before its subdomains or
+  // ones sharing it as a prefix
+  std::vector<uint32_t> prefixes;
+  const char* prev = nullptr;
+  size_t prev_size = 0;
+  for (const Sortable& item : sortable) {
+    uint32_t i = item.index;
+    const char* cur = key(i);
+    size_t size = key_size(i);
+    uint32_t value = pending_values_[i];
+
+    while (!prefixes.empty() &&
+           (key_size(prefixes.back()) > size ||
+            ::memcmp(key(prefixes.back()), cur,
+                     key_size(prefixes.back())) != 0))
+      prefixes.pop_back();
+    bool covered = false;
+    for (uint32_t prefix : prefixes) {
+      size_t prefix_size = key_size(prefix);
+      if ((prefix_size == size || cur[prefix_size] == '.') &&
+          pending_values_[prefix] <= value) {
+        covered = true;
+        break;
+      }
+    }
+    if (covered)
+      continue;
+    prefixes.push_back(i);
+
+    size_t shared = 0;
+    if (count_ % kBucketSize == 0) {
+      buckets_.push_back((uint32_t)data_.size());
+    } else {
+      size_t limit = std::min(prev_size, size);
+      while (shared < limit && prev[shared] == cur[shared])
+        ++shared;
+    }
+    data_.push_back((uint8_t)shared);
+    data_.push_back((uint8_t)(size - shared));
+    data_.insert(data_.end(), cur + shared, cur + size);
+    do {
+      data_.push_back((uint8_t)((value & 0x7F) | (value > 0x7F ? 0x80 : 0)));
+      value >>= 7;
+    } while (value != 0);
+
+    prev = cur;
+    prev_size = size;
+    ++count_;
+  }
+  data_.shrink_to_fit();
+  buckets_.shrink_to_fit();
+  data_table_ = MakeTable(data_);
+  bucket_table_ = MakeTable(buckets_);
+
+  std::string().swap(pending_);
+  std::vector<uint32_t>().swap(pending_offsets_);
+  std::vector<uint32_t>().swap(pending_values_);
+}
+
+void CrDomainList::Clear() {
+  *this = CrDomainList();
+}
+
+uint32_t CrDomainList::Match(const CrQName& name) const {
+  if (count_ == 0 || name.Empty())
+    return kNone;
+
+  // Look up domains covering name from the shortest, no longer one can be
+  // there once no domain starts with what is looked up
+  char key[CrQName::kMaxSize + 1];
+  size_t size = Reverse(name, key);
+  uint32_t best = kNone;
+  bool extended = true;
+  for (size_t pos = 0; pos <= size && extended; ++pos) {
+    if (pos == size || key[pos] == '.')
+      best = std::min(best, Find(key, pos, extended));
+  }
+  return best;
+}
+
+size_t CrDomainList::Reverse(const CrQName& name, char* key) {
+  size_t size = 0;
+  for (size_t index = name.LabelCount(); index-- > 0;) {
+    if (size != 0)
+      key[size++] = '.';
+    size_t label_size = name.LabelSize(index);
+    ::memcpy(key + size, name.Suffix(index), label_size);
+    size += label_size;
+  }
+  return size;
+}
+
+uint32_t CrDomainList::Find(const char* key,
+                            size_t size,
+                            bool& extended) const {
+  // Bucket after the last one whose head is not greater than key
+  size_t low = 0, high = bucket_table_.size;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    const uint8_t* head = &data_table_[bucket_table_[mid]];
+    if (compare_keys((const char*)head + 2, head[1], key, size) <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  // Scan from the very first entry if key is before all, only to find out
+  // if it starts with key
+  const uint8_t* cur =
+      data_table_.begin() + (low != 0 ? bucket_table_[low - 1] : 0);
+  const uint8_t* end = data_table_.end();
+  char text[CrQName::kMaxSize + 1];
+  uint32_t found = kNone;
+  extended = false;
+  while (cur < end) {
+    size_t shared = cur[0], rest = cur[1];
+    ::memcpy(text + shared, cur + 2, rest);
+    cur += 2 + rest;
+    uint32_t value = ReadValue(cur);
+    // Only the entry right after key tells if any entry starts with it,
+    // which may be head of next bucket
+    int cmp = compare_keys(text, shared + rest, key, size);
+    if (cmp == 0) {
+      found = value;
+    } else if (cmp > 0) {
+      extended = shared + rest > size && ::memcmp(text, key, size) == 0;
+      break;
+    }
+  }
+  return found;
+}
+
+void CrDomainList::Save(CrImageWriter& writer) const {
+  writer.Add(data_table_);
+  writer.Add(bucket_table_);
+  writer.Add(&count_, 1);
+}
+
+bool CrDomainList::Map(const CrImage& image, size_t index) {
+  CrTable<uint8_t> data;
+  CrTable<uint32_t> buckets, count;
+  if (!image.Get(index, data) || !image.Get(index + 1, buckets) ||
+      !image.Get(index + 2, count) || count.size != 1)
+    return false;
+  if (!data.empty() && (buckets.empty() || buckets[0] != 0))
+    return false;
+
+  Clear();
+  data_table_ = data;
+  bucket_table_ = buckets;
+  count_ = count[0];
+  return true;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_DOMAIN_LIST_H_
+#define _CR_HOSTS_DOMAIN_LIST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../image.h"
+#include "../qname.h"
+
+// Large set of domains, each covering itself and its subdomains, with a
+// small value for each. Domains are kept with labels in reverse order,
+// sorted and front coded in buckets, so a domain takes little more than
+// what it does not share with the one before it. A lookup is a binary
+// search over heads of buckets and a short scan in one of them.
+class CrDomainList {
+ public:
+  static const uint32_t kNone = UINT32_MAX;
+  static const size_t kImageTables = 3;
+
+  CrDomainList();
+  // Tables may point into a mapped image
+  CrDomainList(const CrDomainList&) = delete;
+  CrDomainList& operator=(const CrDomainList&) = delete;
+  CrDomainList(CrDomainList&&) = default;
+  CrDomainList& operator=(CrDomainList&&) = default;
+
+  // Reads a domain from each line, in plain, hosts or dnsmasq server=/.../
+  // form. Returns number of domains read, or -1 if file can not be opened
+  int LoadFile(const char* path, uint32_t value);
+  void Add(const CrQName& name, uint32_t value);
+  // Replaces what was built before with domains added since. Where domains
+  // overlap the lowest value wins, so subdomains of one with a value no
+  // higher than their own are dropped.
+  void Build();
+  void Clear();
+  size_t Size() const { return count_; }
+  size_t Bytes() const {
+    return data_table_.size + bucket_table_.size * sizeof(uint32_t);
+  }
+
+  // Lowest value among domains covering name, kNone if there is none
+  uint32_t Match(const CrQName& name) const;
+  // Calls fn(key, size, value) for every domain kept, key is the domain
+  // with labels reversed as Reverse gives
+  template <class Fn>
+  void ForEach(Fn fn) const;
+
+  // Writes name with labels in reverse order into key, returns its size
+  static size_t Reverse(const CrQName& name, char* key);
+
+  // Adds kImageTables tables of what is built to writer, Map takes them
+  // from index on
+  void Save(CrImageWriter& writer) const;
+  bool Map(const CrImage& image, size_t index);
+
+ private:
+  static const size_t kBucketSize = 16;
+
+  // Reversed domains waiting for Build, separated by NUL
+  std::string pending_;
+  std::vector<uint32_t> pending_offsets_;
+  std::vector<uint32_t> pending_values_;
+
+  // Entry is length of prefix shared with the one before, size of rest,
+  // the rest and value in LEB128. First entry of a bucket shares nothing.
+  std::vector<uint8_t> data_;
+  std::vector<uint32_t> buckets_;
+  uint32_t count_;
+  // Lookup goes through these, over the vectors or into an image
+  CrTable<uint8_t> data_table_;
+  CrTable<uint32_t> bucket_table_;
+
+  static uint32_t ReadValue(const uint8_t*& cur) {
+    uint32_t value = 0;
+    for (unsigned int shift = 0;; shift += 7) {
+      value |= (uint32_t)(*cur & 0x7F) << shift;
+      if ((*cur++ & 0x80) == 0)
+        return value;
+    }
+  }
+  // Value of key, or kNone. Tells if there are longer keys starting with it.
+  uint32_t Find(const char* key, size_t size, bool& extended) const;
+};
+
+template <class Fn>
+void CrDomainList::ForEach(Fn fn) const {
+  char key[CrQName::kMaxSize + 1];
+  const uint8_t* cur = data_table_.begin();
+  const uint8_t* end = data_table_.end();
+  while (cur < end) {
+    size_t shared = cur[0], rest = cur[1];
+    ::memcpy(key + shared, cur + 2, rest);
+    cur += 2 + rest;
+    uint32_t value = ReadValue(cur);
+    fn((const char*)key, shared + rest, value);
+  }
+}
+
+#endif
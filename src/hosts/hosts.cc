@@ -19,13 +19,47 @@
 
 #include "hosts.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
-#include <queue>
 #include <string>
 
 #include <arpa/nameser.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-const std::string CrappyHosts::kRegexRuleKey = "/^regex$/";
+const uint32_t CrappyHosts::kNoRank;
+const uint16_t CrappyHosts::kNoGroup;
+std::atomic<uint64_t> CrappyHosts::next_generation_(0);
+
+// Wildcard rules starting with a wildcard are compiled this many at a time
+static const size_t kUnanchoredGroupSize = 16;
+// Rules in [hosts] are parsed on several threads this many lines at a time
+static const size_t kParseChunkSize = 4096;
+
+// Bump whenever a table changes, tables are in the order of ImageTable
+static const char kImageMagic[CrImage::kMagicSize] = {'C', 'R', 'H', 'O',
+                                                      'S', 'T', 'S', '\0'};
+static const uint32_t kImageVersion = 2;
+
+enum ImageTable : size_t {
+  kImageRules,
+  kImageStrings,
+  kImageAddresses,
+  kImageGroups,
+  kImageRanks,
+  kImageRanked,
+  kImageNodeRanks = kImageRanked + 2,
+  kImageRegexRules,
+  kImageListRules,
+  kImageScanRules,
+  kImageBests = kImageScanRules + 2,
+  kImageTrie,
+  kImageWildcards = kImageTrie + CrLabelTrie::kImageTables,
+  kImageDomains = kImageWildcards + CrWildcardDFA::kImageTables,
+  kImageBlocklist = kImageDomains + CrDomainList::kImageTables,
+  kImageTableCount = kImageBlocklist + CrBlocklist::kImageTables
+};
 
 enum class ParseHostsState { kInit, kConfig, kHost };
 enum class ParseConfigState { kName, kIPList, kTerm };
@@ -52,7 +86,10 @@ CrPacket CrappyHosts::AssemblePacket(
   resp->insert(resp->cend(), request->begin() + 12, it + 2 + 1);
   for (const auto& addr : address_list) {
     auto addr_in = (const struct sockaddr_in*)addr.get();
-    auto sin_addr = (uint8_t*)&(addr_in->sin_addr);
+    auto sin_addr =
+        addr->ss_family == AF_INET6
+            ? (uint8_t*)&((const struct sockaddr_in6*)addr.get())->sin6_addr
+            : (uint8_t*)&(addr_in->sin_addr);
     auto addr_len = get_addrlen(addr_in), rd_len = htons(addr_len);
     auto rd_length = (uint8_t*)&rd_len;
     resp->insert(resp->cend(), {0xC0, 0x0C, type_hi, type_lo, 0x00, 0x01});
@@ -64,12 +101,25 @@ CrPacket CrappyHosts::AssemblePacket(
 }
 
 int CrappyHosts::LoadFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (CrImage::Sniff(fd, kImageMagic)) {
+    int rtn = LoadImage(fd);
+    close(fd);
+    return rtn;
+  }
+  close(fd);
+
   std::string line;
   std::ifstream ifs(path);
   ParseHostsState state = ParseHostsState::kInit;
+  std::vector<std::string> rule_lines;
 
   if (!ifs)
     return -1;
+  const char* slash = strrchr(path, '/');
+  std::string dir(path, slash ? slash + 1 - path : 0);
 
   while (std::getline(ifs, line)) {
     if (line.size() == 0 || line[0] == '!')
@@ -85,13 +135,22 @@ int CrappyHosts::LoadFile(const char* path) {
           break;
         }
       case ParseHostsState::kHost: {
-        auto rule = HostsRule::Parse(line.c_str(), dns_server_list_);
-        if (rule == nullptr)
+        size_t word = std::min(line.find(' '), line.size());
+        auto action = CrBlocklist::ActionOf(line.data(), word);
+        if (action != CrBlocklist::Action::kPass) {
+          if (!AddBlockRule(action, line.c_str() + word, dir))
+            return -1;
           break;
-        std::string digest = rule->type_ != HostsRule::Type::kRegex
-                                 ? rule->Digest()
-                                 : CrappyHosts::kRegexRuleKey;
-        digest_map_[digest].push_back(rule);
+        }
+        // No more DNS config can follow [hosts], so rules there are parsed
+        // all at once later
+        if (state == ParseHostsState::kHost) {
+          rule_lines.push_back(line);
+          break;
+        }
+        auto rule = HostsRule::Parse(line.c_str(), dns_server_list_);
+        if (rule != nullptr)
+          rules_.push_back(rule);
         break;
       }
       case ParseHostsState::kConfig:
@@ -128,6 +187,7 @@ int CrappyHosts::LoadFile(const char* path) {
                   return -2;
                 }
                 dns_server_list_.push_back(std::make_pair(dns_name, dns_list));
+                dns_server_specs_.push_back(token);
                 pc_state = ParseConfigState::kTerm;
                 break;
               case ParseConfigState::kTerm:
@@ -141,51 +201,531 @@ int CrappyHosts::LoadFile(const char* path) {
     }
   }
   ifs.close();
+  ParseRules(rule_lines);
 
+  // Blocklist and rules share nothing, so they are built side by side
+  bool compiled = true;
+  ParallelFor(2, [&](size_t job) {
+    if (job == 0)
+      blocklist_.Build();
+    else
+      compiled = Compile(dir);
+  });
+  if (blocklist_.Size() != 0) {
+    INFO << "[Hosts] " << blocklist_.Size() << " domains blocked, "
+         << blocklist_.Bytes() << " bytes" << ENDL;
+  }
+  if (!compiled)
+    return -1;
   return 0;
 }
 
-std::shared_ptr<const HostsRule> CrappyHosts::Match(std::string hostname,
-                                                    uint16_t type) {
-  auto cmp = [&type](std::shared_ptr<const HostsRule>& lhs,
-                     std::shared_ptr<const HostsRule>& rhs) {
-    if (lhs->priority_ == rhs->priority_) {
-      if (lhs->type_ == rhs->type_) {
-        if (LIKELY((type & ns_t_a) == type)) {
-          return lhs->ipv4_list_.size() < rhs->ipv4_list_.size();
-        }
-        return lhs->ipv6_list_.size() < rhs->ipv6_list_.size();
+void CrappyHosts::ParseRules(const std::vector<std::string>& lines) {
+  // Chunks are joined in order, so rules end up as if parsed one by one
+  size_t chunk_count = (lines.size() + kParseChunkSize - 1) / kParseChunkSize;
+  std::vector<std::vector<std::shared_ptr<const HostsRule>>> chunks(
+      chunk_count);
+  ParallelFor(chunk_count, [&](size_t chunk) {
+    size_t end = std::min(lines.size(), (chunk + 1) * kParseChunkSize);
+    for (size_t i = chunk * kParseChunkSize; i < end; ++i) {
+      auto rule = HostsRule::Parse(lines[i].c_str(), dns_server_list_);
+      if (rule != nullptr)
+        chunks[chunk].push_back(rule);
+    }
+  });
+  for (const auto& rules : chunks) {
+    rules_.insert(rules_.end(), rules.begin(), rules.end());
+  }
+}
+
+std::shared_ptr<const HostsRule> CrappyHosts::Match(const CrQName& hostname,
+                                                    uint16_t type) const {
+  bool deferred = false;
+  uint32_t best = BestRank(hostname, type, false, deferred);
+  return best != kNoRank ? Rule(tables_.ranked[KindOf(type)][best]) : nullptr;
+}
+
+bool CrappyHosts::MatchInline(const CrQName& hostname,
+                              uint16_t type,
+                              std::shared_ptr<const HostsRule>& rule) const {
+  bool deferred = false;
+  uint32_t best = BestRank(hostname, type, true, deferred);
+  if (deferred)
+    return false;
+  rule = best != kNoRank ? Rule(tables_.ranked[KindOf(type)][best]) : nullptr;
+  return true;
+}
+
+uint32_t CrappyHosts::BestRank(const CrQName& hostname,
+                               uint16_t type,
+                               bool inline_only,
+                               bool& deferred) const {
+  Kind kind = KindOf(type);
+  uint32_t best = kNoRank;
+  if (kind == kKindMax)
+    return best;
+
+  // * does not match underscore, *.domain only matches subdomains whose
+  // extra labels are free of it
+  const char* underscore =
+      (const char*)::memchr(hostname.Text(), '_', hostname.Size());
+  trie_.Walk(hostname, [&](uint32_t node, size_t index) {
+    const NodeRanks& ranks = tables_.node_ranks[node];
+    if (index == 0) {
+      best = std::min(best, ranks.exact[kind]);
+    } else if (!underscore || underscore >= hostname.Suffix(index)) {
+      best = std::min(best, ranks.subdomain[kind]);
+    }
+  });
+
+  for (const auto& wildcard : wildcards_) {
+    const uint32_t* ranks = wildcard.Match(hostname.Text(), hostname.Size());
+    best = std::min(best, ranks[kind]);
+  }
+
+  // Only rules ranked higher than what is found so far are worth a check
+  if (list_best_[kind] < best) {
+    uint32_t list = domains_.Match(hostname);
+    if (list != CrDomainList::kNone)
+      best = std::min(best, tables_.ranks[tables_.list_rules[list]][kind]);
+  }
+
+  if (regex_best_[kind] < best) {
+    regexes_.Match(hostname.Text(), hostname.Size(), [&](uint32_t id) {
+      best = std::min(best, tables_.ranks[tables_.regex_rules[id]][kind]);
+    });
+  }
+
+  for (uint32_t rank : tables_.scan_rules[kind]) {
+    if (rank >= best)
+      break;
+    if (inline_only) {
+      deferred = true;
+      break;
+    }
+    if (Rule(tables_.ranked[kind][rank])->Match(hostname, type)) {
+      best = rank;
+      break;
+    }
+  }
+
+  return best;
+}
+
+int CrappyHosts::SaveImage(const char* path) const {
+  std::vector<RuleRecord> records;
+  std::vector<char> strings;
+  std::vector<AddressRecord> addresses;
+  std::vector<GroupRecord> groups;
+  auto add_text = [&strings](const std::string& text) {
+    uint32_t offset = (uint32_t)strings.size();
+    strings.insert(strings.end(), text.begin(), text.end());
+    return offset;
+  };
+
+  std::vector<HostsRule::CrDNSServerListPtr> group_lists;
+  auto spec = dns_server_specs_.begin();
+  for (const auto& group : dns_server_list_) {
+    GroupRecord record;
+    record.name = add_text(group.first);
+    record.name_size = (uint32_t)group.first.size();
+    record.spec = add_text(*spec);
+    record.spec_size = (uint32_t)(spec++)->size();
+    groups.push_back(record);
+    group_lists.push_back(group.second);
+  }
+
+  for (uint32_t i = 0; i < rules_.size(); ++i) {
+    auto rule = Rule(i);
+    // Padding is cleared so the same rules make the same image
+    RuleRecord record;
+    ::memset(&record, 0, sizeof(record));
+    record.priority = (uint8_t)rule->priority_;
+    record.group = kNoGroup;
+    if (rule->dns_server_list_ != nullptr)
+      record.group = (uint16_t)(std::find(group_lists.begin(),
+                                          group_lists.end(),
+                                          rule->dns_server_list_) -
+                                group_lists.begin());
+    record.host = add_text(rule->Host());
+    record.host_size = (uint32_t)rule->Host().size();
+    record.address = (uint32_t)addresses.size();
+    for (const auto* list : {&rule->ipv4_list_, &rule->ipv6_list_}) {
+      for (const auto& addr : *list) {
+        AddressRecord address = {};
+        address.family = addr->ss_family;
+        if (addr->ss_family == AF_INET)
+          ::memcpy(address.bytes,
+                   &((const struct sockaddr_in*)addr.get())->sin_addr, 4);
+        else
+          ::memcpy(address.bytes,
+                   &((const struct sockaddr_in6*)addr.get())->sin6_addr, 16);
+        addresses.push_back(address);
       }
-      return lhs->type_ > rhs->type_;
     }
-    return lhs->priority_ > rhs->priority_;
+    record.address_count = (uint32_t)addresses.size() - record.address;
+    records.push_back(record);
+  }
+
+  CrImageWriter writer;
+  writer.Add(std::move(records));
+  writer.Add(std::move(strings));
+  writer.Add(std::move(addresses));
+  writer.Add(std::move(groups));
+  writer.Add(tables_.ranks);
+  for (int kind = 0; kind < kKindMax; ++kind) {
+    writer.Add(tables_.ranked[kind]);
+  }
+  writer.Add(tables_.node_ranks);
+  writer.Add(tables_.regex_rules);
+  writer.Add(tables_.list_rules);
+  for (int kind = 0; kind < kKindMax; ++kind) {
+    writer.Add(tables_.scan_rules[kind]);
+  }
+  writer.Add(std::vector<Ranks>{regex_best_, list_best_});
+  trie_.Save(writer);
+  CrWildcardDFA::Save(wildcards_, writer);
+  domains_.Save(writer);
+  blocklist_.Save(writer);
+  return writer.Save(path, kImageMagic, kImageVersion);
+}
+
+int CrappyHosts::LoadImage(int fd) {
+  static_assert(kKindMax == 2, "ImageTable takes two kinds");
+  CrImage image;
+  if (image.Map(fd, kImageMagic, kImageVersion, kImageTableCount, "hosts",
+                CrConfig::verify_images) != 0)
+    return -1;
+
+  Tables tables = {};
+  CrTable<GroupRecord> groups = {};
+  CrTable<Ranks> bests = {};
+  bool valid = image.Get(kImageRules, rule_records_) &&
+               image.Get(kImageStrings, strings_) &&
+               image.Get(kImageAddresses, addresses_) &&
+               image.Get(kImageGroups, groups) &&
+               image.Get(kImageRanks, tables.ranks) &&
+               image.Get(kImageNodeRanks, tables.node_ranks) &&
+               image.Get(kImageRegexRules, tables.regex_rules) &&
+               image.Get(kImageListRules, tables.list_rules) &&
+               image.Get(kImageBests, bests) && bests.size == 2 &&
+               tables.ranks.size == rule_records_.size &&
+               trie_.Map(image, kImageTrie) &&
+               CrWildcardDFA::Map(image, kImageWildcards, wildcards_) &&
+               domains_.Map(image, kImageDomains) &&
+               blocklist_.Map(image, kImageBlocklist);
+  for (int kind = 0; kind < kKindMax && valid; ++kind) {
+    valid = image.Get(kImageRanked + kind, tables.ranked[kind]) &&
+            image.Get(kImageScanRules + kind, tables.scan_rules[kind]);
+  }
+  if (!valid) {
+    ERR << "Bad hosts image: malformed table" << ENDL;
+    return -1;
+  }
+
+  for (const GroupRecord& group : groups) {
+    std::string spec = Text(group.spec, group.spec_size);
+    auto dns_list = std::make_shared<HostsRule::CrDNSServerList>();
+    if (!ParseDNSList(spec.c_str(), CrDNSServer::Health::kTrusted,
+                      *dns_list) ||
+        dns_list->empty()) {
+      ERR << "Bad hosts image: malformed DNS config " << spec << ENDL;
+      return -1;
+    }
+    dns_server_list_.push_back(
+        std::make_pair(Text(group.name, group.name_size), dns_list));
+    dns_server_specs_.push_back(spec);
+  }
+
+  // Regexes are compiled again, in the order which gave them their ids
+  for (uint32_t rule : tables.regex_rules) {
+    const RuleRecord& record = rule_records_[rule];
+    if (regexes_.Add(Text(record.host + 1, record.host_size - 2)) ==
+        CrRegexSet::kUnsupported) {
+      ERR << "Bad hosts image: malformed regex rule" << ENDL;
+      return -1;
+    }
+  }
+  regexes_.Build();
+
+  rules_.assign(rule_records_.size, nullptr);
+  regex_best_ = bests[0];
+  list_best_ = bests[1];
+  tables_ = tables;
+  image_ = std::move(image);
+  INFO << "[Hosts] " << rule_records_.size << " rules mapped from image"
+       << ENDL;
+  return 0;
+}
+
+std::shared_ptr<const HostsRule> CrappyHosts::Rule(uint32_t index) const {
+  if (!image_.Mapped())
+    return rules_[index];
+
+  std::lock_guard<std::mutex> lock(rules_mutex_);
+  auto& rule = rules_[index];
+  if (rule != nullptr)
+    return rule;
+
+  const RuleRecord& record = rule_records_[index];
+  HostsRule::CrDNSServerListPtr dns_list = nullptr;
+  if (record.group != kNoGroup && record.group < dns_server_list_.size())
+    dns_list = std::next(dns_server_list_.begin(), record.group)->second;
+  std::list<std::shared_ptr<struct sockaddr_storage>> addr_list;
+  for (uint32_t i = 0; i < record.address_count; ++i) {
+    const AddressRecord& address = addresses_[record.address + i];
+    auto addr = std::make_shared<struct sockaddr_storage>();
+    addr->ss_family = address.family;
+    if (address.family == AF_INET)
+      ::memcpy(&((struct sockaddr_in*)addr.get())->sin_addr, address.bytes, 4);
+    else
+      ::memcpy(&((struct sockaddr_in6*)addr.get())->sin6_addr, address.bytes,
+               16);
+    addr_list.push_back(addr);
+  }
+  rule = std::make_shared<HostsRule>(HostsRule::Priority(record.priority),
+                                     Text(record.host, record.host_size),
+                                     dns_list, addr_list);
+  return rule;
+}
+
+CrappyHosts::Kind CrappyHosts::KindOf(uint16_t type) {
+  switch (type) {
+    case ns_t_a:
+      return kKindA;
+    case ns_t_aaaa:
+      return kKindAAAA;
+    default:
+      return kKindMax;
+  }
+}
+
+bool CrappyHosts::AddBlockRule(CrBlocklist::Action action,
+                               const char* target,
+                               const std::string& dir) {
+  while (*target == ' ')
+    ++target;
+  std::string host(target, strcspn(target, " "));
+
+  if (host.size() > 1 && host.front() == '@') {
+    std::string path = host.substr(1);
+    if (path.front() != '/')
+      path = dir + path;
+    if (blocklist_.LoadFile(path.c_str(), action) < 0) {
+      ERR << "Failed to open block list " << path << ENDL;
+      return false;
+    }
+    return true;
+  }
+
+  CrQName name;
+  if (name.Assign(host) && !name.Empty()) {
+    blocklist_.Add(name, action);
+  } else {
+    WARN << "Not a valid hostname in block rule: " << host << ENDL;
+  }
+  return true;
+}
+
+bool CrappyHosts::Compile(const std::string& dir) {
+  trie_ = CrLabelTrie();
+  node_ranks_.assign(1, NodeRanks{});
+  wildcards_.clear();
+  regexes_.Clear();
+  regex_rules_.clear();
+  regex_best_.fill(kNoRank);
+  domains_.Clear();
+  list_rules_.clear();
+  list_best_.fill(kNoRank);
+  for (auto& scan_rules : scan_rules_) {
+    scan_rules.clear();
+  }
+
+  ranks_.assign(rules_.size(), Ranks{});
+  for (int kind = 0; kind < kKindMax; ++kind) {
+    auto addr_count = [kind](const HostsRule& rule) {
+      return kind == kKindA ? rule.ipv4_list_.size() : rule.ipv6_list_.size();
+    };
+    ranked_[kind].clear();
+    for (uint32_t i = 0; i < rules_.size(); ++i) {
+      // Rules with a DNS server apply to every query, others only to queries
+      // they have addresses for
+      ranks_[i][kind] = kNoRank;
+      if (rules_[i]->dns_server_list_ != nullptr ||
+          addr_count(*rules_[i]) != 0)
+        ranked_[kind].push_back(i);
+    }
+    std::stable_sort(ranked_[kind].begin(), ranked_[kind].end(),
+                     [&](uint32_t lhs, uint32_t rhs) {
+                       const HostsRule& l = *rules_[lhs];
+                       const HostsRule& r = *rules_[rhs];
+                       if (l.priority_ != r.priority_)
+                         return l.priority_ < r.priority_;
+                       if (l.type_ != r.type_)
+                         return l.type_ < r.type_;
+                       return addr_count(l) > addr_count(r);
+                     });
+    for (uint32_t rank = 0; rank < ranked_[kind].size(); ++rank) {
+      ranks_[ranked_[kind][rank]][kind] = rank;
+    }
+  }
+
+  Ranks none;
+  none.fill(kNoRank);
+  auto keep_best = [](Ranks& slot, const Ranks& ranks) {
+    for (int kind = 0; kind < kKindMax; ++kind) {
+      slot[kind] = std::min(slot[kind], ranks[kind]);
+    }
   };
 
-  std::priority_queue<std::shared_ptr<const HostsRule>,
-                      std::vector<std::shared_ptr<const HostsRule>>,
-                      decltype(cmp)>
-      candidate_rules(cmp);
+  CrQName name;
+  std::vector<uint32_t> wildcards;
+  for (uint32_t i = 0; i < rules_.size(); ++i) {
+    const HostsRule& rule = *rules_[i];
+    const std::string& host = rule.Host();
+
+    if (rule.type_ == HostsRule::Type::kRaw) {
+      if (rule.HostQName().Empty())
+        continue;
+      uint32_t node = trie_.Insert(rule.HostQName());
+      node_ranks_.resize(trie_.Size(), NodeRanks{none, none});
+      keep_best(node_ranks_[node].exact, ranks_[i]);
+      continue;
+    }
+
+    if (rule.type_ == HostsRule::Type::kWildcard && host.size() > 2 &&
+        host.compare(0, 2, "*.") == 0 &&
+        host.find_first_of("*?", 2) == std::string::npos &&
+        name.Assign(host.data() + 2, host.size() - 2)) {
+      uint32_t node = trie_.Insert(name);
+      node_ranks_.resize(trie_.Size(), NodeRanks{none, none});
+      keep_best(node_ranks_[node].subdomain, ranks_[i]);
+      continue;
+    }
+
+    if (rule.type_ == HostsRule::Type::kWildcard) {
+      wildcards.push_back(i);
+      continue;
+    }
+
+    if (rule.type_ == HostsRule::Type::kList) {
+      // Addresses would rank a list differently for each kind
+      if (rule.dns_server_list_ == nullptr) {
+        WARN << "Domain list without a DNS server ignored: " << host << ENDL;
+        continue;
+      }
+      list_rules_.push_back(i);
+      keep_best(list_best_, ranks_[i]);
+      continue;
+    }
+
+    if (regexes_.Add(host.substr(1, host.size() - 2)) !=
+        CrRegexSet::kUnsupported) {
+      regex_rules_.push_back(i);
+      keep_best(regex_best_, ranks_[i]);
+      continue;
+    }
 
-  auto regex_rules_list = digest_map_[CrappyHosts::kRegexRuleKey];
-  for (const auto& rule : regex_rules_list) {
-    candidate_rules.push(rule);
+    for (int kind = 0; kind < kKindMax; ++kind) {
+      if (ranks_[i][kind] != kNoRank)
+        scan_rules_[kind].push_back(ranks_[i][kind]);
+    }
   }
 
-  for (const auto& digest_pair : digest_map_) {
-    if (hostname.find(digest_pair.first) != std::string::npos) {
-      for (const auto& rule : digest_pair.second) {
-        candidate_rules.push(rule);
+  // Rules starting with a wildcard are alive at every byte, DFA of them
+  // grows with the square of their number at least, so they go in small
+  // groups of their own
+  auto anchored = std::stable_partition(
+      wildcards.begin(), wildcards.end(), [this](uint32_t rule) {
+        char head = rules_[rule]->Host().front();
+        return head != '*' && head != '?';
+      });
+  size_t anchored_count = anchored - wildcards.begin();
+  std::vector<std::pair<size_t, size_t>> groups;
+  if (anchored_count != 0)
+    groups.push_back(std::make_pair(0, anchored_count));
+  for (size_t i = anchored_count; i < wildcards.size();
+       i += kUnanchoredGroupSize) {
+    groups.push_back(std::make_pair(
+        i, std::min(kUnanchoredGroupSize, wildcards.size() - i)));
+  }
+  // Groups are compiled on threads of their own and joined in order
+  std::vector<std::vector<CrWildcardDFA>> group_dfas(groups.size());
+  std::vector<std::vector<uint32_t>> unfit(groups.size());
+  ParallelFor(groups.size(), [&](size_t group) {
+    CompileWildcards(wildcards.data() + groups[group].first,
+                     groups[group].second, group_dfas[group], unfit[group]);
+  });
+  for (size_t group = 0; group < groups.size(); ++group) {
+    for (auto& dfa : group_dfas[group]) {
+      wildcards_.push_back(std::move(dfa));
+    }
+    for (uint32_t rule : unfit[group]) {
+      for (int kind = 0; kind < kKindMax; ++kind) {
+        if (ranks_[rule][kind] != kNoRank)
+          scan_rules_[kind].push_back(ranks_[rule][kind]);
       }
     }
   }
+  regexes_.Build();
+  for (int kind = 0; kind < kKindMax; ++kind) {
+    std::sort(scan_rules_[kind].begin(), scan_rules_[kind].end());
+  }
 
-  while (!candidate_rules.empty()) {
-    auto rule = candidate_rules.top();
-    if (rule->Match(hostname, type)) {
-      return rule;
+  std::sort(list_rules_.begin(), list_rules_.end(),
+            [this](uint32_t lhs, uint32_t rhs) {
+              return ranks_[lhs][kKindA] < ranks_[rhs][kKindA];
+            });
+  for (uint32_t i = 0; i < list_rules_.size(); ++i) {
+    std::string path = rules_[list_rules_[i]]->Host().substr(1);
+    if (path.front() != '/')
+      path = dir + path;
+    if (domains_.LoadFile(path.c_str(), i) < 0) {
+      ERR << "Failed to open domain list " << path << ENDL;
+      return false;
     }
-    candidate_rules.pop();
+  }
+  domains_.Build();
+  SyncTables();
+  if (!list_rules_.empty()) {
+    INFO << "[Hosts] " << domains_.Size() << " domains in "
+         << list_rules_.size() << " lists, " << domains_.Bytes() << " bytes"
+         << ENDL;
+  }
+  return true;
+}
+
+void CrappyHosts::CompileWildcards(const uint32_t* rules,
+                                   size_t count,
+                                   std::vector<CrWildcardDFA>& dfas,
+                                   std::vector<uint32_t>& unfit) const {
+  CrWildcardDFA wildcard(kKindMax);
+  for (size_t i = 0; i < count; ++i) {
+    wildcard.Add(rules_[rules[i]]->Host(), ranks_[rules[i]].data());
+  }
+  if (wildcard.Build()) {
+    dfas.push_back(std::move(wildcard));
+    return;
   }
 
-  return nullptr;
+  // Subset construction may blow up on rules like *a*b*c, split them until
+  // DFAs fit, a single rule too big is checked by itself
+  if (count == 1) {
+    unfit.push_back(rules[0]);
+    return;
+  }
+  CompileWildcards(rules, count / 2, dfas, unfit);
+  CompileWildcards(rules + count / 2, count - count / 2, dfas, unfit);
+}
+
+void CrappyHosts::SyncTables() {
+  image_.Unmap();
+  tables_.ranks = MakeTable(ranks_);
+  tables_.node_ranks = MakeTable(node_ranks_);
+  tables_.regex_rules = MakeTable(regex_rules_);
+  tables_.list_rules = MakeTable(list_rules_);
+  for (int kind = 0; kind < kKindMax; ++kind) {
+    tables_.ranked[kind] = MakeTable(ranked_[kind]);
+    tables_.scan_rules[kind] = MakeTable(scan_rules_[kind]);
+  }
 }
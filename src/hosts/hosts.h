@@ -20,30 +20,192 @@
 #ifndef _CR_HOSTS_H_
 #define _CR_HOSTS_H_
 
+#include <array>
+#include <atomic>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
 #include "../crappydns.h"
+#include "../image.h"
+#include "../qname.h"
+#include "blocklist.h"
+#include "domain_list.h"
+#include "label_trie.h"
+#include "regex_set.h"
 #include "rule.h"
+#include "wildcard_dfa.h"
 
 class CrappyHosts {
  public:
-  CrappyHosts() : dns_server_list_(), digest_map_(){};
+  CrappyHosts()
+      : generation_(++next_generation_),
+        dns_server_list_(),
+        dns_server_specs_(),
+        rules_(),
+        ranks_(),
+        ranked_(),
+        trie_(),
+        node_ranks_(),
+        wildcards_(),
+        regexes_(),
+        regex_rules_(),
+        regex_best_(),
+        domains_(),
+        list_rules_(),
+        list_best_(),
+        scan_rules_(),
+        tables_(),
+        image_(),
+        rule_records_(),
+        strings_(),
+        addresses_(),
+        rules_mutex_(){};
   ~CrappyHosts(){};
+  // Tables may point into a mapped image
+  CrappyHosts(const CrappyHosts&) = delete;
+  CrappyHosts& operator=(const CrappyHosts&) = delete;
 
   static CrPacket AssemblePacket(
       std::shared_ptr<u8_vec> request,
       std::list<std::shared_ptr<struct sockaddr_storage>> address_list);
 
+  // Loads hosts file, or a binary image of one written by SaveImage, which
+  // maps what a hosts file is compiled into without parsing it
   int LoadFile(const char* path);
-  std::shared_ptr<const HostsRule> Match(std::string, uint16_t);
+  int SaveImage(const char* path) const;
+  // Matches every rule, which may take long with a pathological regex, so
+  // event loops go through MatchInline
+  std::shared_ptr<const HostsRule> Match(const CrQName&, uint16_t) const;
+  // Matches leaving out rules that are scanned one by one, regexes
+  // std::regex takes and wildcards too large for a DFA, since nothing bounds
+  // how long they take. Returns false if one of them could still win, Match
+  // has to run off the loop then.
+  bool MatchInline(const CrQName& hostname,
+                   uint16_t type,
+                   std::shared_ptr<const HostsRule>& rule) const;
+  // Unique to every instance, tells memos of Match when hosts are replaced
+  uint64_t Generation() const { return generation_; }
+  // Checked before Match, a blocked name is never matched
+  const CrBlocklist& Blocklist() const { return blocklist_; }
 
  private:
-  static const std::string kRegexRuleKey;
+  // Rules compete by priority, then by type, then by number of addresses
+  // of the queried type, and by order in file at last. Every rule is ranked
+  // for each kind of query once loaded, the matching rule with the lowest
+  // rank wins. Only A and AAAA queries are matched, others go upstream.
+  enum Kind { kKindA, kKindAAAA, kKindMax };
+  typedef std::array<uint32_t, kKindMax> Ranks;
+  static const uint32_t kNoRank = UINT32_MAX;
+
+  // Ranks of rules which a trie node stands for
+  struct NodeRanks {
+    // Raw rules of the domain itself
+    Ranks exact;
+    // Wildcard rules in form of *.domain
+    Ranks subdomain;
+  };
+
+  // Match goes through tables, which point either to the vectors compiled
+  // from a hosts file, or into a mapped image
+  struct Tables {
+    CrTable<Ranks> ranks;
+    CrTable<uint32_t> ranked[kKindMax];
+    CrTable<NodeRanks> node_ranks;
+    CrTable<uint32_t> regex_rules;
+    CrTable<uint32_t> list_rules;
+    CrTable<uint32_t> scan_rules[kKindMax];
+  };
+
+  // Rules are kept in image as records, with their text in a string pool
+  struct RuleRecord {
+    uint8_t priority;
+    uint16_t group;
+    uint32_t host;
+    uint32_t host_size;
+    uint32_t address;
+    uint32_t address_count;
+  };
+  struct AddressRecord {
+    uint16_t family;
+    uint8_t bytes[16];
+  };
+  // Servers of a group are parsed again from its spec
+  struct GroupRecord {
+    uint32_t name;
+    uint32_t name_size;
+    uint32_t spec;
+    uint32_t spec_size;
+  };
+  static const uint16_t kNoGroup = UINT16_MAX;
+
+  static std::atomic<uint64_t> next_generation_;
+
+  uint64_t generation_;
+  CrBlocklist blocklist_;
   std::list<HostsRule::CrDNSServerNameListPair> dns_server_list_;
-  std::unordered_map<std::string, std::list<std::shared_ptr<const HostsRule>>>
-      digest_map_;
+  // Text each group of dns_server_list_ is parsed from
+  std::vector<std::string> dns_server_specs_;
+  // Rules of a mapped image are made from records on first use
+  mutable std::vector<std::shared_ptr<const HostsRule>> rules_;
+  // Rank of each rule, kNoRank if it does not apply to the kind
+  std::vector<Ranks> ranks_;
+  // Rules of each kind in order of rank
+  std::vector<uint32_t> ranked_[kKindMax];
+
+  CrLabelTrie trie_;
+  std::vector<NodeRanks> node_ranks_;
+  // Other wildcard rules, in more than one DFA only if one would be too big
+  std::vector<CrWildcardDFA> wildcards_;
+  // Regex rules, best rank among them for each kind
+  CrRegexSet regexes_;
+  std::vector<uint32_t> regex_rules_;
+  Ranks regex_best_;
+  // Domains of list rules, valued by order of the rule in list_rules_,
+  // which is the order of rank for every kind
+  CrDomainList domains_;
+  std::vector<uint32_t> list_rules_;
+  Ranks list_best_;
+  // Rules none of above can take, ranks in ascending order
+  std::vector<uint32_t> scan_rules_[kKindMax];
+  Tables tables_;
+
+  CrImage image_;
+  CrTable<RuleRecord> rule_records_;
+  CrTable<char> strings_;
+  CrTable<AddressRecord> addresses_;
+  mutable std::mutex rules_mutex_;
+
+  // kKindMax for a type no rule applies to
+  static Kind KindOf(uint16_t type);
+  std::shared_ptr<const HostsRule> Rule(uint32_t index) const;
+  // Rank of the best rule for hostname, kNoRank if none. With inline_only,
+  // deferred tells a scan rule was left out that could rank better.
+  uint32_t BestRank(const CrQName& hostname,
+                    uint16_t type,
+                    bool inline_only,
+                    bool& deferred) const;
+  std::string Text(uint32_t offset, uint32_t size) const {
+    return std::string(strings_.data + offset, size);
+  }
+  int LoadImage(int fd);
+  void ParseRules(const std::vector<std::string>& lines);
+  // Adds domain or list of the rest of a block rule, returns false if list
+  // can not be opened
+  bool AddBlockRule(CrBlocklist::Action action,
+                    const char* target,
+                    const std::string& dir);
+  // Paths of domain lists are relative to dir, returns false if one of them
+  // can not be opened
+  bool Compile(const std::string& dir);
+  // Rules no DFA can take go to unfit
+  void CompileWildcards(const uint32_t* rules,
+                        size_t count,
+                        std::vector<CrWildcardDFA>& dfas,
+                        std::vector<uint32_t>& unfit) const;
+  void SyncTables();
 };
 
 #endif
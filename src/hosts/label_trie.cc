@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "label_trie.h"
+
+#include <cstring>
+
+const size_t CrLabelTrie::kImageTables;
+
+CrLabelTrie::CrLabelTrie()
+    : edges_(),
+      labels_(),
+      node_count_(1),
+      edge_count_(0),
+      edge_table_(),
+      label_table_() {}
+
+uint32_t CrLabelTrie::Insert(const CrQName& name) {
+  uint32_t node = kRoot;
+  for (size_t index = name.LabelCount(); index-- > 0;) {
+    const char* label = name.Suffix(index);
+    size_t size = name.LabelSize(index);
+    uint32_t child = Find(node, label, size);
+    if (child == kRoot) {
+      // Keep load factor under a half
+      if ((edge_count_ + 1) * 2 > edges_.size())
+        Grow();
+      child = node_count_++;
+      size_t mask = edges_.size() - 1;
+      size_t slot = Hash(node, label, size) & mask;
+      while (edges_[slot].child != kRoot)
+        slot = (slot + 1) & mask;
+      edges_[slot] =
+          Edge{node, child, (uint32_t)labels_.size(), (uint32_t)size};
+      labels_.insert(labels_.end(), label, label + size);
+      label_table_ = MakeTable(labels_);
+      ++edge_count_;
+    }
+    node = child;
+  }
+  return node;
+}
+
+size_t CrLabelTrie::Hash(uint32_t parent, const char* label, size_t size) {
+  // FNV-1a, labels are short
+  uint64_t hash = 14695981039346656037ull ^ parent;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ (uint8_t)label[i]) * 1099511628211ull;
+  }
+  return (size_t)(hash ^ (hash >> 32));
+}
+
+uint32_t CrLabelTrie::Find(uint32_t parent,
+                           const char* label,
+                           size_t size) const {
+  if (edge_table_.empty())
+    return kRoot;
+
+  size_t mask = edge_table_.size - 1;
+  for (size_t slot = Hash(parent, label, size) & mask;
+       edge_table_[slot].child != kRoot; slot = (slot + 1) & mask) {
+    const Edge& edge = edge_table_[slot];
+    if (edge.parent == parent && edge.size == size &&
+        ::memcmp(label_table_.data + edge.label, label, size) == 0)
+      return edge.child;
+  }
+  return kRoot;
+}
+
+void CrLabelTrie::Grow() {
+  std::vector<Edge> edges(edges_.empty() ? 16 : edges_.size() * 2, Edge{});
+  size_t mask = edges.size() - 1;
+  for (const auto& edge : edges_) {
+    if (edge.child == kRoot)
+      continue;
+    size_t slot =
+        Hash(edge.parent, labels_.data() + edge.label, edge.size) & mask;
+    while (edges[slot].child != kRoot)
+      slot = (slot + 1) & mask;
+    edges[slot] = edge;
+  }
+  edges_.swap(edges);
+  edge_table_ = MakeTable(edges_);
+}
+
+void CrLabelTrie::Save(CrImageWriter& writer) const {
+  writer.Add(edge_table_);
+  writer.Add(label_table_);
+  writer.Add(&node_count_, 1);
+}
+
+bool CrLabelTrie::Map(const CrImage& image, size_t index) {
+  CrTable<Edge> edges;
+  CrTable<char> labels;
+  CrTable<uint32_t> node_count;
+  if (!image.Get(index, edges) || !image.Get(index + 1, labels) ||
+      !image.Get(index + 2, node_count) || node_count.size != 1 ||
+      (edges.size & (edges.size - 1)) != 0)
+    return false;
+
+  *this = CrLabelTrie();
+  edge_table_ = edges;
+  label_table_ = labels;
+  node_count_ = node_count[0];
+  edge_count_ = node_count_ - 1;
+  return true;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_LABEL_TRIE_H_
+#define _CR_HOSTS_LABEL_TRIE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../image.h"
+#include "../qname.h"
+
+// Trie over labels of domain names, walked from the last label, so every
+// node stands for a domain and its children for its subdomains. Nodes are
+// plain ids, owner keeps what a node carries in its own arrays. Edges live
+// in one open addressing table keyed by parent and label, a step of walk is
+// a hash probe and a short compare.
+class CrLabelTrie {
+ public:
+  static const uint32_t kRoot = 0;
+
+  static const size_t kImageTables = 3;
+
+  CrLabelTrie();
+  // Tables may point into a mapped image
+  CrLabelTrie(const CrLabelTrie&) = delete;
+  CrLabelTrie& operator=(const CrLabelTrie&) = delete;
+  CrLabelTrie(CrLabelTrie&&) = default;
+  CrLabelTrie& operator=(CrLabelTrie&&) = default;
+
+  // Adds labels of name which are not in trie yet, returns node of name
+  uint32_t Insert(const CrQName& name);
+  // Number of nodes, including root
+  size_t Size() const { return node_count_; }
+
+  // Calls fn(node, index) for every node on the path of name, where index
+  // is the label suffix of the node starts with, until trie ends
+  template <class Fn>
+  void Walk(const CrQName& name, Fn fn) const;
+
+  // Adds kImageTables tables to writer. A trie mapped from image by Map
+  // takes tables from index on and can not be inserted into any more.
+  void Save(CrImageWriter& writer) const;
+  bool Map(const CrImage& image, size_t index);
+
+ private:
+  struct Edge {
+    uint32_t parent;
+    // kRoot for an empty slot, root is never a child
+    uint32_t child;
+    uint32_t label;
+    uint32_t size;
+  };
+
+  std::vector<Edge> edges_;
+  // Text of labels on edges
+  std::vector<char> labels_;
+  uint32_t node_count_;
+  size_t edge_count_;
+  // Lookup goes through these, over the vectors or into an image
+  CrTable<Edge> edge_table_;
+  CrTable<char> label_table_;
+
+  static size_t Hash(uint32_t parent, const char* label, size_t size);
+  uint32_t Find(uint32_t parent, const char* label, size_t size) const;
+  void Grow();
+};
+
+template <class Fn>
+void CrLabelTrie::Walk(const CrQName& name, Fn fn) const {
+  uint32_t node = kRoot;
+  for (size_t index = name.LabelCount(); index-- > 0;) {
+    node = Find(node, name.Suffix(index), name.LabelSize(index));
+    if (node == kRoot)
+      return;
+    fn(node, index);
+  }
+}
+
+#endif
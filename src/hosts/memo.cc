@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memo.h"
+
+#include <utility>
+
+#include "hosts.h"
+
+CrHostsMemo::CrHostsMemo(size_t slots)
+    : mask_(0),
+      generation_(0),
+      slots_(),
+      hits_(0),
+      misses_(0),
+      deferred_(0) {
+  // Round up to a power of two so a pair is picked by mask
+  size_t size = 2;
+  while (size < slots)
+    size <<= 1;
+  mask_ = size - 2;
+  slots_.resize(size);
+  Reset(0);
+}
+
+bool CrHostsMemo::Match(const CrappyHosts& hosts,
+                        const CrQName& name,
+                        uint16_t type,
+                        std::shared_ptr<const HostsRule>& rule) {
+  if (hosts.Generation() != generation_)
+    Reset(hosts.Generation());
+
+  uint64_t hash = Hash(name, type);
+  Slot* pair = &slots_[(hash ^ (hash >> 32)) & mask_];
+  if (Holds(pair[0], hash, name, type)) {
+    ++hits_;
+    rule = pair[0].rule;
+    return true;
+  }
+  // The first slot of a pair is always the one used more recently
+  std::swap(pair[0], pair[1]);
+  if (Holds(pair[0], hash, name, type)) {
+    ++hits_;
+    rule = pair[0].rule;
+    return true;
+  }
+
+  ++misses_;
+  if (!hosts.MatchInline(name, type, rule)) {
+    ++deferred_;
+    return false;
+  }
+  Fill(pair[0], hash, name, type, rule);
+  return true;
+}
+
+void CrHostsMemo::Put(const CrappyHosts& hosts,
+                      const CrQName& name,
+                      uint16_t type,
+                      std::shared_ptr<const HostsRule> rule) {
+  // Hosts may have been replaced while it was matched off the loop
+  if (hosts.Generation() != generation_)
+    return;
+
+  uint64_t hash = Hash(name, type);
+  Slot* pair = &slots_[(hash ^ (hash >> 32)) & mask_];
+  if (!Holds(pair[0], hash, name, type))
+    std::swap(pair[0], pair[1]);
+  Fill(pair[0], hash, name, type, std::move(rule));
+}
+
+void CrHostsMemo::Fill(Slot& slot,
+                       uint64_t hash,
+                       const CrQName& name,
+                       uint16_t type,
+                       std::shared_ptr<const HostsRule> rule) {
+  slot.used = true;
+  slot.type = type;
+  slot.hash = hash;
+  // Keeps capacity of the string, so a slot reaches the heap rarely
+  slot.name.assign(name.Text(), name.Size());
+  slot.rule = std::move(rule);
+}
+
+void CrHostsMemo::Reset(uint64_t generation) {
+  generation_ = generation;
+  // Drop rules of the old hosts as well, they are not kept alive by memo
+  for (auto& slot : slots_) {
+    slot.used = false;
+    slot.rule = nullptr;
+  }
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_MEMO_H_
+#define _CR_HOSTS_MEMO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../qname.h"
+
+class CrappyHosts;
+class HostsRule;
+
+// Bounded memo of what CrappyHosts::Match returns, misses included. The
+// result only depends on name and type, so it is kept until the hosts it
+// came from are replaced, which is told by their generation. Every name
+// hashes to a pair of slots, a new entry takes the place of the one used
+// less recently. Not thread safe, every loop keeps its own.
+class CrHostsMemo {
+ public:
+  static const size_t kSlots = 4096;
+
+  explicit CrHostsMemo(size_t slots = kSlots);
+  ~CrHostsMemo() {}
+
+  // Returns false if hosts has to match name off the loop, Put the result
+  // once it is in
+  bool Match(const CrappyHosts& hosts,
+             const CrQName& name,
+             uint16_t type,
+             std::shared_ptr<const HostsRule>& rule);
+  void Put(const CrappyHosts& hosts,
+           const CrQName& name,
+           uint16_t type,
+           std::shared_ptr<const HostsRule> rule);
+
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+  uint64_t Deferred() const { return deferred_; }
+
+ private:
+  struct Slot {
+    bool used;
+    uint16_t type;
+    uint64_t hash;
+    std::string name;
+    std::shared_ptr<const HostsRule> rule;
+  };
+
+  // Picks the first slot of a pair
+  size_t mask_;
+  uint64_t generation_;
+  std::vector<Slot> slots_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t deferred_;
+
+  static uint64_t Hash(const CrQName& name, uint16_t type) {
+    // Mix type in so A and AAAA of a name do not fight for one slot
+    return name.Hash() ^ ((uint64_t)type * 0x9e3779b97f4a7c15ull);
+  }
+  static bool Holds(const Slot& slot,
+                    uint64_t hash,
+                    const CrQName& name,
+                    uint16_t type) {
+    return slot.used && slot.hash == hash && slot.type == type &&
+           slot.name.size() == name.Size() &&
+           ::memcmp(slot.name.data(), name.Text(), name.Size()) == 0;
+  }
+  void Fill(Slot& slot,
+            uint64_t hash,
+            const CrQName& name,
+            uint16_t type,
+            std::shared_ptr<const HostsRule> rule);
+  void Reset(uint64_t generation);
+};
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "regex_set.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+const int CrRegexSet::kUnsupported;
+const size_t CrRegexSet::kCacheBytes;
+const uint32_t CrRegexSet::kStart;
+const uint32_t CrRegexSet::kDead;
+const uint32_t CrRegexSet::kUnknown;
+std::atomic<uint64_t> CrRegexSet::next_serial_(0);
+
+// Nodes one regex may take, {m,n} copies what it repeats
+static const size_t kMaxNodes = 1 << 14;
+static const int kMaxDepth = 128;
+static const int kNoLimit = -1;
+
+// Syntax tree of a regex
+struct CrRegexSet::Tree {
+  enum class Kind { kEmpty, kSet, kBegin, kEnd, kConcat, kAlternate, kRepeat };
+
+  Kind kind;
+  ByteSet set;
+  int min;
+  int max;
+  std::vector<Tree> children;
+
+  explicit Tree(Kind kind = Kind::kEmpty)
+      : kind(kind), set(), min(0), max(0), children() {}
+};
+
+// Recursive descent parser of the ECMAScript grammar std::regex defaults
+// to, fails on anything it does not know
+class CrRegexSet::Parser {
+ public:
+  explicit Parser(const std::string& regex) : text_(regex), pos_(0) {}
+
+  bool Parse(Tree& tree) {
+    return Alternate(tree, 0) && pos_ == text_.size();
+  }
+
+ private:
+  const std::string& text_;
+  size_t pos_;
+
+  bool More() const { return pos_ < text_.size(); }
+  char Peek() const { return text_[pos_]; }
+
+  bool Alternate(Tree& tree, int depth);
+  bool Concat(Tree& tree, int depth);
+  bool Repeat(Tree& tree, int depth);
+  bool Atom(Tree& tree, int depth);
+  bool Class(ByteSet& set);
+  bool Escape(ByteSet& set, bool in_class);
+  bool Number(int& number);
+};
+
+bool CrRegexSet::Parser::Alternate(Tree& tree, int depth) {
+  if (depth > kMaxDepth)
+    return false;
+
+  Tree branch;
+  if (!Concat(branch, depth))
+    return false;
+  if (!More() || Peek() != '|') {
+    tree = std::move(branch);
+    return true;
+  }
+  tree = Tree(Tree::Kind::kAlternate);
+  tree.children.push_back(std::move(branch));
+  while (More() && Peek() == '|') {
+    ++pos_;
+    if (!Concat(branch, depth))
+      return false;
+    tree.children.push_back(std::move(branch));
+  }
+  return true;
+}
+
+bool CrRegexSet::Parser::Concat(Tree& tree, int depth) {
+  tree = Tree(Tree::Kind::kConcat);
+  while (More() && Peek() != '|' && Peek() != ')') {
+    Tree item;
+    if (!Repeat(item, depth))
+      return false;
+    tree.children.push_back(std::move(item));
+  }
+  if (tree.children.empty())
+    tree = Tree();
+  return true;
+}
+
+bool CrRegexSet::Parser::Number(int& number) {
+  size_t begin = pos_;
+  number = 0;
+  while (More() && Peek() >= '0' && Peek() <= '9') {
+    number = number * 10 + (Peek() - '0');
+    if (number > (int)kMaxNodes)
+      return false;
+    ++pos_;
+  }
+  return pos_ != begin;
+}
+
+bool CrRegexSet::Parser::Repeat(Tree& tree, int depth) {
+  if (!Atom(tree, depth))
+    return false;
+  if (!More())
+    return true;
+
+  int min, max;
+  switch (Peek()) {
+    case '*':
+      min = 0, max = kNoLimit;
+      break;
+    case '+':
+      min = 1, max = kNoLimit;
+      break;
+    case '?':
+      min = 0, max = 1;
+      break;
+    case '{':
+      ++pos_;
+      if (!Number(min))
+        return false;
+      max = min;
+      if (More() && Peek() == ',') {
+        ++pos_;
+        max = kNoLimit;
+        if (More() && Peek() != '}' && (!Number(max) || max < min))
+          return false;
+      }
+      if (!More() || Peek() != '}')
+        return false;
+      break;
+    default:
+      return true;
+  }
+  ++pos_;
+  // Laziness only changes what is captured, never whether a name matches
+  if (More() && Peek() == '?')
+    ++pos_;
+  if (tree.kind == Tree::Kind::kBegin || tree.kind == Tree::Kind::kEnd)
+    return false;
+
+  Tree repeat(Tree::Kind::kRepeat);
+  repeat.min = min;
+  repeat.max = max;
+  repeat.children.push_back(std::move(tree));
+  tree = std::move(repeat);
+  // Quantifier of quantifier is an error
+  return !More() || (Peek() != '*' && Peek() != '+' && Peek() != '?' &&
+                     Peek() != '{');
+}
+
+bool CrRegexSet::Parser::Atom(Tree& tree, int depth) {
+  char c = Peek();
+  ++pos_;
+  switch (c) {
+    case '(':
+      if (More() && Peek() == '?') {
+        // Only non-capturing groups, no lookaheads
+        if (pos_ + 1 >= text_.size() || text_[pos_ + 1] != ':')
+          return false;
+        pos_ += 2;
+      }
+      if (!Alternate(tree, depth + 1) || !More() || Peek() != ')')
+        return false;
+      ++pos_;
+      return true;
+    case '[':
+      tree = Tree(Tree::Kind::kSet);
+      return Class(tree.set);
+    case '.':
+      tree = Tree(Tree::Kind::kSet);
+      tree.set.set();
+      tree.set.reset('\n');
+      tree.set.reset('\r');
+      return true;
+    case '^':
+      tree = Tree(Tree::Kind::kBegin);
+      return true;
+    case '$':
+      tree = Tree(Tree::Kind::kEnd);
+      return true;
+    case '\\':
+      tree = Tree(Tree::Kind::kSet);
+      return Escape(tree.set, false);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '}':
+    case ']':
+      return false;
+    default:
+      tree = Tree(Tree::Kind::kSet);
+      tree.set.set((uint8_t)c);
+      return true;
+  }
+}
+
+bool CrRegexSet::Parser::Class(ByteSet& set) {
+  bool negate = More() && Peek() == '^';
+  if (negate)
+    ++pos_;
+  // [] and [^] mean nothing and anything, too rare to bother
+  if (More() && Peek() == ']')
+    return false;
+
+  while (More() && Peek() != ']') {
+    ByteSet item;
+    bool single = true;
+    uint8_t low = (uint8_t)Peek();
+    if (Peek() == '\\') {
+      ++pos_;
+      if (!More() || !Escape(item, true))
+        return false;
+      // Only an escape of a single byte may start a range, not \d or \w
+      single = item.count() == 1;
+      for (int b = 0; single && b < 256; ++b) {
+        if (item[b])
+          low = (uint8_t)b;
+      }
+    } else {
+      item.set(low);
+      ++pos_;
+    }
+
+    if (pos_ + 1 < text_.size() && Peek() == '-' && text_[pos_ + 1] != ']') {
+      ++pos_;
+      uint8_t high = (uint8_t)Peek();
+      if (Peek() == '\\') {
+        ByteSet end;
+        ++pos_;
+        if (!More() || !Escape(end, true) || end.count() != 1)
+          return false;
+        for (int b = 0; b < 256; ++b) {
+          if (end[b])
+            high = (uint8_t)b;
+        }
+      } else {
+        ++pos_;
+      }
+      if (!single || low > high)
+        return false;
+      for (int b = low; b <= high; ++b) {
+        item.set(b);
+      }
+    }
+    set |= item;
+  }
+  if (!More())
+    return false;
+  ++pos_;
+  if (negate)
+    set.flip();
+  return true;
+}
+
+bool CrRegexSet::Parser::Escape(ByteSet& set, bool in_class) {
+  char c = Peek();
+  ++pos_;
+  auto range = [&set](char low, char high) {
+    for (int b = low; b <= high; ++b) {
+      set.set(b);
+    }
+  };
+  switch (c) {
+    case 'd':
+    case 'D':
+      range('0', '9');
+      break;
+    case 'w':
+    case 'W':
+      range('a', 'z');
+      range('A', 'Z');
+      range('0', '9');
+      set.set('_');
+      break;
+    case 's':
+    case 'S':
+      for (char b : std::string(" \t\n\v\f\r")) {
+        set.set((uint8_t)b);
+      }
+      break;
+    case 'n':
+      set.set('\n');
+      return true;
+    case 't':
+      set.set('\t');
+      return true;
+    case 'r':
+      set.set('\r');
+      return true;
+    case 'f':
+      set.set('\f');
+      return true;
+    case 'v':
+      set.set('\v');
+      return true;
+    case 'b':
+      // Backspace in a class, word boundary out of it
+      if (!in_class)
+        return false;
+      set.set('\b');
+      return true;
+    case '0':
+      if (More() && Peek() >= '0' && Peek() <= '9')
+        return false;
+      set.set(0);
+      return true;
+    case 'x': {
+      if (pos_ + 2 > text_.size() || !isxdigit(text_[pos_]) ||
+          !isxdigit(text_[pos_ + 1]))
+        return false;
+      set.set(std::stoi(text_.substr(pos_, 2), nullptr, 16));
+      pos_ += 2;
+      return true;
+    }
+    default:
+      // Backreferences, \B, \c, \u and friends are out of reach
+      if (isalnum((uint8_t)c))
+        return false;
+      set.set((uint8_t)c);
+      return true;
+  }
+  if (isupper((uint8_t)c))
+    set.flip();
+  return true;
+}
+
+size_t CrRegexSet::NodesHash::operator()(
+    const std::vector<uint32_t>& nodes) const {
+  uint64_t hash = 14695981039346656037ull;
+  for (uint32_t node : nodes) {
+    hash = (hash ^ node) * 1099511628211ull;
+  }
+  return (size_t)(hash ^ (hash >> 32));
+}
+
+CrRegexSet::CrRegexSet(size_t cache_bytes)
+    : cache_bytes_(cache_bytes),
+      nodes_(),
+      sets_(),
+      starts_(),
+      class_count_(1),
+      samples_(),
+      empty_matches_(),
+      serial_(0) {
+  ::memset(class_, 0, sizeof(class_));
+}
+
+int CrRegexSet::Add(const std::string& regex) {
+  Tree tree;
+  if (!Parser(regex).Parse(tree))
+    return kUnsupported;
+
+  size_t node_count = nodes_.size();
+  size_t set_count = sets_.size();
+  uint32_t id = (uint32_t)starts_.size();
+  nodes_.push_back(Node{NodeType::kMatch, 0, id});
+  uint32_t start = Emit(tree, (uint32_t)nodes_.size() - 1, node_count);
+  if (start == kUnknown) {
+    nodes_.resize(node_count);
+    sets_.resize(set_count);
+    return kUnsupported;
+  }
+  starts_.push_back(start);
+  return (int)id;
+}
+
+void CrRegexSet::Clear() {
+  nodes_.clear();
+  sets_.clear();
+  starts_.clear();
+  Build();
+}
+
+uint32_t CrRegexSet::Emit(const Tree& tree, uint32_t next, size_t base) {
+  // NFA is built from the end, each piece is given where it goes after
+  if (next == kUnknown || nodes_.size() - base > kMaxNodes)
+    return kUnknown;
+
+  switch (tree.kind) {
+    case Tree::Kind::kEmpty:
+      return next;
+    case Tree::Kind::kSet:
+      sets_.push_back(tree.set);
+      nodes_.push_back(Node{NodeType::kByte, next, (uint32_t)sets_.size() - 1});
+      return (uint32_t)nodes_.size() - 1;
+    case Tree::Kind::kBegin:
+      nodes_.push_back(Node{NodeType::kBegin, next, 0});
+      return (uint32_t)nodes_.size() - 1;
+    case Tree::Kind::kEnd:
+      nodes_.push_back(Node{NodeType::kEnd, next, 0});
+      return (uint32_t)nodes_.size() - 1;
+    case Tree::Kind::kConcat:
+      for (auto it = tree.children.rbegin(); it != tree.children.rend(); ++it) {
+        next = Emit(*it, next, base);
+      }
+      return next;
+    case Tree::Kind::kAlternate: {
+      uint32_t entry = Emit(tree.children.back(), next, base);
+      for (size_t i = tree.children.size() - 1; i-- > 0;) {
+        uint32_t branch = Emit(tree.children[i], next, base);
+        if (branch == kUnknown || entry == kUnknown)
+          return kUnknown;
+        nodes_.push_back(Node{NodeType::kSplit, branch, entry});
+        entry = (uint32_t)nodes_.size() - 1;
+      }
+      return entry;
+    }
+    case Tree::Kind::kRepeat:
+    default: {
+      const Tree& child = tree.children.front();
+      uint32_t entry = next;
+      if (tree.max == kNoLimit) {
+        nodes_.push_back(Node{NodeType::kSplit, kUnknown, next});
+        entry = (uint32_t)nodes_.size() - 1;
+        uint32_t body = Emit(child, entry, base);
+        if (body == kUnknown)
+          return kUnknown;
+        nodes_[entry].out = body;
+      } else {
+        for (int i = tree.min; i < tree.max; ++i) {
+          uint32_t body = Emit(child, entry, base);
+          if (body == kUnknown)
+            return kUnknown;
+          nodes_.push_back(Node{NodeType::kSplit, body, next});
+          entry = (uint32_t)nodes_.size() - 1;
+        }
+      }
+      for (int i = 0; i < tree.min; ++i) {
+        entry = Emit(child, entry, base);
+      }
+      return entry;
+    }
+  }
+}
+
+void CrRegexSet::Build() {
+  // Bytes are in one class if every byte set treats them the same
+  std::map<std::vector<bool>, uint8_t> signatures;
+  samples_.clear();
+  for (int c = 0; c < 256; ++c) {
+    std::vector<bool> signature;
+    for (const auto& set : sets_) {
+      signature.push_back(set[c]);
+    }
+    auto it = signatures.find(signature);
+    if (it == signatures.end()) {
+      it = signatures.insert({signature, (uint8_t)samples_.size()}).first;
+      samples_.push_back((uint8_t)c);
+    }
+    class_[c] = it->second;
+  }
+  class_count_ = samples_.size();
+  serial_ = ++next_serial_;
+
+  // Empty text is where both ^ and $ hold, states never know that
+  Cache cache{0, {}, {}, 0, std::vector<uint32_t>(nodes_.size(), 0), 0};
+  std::vector<uint32_t> nodes;
+  NextGeneration(cache);
+  for (uint32_t start : starts_) {
+    Close(cache, start, true, true, nodes);
+  }
+  empty_matches_.clear();
+  for (uint32_t node : nodes) {
+    if (nodes_[node].type == NodeType::kMatch)
+      empty_matches_.push_back(nodes_[node].arg);
+  }
+  std::sort(empty_matches_.begin(), empty_matches_.end());
+}
+
+CrRegexSet::Cache& CrRegexSet::LocalCache() const {
+  static thread_local Cache cache{0, {}, {}, 0, {}, 0};
+  if (cache.owner != serial_) {
+    cache.owner = serial_;
+    cache.marks.assign(nodes_.size(), 0);
+    cache.generation = 0;
+    Reset(cache);
+  }
+  return cache;
+}
+
+void CrRegexSet::Close(Cache& cache,
+                       uint32_t node,
+                       bool begin,
+                       bool end,
+                       std::vector<uint32_t>& nodes) const {
+  std::vector<uint32_t> stack{node};
+  while (!stack.empty()) {
+    node = stack.back();
+    stack.pop_back();
+    if (cache.marks[node] == cache.generation)
+      continue;
+    cache.marks[node] = cache.generation;
+    const Node& current = nodes_[node];
+    switch (current.type) {
+      case NodeType::kSplit:
+        stack.push_back(current.arg);
+        stack.push_back(current.out);
+        break;
+      case NodeType::kBegin:
+        if (begin)
+          stack.push_back(current.out);
+        break;
+      case NodeType::kEnd:
+        if (end)
+          stack.push_back(current.out);
+        else
+          nodes.push_back(node);
+        break;
+      default:
+        nodes.push_back(node);
+        break;
+    }
+  }
+}
+
+void CrRegexSet::NextGeneration(Cache& cache) {
+  if (++cache.generation == 0) {
+    std::fill(cache.marks.begin(), cache.marks.end(), 0);
+    cache.generation = 1;
+  }
+}
+
+uint32_t CrRegexSet::Intern(Cache& cache, std::vector<uint32_t>& nodes) const {
+  std::sort(nodes.begin(), nodes.end());
+  auto it = cache.ids.find(nodes);
+  if (it != cache.ids.end())
+    return it->second;
+
+  uint32_t id = (uint32_t)cache.states.size();
+  cache.bytes += sizeof(State) + class_count_ * sizeof(uint32_t) +
+                 nodes.size() * sizeof(uint32_t) * 2;
+  cache.ids.insert({nodes, id});
+  cache.states.push_back(State{std::move(nodes),
+                               std::vector<uint32_t>(class_count_, kUnknown),
+                               false, std::vector<uint32_t>()});
+  return id;
+}
+
+void CrRegexSet::Reset(Cache& cache) const {
+  cache.states.clear();
+  cache.ids.clear();
+  cache.bytes = 0;
+
+  std::vector<uint32_t> nodes;
+  NextGeneration(cache);
+  for (uint32_t start : starts_) {
+    Close(cache, start, true, false, nodes);
+  }
+  Intern(cache, nodes);
+  nodes.clear();
+  Intern(cache, nodes);
+}
+
+uint32_t CrRegexSet::Step(Cache& cache, uint32_t state, uint8_t c) const {
+  std::vector<uint32_t> nodes;
+  NextGeneration(cache);
+  for (uint32_t node : cache.states[state].nodes) {
+    const Node& current = nodes_[node];
+    if (current.type == NodeType::kByte && sets_[current.arg][samples_[c]])
+      Close(cache, current.out, false, false, nodes);
+  }
+
+  // Once the cache is full it starts over, the state stepped from is gone
+  // with it so the transition is not kept
+  if (cache.bytes > cache_bytes_) {
+    Reset(cache);
+    return Intern(cache, nodes);
+  }
+  uint32_t next = Intern(cache, nodes);
+  cache.states[state].next[c] = next;
+  return next;
+}
+
+const std::vector<uint32_t>& CrRegexSet::Finish(Cache& cache,
+                                                uint32_t state) const {
+  State& current = cache.states[state];
+  if (current.finished)
+    return current.matches;
+
+  std::vector<uint32_t> nodes;
+  NextGeneration(cache);
+  for (uint32_t node : current.nodes) {
+    if (nodes_[node].type == NodeType::kEnd)
+      Close(cache, nodes_[node].out, false, true, nodes);
+    else
+      nodes.push_back(node);
+  }
+  for (uint32_t node : nodes) {
+    if (nodes_[node].type == NodeType::kMatch)
+      current.matches.push_back(nodes_[node].arg);
+  }
+  std::sort(current.matches.begin(), current.matches.end());
+  current.matches.erase(
+      std::unique(current.matches.begin(), current.matches.end()),
+      current.matches.end());
+  current.finished = true;
+  return current.matches;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_REGEX_SET_H_
+#define _CR_HOSTS_REGEX_SET_H_
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Set of ECMAScript regexes matched against whole names all at once. They
+// are compiled into one NFA, and a DFA of it is built lazily while names are
+// matched, so a name costs one pass no matter how many regexes there are.
+// DFA states are cached up to a budget of memory, the cache starts over
+// once it is used up. Every thread keeps the cache of the set it matched
+// last, so matching never waits on other loops or workers sharing the set.
+class CrRegexSet {
+ public:
+  static const int kUnsupported = -1;
+  static const size_t kCacheBytes = 1 << 20;
+
+  explicit CrRegexSet(size_t cache_bytes = kCacheBytes);
+
+  // Returns id of regex, or kUnsupported if it uses what a DFA can not do,
+  // like backreferences, lookaheads or word boundaries, or is malformed.
+  // Regexes added after Build are not matched until it is called again.
+  int Add(const std::string& regex);
+  void Build();
+  void Clear();
+  size_t Size() const { return starts_.size(); }
+
+  // Calls fn(id) for every regex matching the whole text
+  template <class Fn>
+  void Match(const char* text, size_t size, Fn fn) const;
+
+ private:
+  enum class NodeType : uint8_t { kByte, kSplit, kBegin, kEnd, kMatch };
+  typedef std::bitset<256> ByteSet;
+  struct Tree;
+  class Parser;
+
+  struct Node {
+    NodeType type;
+    uint32_t out;
+    // Second way of kSplit, byte set of kByte, regex id of kMatch
+    uint32_t arg;
+  };
+
+  struct State {
+    // kByte, kEnd and kMatch nodes the state is in, in order
+    std::vector<uint32_t> nodes;
+    std::vector<uint32_t> next;
+    bool finished;
+    // Regexes matched if text ends in the state
+    std::vector<uint32_t> matches;
+  };
+
+  struct NodesHash {
+    size_t operator()(const std::vector<uint32_t>& nodes) const;
+  };
+
+  // DFA built so far by one thread, for the set with serial owner
+  struct Cache {
+    uint64_t owner;
+    std::vector<State> states;
+    std::unordered_map<std::vector<uint32_t>, uint32_t, NodesHash> ids;
+    size_t bytes;
+    // Nodes visited in current closure have the current generation
+    std::vector<uint32_t> marks;
+    uint32_t generation;
+  };
+
+  static const uint32_t kStart = 0;
+  static const uint32_t kDead = 1;
+  static const uint32_t kUnknown = UINT32_MAX;
+
+  size_t cache_bytes_;
+  std::vector<Node> nodes_;
+  std::vector<ByteSet> sets_;
+  std::vector<uint32_t> starts_;
+  size_t class_count_;
+  uint8_t class_[256];
+  std::vector<uint8_t> samples_;
+  std::vector<uint32_t> empty_matches_;
+  // Unique to every Build, tells caches of threads when the NFA is replaced
+  uint64_t serial_;
+  static std::atomic<uint64_t> next_serial_;
+
+  uint32_t Emit(const Tree& tree, uint32_t next, size_t base);
+  // Cache of the calling thread, started over if it was built for another
+  // set or an earlier Build
+  Cache& LocalCache() const;
+  void Close(Cache& cache,
+             uint32_t node,
+             bool begin,
+             bool end,
+             std::vector<uint32_t>& nodes) const;
+  static void NextGeneration(Cache& cache);
+  uint32_t Intern(Cache& cache, std::vector<uint32_t>& nodes) const;
+  void Reset(Cache& cache) const;
+  uint32_t Step(Cache& cache, uint32_t state, uint8_t c) const;
+  const std::vector<uint32_t>& Finish(Cache& cache, uint32_t state) const;
+};
+
+template <class Fn>
+void CrRegexSet::Match(const char* text, size_t size, Fn fn) const {
+  if (starts_.empty())
+    return;
+
+  if (size == 0) {
+    for (uint32_t id : empty_matches_) {
+      fn(id);
+    }
+    return;
+  }
+
+  Cache& cache = LocalCache();
+  uint32_t state = kStart;
+  for (size_t i = 0; i < size && state != kDead; ++i) {
+    uint8_t c = class_[(uint8_t)text[i]];
+    uint32_t next = cache.states[state].next[c];
+    state = next != kUnknown ? next : Step(cache, state, c);
+  }
+  for (uint32_t id : Finish(cache, state)) {
+    fn(id);
+  }
+}
+
+#endif
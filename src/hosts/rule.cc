@@ -24,14 +24,13 @@
 #include <arpa/nameser.h>
 
 #include "../crappydns.h"
-
-const std::regex HostsRule::kDigestRegex("[A-Za-z0-9-\\.]{3,}");
+#include "wildcard_dfa.h"
 
 enum class ParseState { kInit, kPriority, kIPSrvList, kHostname, kTerm };
 
 std::shared_ptr<const HostsRule> HostsRule::Parse(
     const char* raw_rule,
-    std::list<CrDNSServerNameListPair> dns_server_group_list) {
+    const std::list<CrDNSServerNameListPair>& dns_server_group_list) {
   ParseState fsm_state = ParseState::kInit;
 
   HostsRule::Priority priority = HostsRule::Priority::kNotDefined;
@@ -107,6 +106,7 @@ HostsRule::HostsRule(
       ipv4_list_(),
       ipv6_list_(),
       host_(hostname),
+      host_qname_(),
       host_regex_() {
   // set default priority
   if (priority_ == Priority::kNotDefined) {
@@ -130,47 +130,40 @@ HostsRule::HostsRule(
                   }
                 });
 
-  // set type and build regex
+  // set type and build regex, queried names are always in lower case
   if (host_.front() == '/' && host_.back() == '/' && host_.size() > 2) {
     type_ = Type::kRegex;
     host_regex_ = std::regex(host_.substr(1, host_.length() - 2));
+  } else if (host_.front() == '@' && host_.size() > 1) {
+    // Path of a domain list, loaded and matched by CrappyHosts
+    type_ = Type::kList;
   } else if (host_.find('*') != std::string::npos ||
              host_.find('?') != std::string::npos) {
     type_ = Type::kWildcard;
-    std::string regexp(host_);
-    regexp.insert(0, "^");
-    regexp.push_back('$');
-    regexp = std::regex_replace(regexp, std::regex("\\."), "\\.");
-    regexp = std::regex_replace(regexp, std::regex("\\?"), "[A-Za-z0-9-]+");
-    regexp = std::regex_replace(regexp, std::regex("\\*"), "[A-Za-z0-9-\\.]+");
-    host_regex_ = std::regex(regexp);
+    std::transform(host_.begin(), host_.end(), host_.begin(), ::tolower);
   } else {
     type_ = Type::kRaw;
+    std::transform(host_.begin(), host_.end(), host_.begin(), ::tolower);
+    if (!host_qname_.Assign(host_)) {
+      WARN << "Not a valid hostname in rule: " << host_ << ENDL;
+    }
   }
 }
 
-static bool match_comp(const std::smatch& lhs, const std::smatch& rhs) {
-  return lhs.str().length() < rhs.str().length();
-}
-
-std::string HostsRule::Digest() const {
-  if (type_ == Type::kRegex)
-    return std::string();
-  auto hosts_begin =
-      std::sregex_iterator(host_.begin(), host_.end(), HostsRule::kDigestRegex);
-  auto hosts_end = std::sregex_iterator();
-  return std::max_element(hosts_begin, hosts_end, match_comp)->str();
-}
-
-bool HostsRule::Match(std::string domain, uint16_t type) const {
+bool HostsRule::Match(const CrQName& domain, uint16_t type) const {
+  if ((type & addr_type_) != type && dns_server_list_ == nullptr)
+    return false;
   switch (type_) {
     case Type::kRaw:
-      return ((type & addr_type_) == type || dns_server_list_ != nullptr) &&
-             host_ == domain;
+      return host_qname_ == domain;
     case Type::kWildcard:
+      return CrWildcardDFA::Match(host_, domain.Text(), domain.Size());
+    case Type::kList:
+      // Domains of list are not kept in rule
+      return false;
     case Type::kRegex:
     default:
-      return ((type & addr_type_) == type || dns_server_list_ != nullptr) &&
-             std::regex_match(domain, host_regex_);
+      return std::regex_match(domain.Text(), domain.Text() + domain.Size(),
+                              host_regex_);
   }
 }
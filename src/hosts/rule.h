@@ -27,6 +27,8 @@
 
 #include <sys/socket.h>
 
+#include "../qname.h"
+
 struct CrDNSServer;
 
 class HostsRule {
@@ -35,7 +37,7 @@ class HostsRule {
   using CrDNSServerListPtr = std::shared_ptr<CrDNSServerList>;
   using CrDNSServerNameListPair = std::pair<std::string, CrDNSServerListPtr>;
 
-  enum class Type { kRaw, kWildcard, kRegex };
+  enum class Type { kRaw, kWildcard, kRegex, kList };
   enum class Priority {
     kNotDefined,
     kHigh,
@@ -60,15 +62,16 @@ class HostsRule {
 
   static std::shared_ptr<const HostsRule> Parse(
       const char*,
-      std::list<CrDNSServerNameListPair>);
+      const std::list<CrDNSServerNameListPair>&);
 
-  std::string Digest() const;
-  bool Match(std::string domain, uint16_t type) const;
+  const std::string& Host() const { return host_; }
+  const CrQName& HostQName() const { return host_qname_; }
+  bool Match(const CrQName& domain, uint16_t type) const;
 
  private:
-  static const std::regex kDigestRegex;
-
   std::string host_;
+  CrQName host_qname_;
+  // Only regex rules have one, wildcards are matched by CrWildcardDFA
   std::regex host_regex_;
 };
 
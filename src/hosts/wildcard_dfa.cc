@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "wildcard_dfa.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+const uint32_t CrWildcardDFA::kNone;
+const size_t CrWildcardDFA::kMaxStates;
+const size_t CrWildcardDFA::kImageTables;
+
+struct SetHash {
+  size_t operator()(const std::vector<uint32_t>& set) const {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t position : set) {
+      hash = (hash ^ position) * 1099511628211ull;
+    }
+    return (size_t)(hash ^ (hash >> 32));
+  }
+};
+
+CrWildcardDFA::CrWildcardDFA(size_t lanes)
+    : lanes_(lanes),
+      patterns_(),
+      values_(),
+      class_count_(1),
+      start_(0),
+      dead_(0),
+      state_count_(1),
+      next_(1, 0),
+      output_(lanes, kNone),
+      next_table_(MakeTable(next_)),
+      output_table_(MakeTable(output_)) {
+  ::memset(class_, 0, sizeof(class_));
+}
+
+CrWildcardDFA::Token CrWildcardDFA::TokenOf(char c) {
+  if (c == '?')
+    return Token::kLabel;
+  if (c == '*')
+    return Token::kName;
+  return Token::kLiteral;
+}
+
+bool CrWildcardDFA::Accepts(Token token, char literal, uint8_t c) {
+  switch (token) {
+    case Token::kLabel:
+      return InLabel(c);
+    case Token::kName:
+      return InName(c);
+    default:
+      return (uint8_t)literal == c;
+  }
+}
+
+bool CrWildcardDFA::Match(const std::string& pattern,
+                          const char* text,
+                          size_t size) {
+  // Position k means first k characters of pattern are matched, a wildcard
+  // right before k may take more bytes
+  size_t length = pattern.size();
+  std::vector<char> current(length + 1, 0), next(length + 1, 0);
+  current[0] = 1;
+  for (size_t i = 0; i < size; ++i) {
+    bool alive = false;
+    std::fill(next.begin(), next.end(), 0);
+    for (size_t k = 0; k <= length; ++k) {
+      if (!current[k])
+        continue;
+      uint8_t c = (uint8_t)text[i];
+      if (k < length && Accepts(TokenOf(pattern[k]), pattern[k], c))
+        next[k + 1] = alive = true;
+      if (k > 0 && TokenOf(pattern[k - 1]) != Token::kLiteral &&
+          Accepts(TokenOf(pattern[k - 1]), pattern[k - 1], c))
+        next[k] = alive = true;
+    }
+    if (!alive)
+      return false;
+    current.swap(next);
+  }
+  return current[length] != 0;
+}
+
+void CrWildcardDFA::Add(const std::string& pattern, const uint32_t* values) {
+  patterns_.push_back(pattern);
+  values_.insert(values_.end(), values, values + lanes_);
+}
+
+bool CrWildcardDFA::Build(size_t max_states) {
+  // Bytes are in one class if every pattern treats them the same
+  bool literal[256] = {};
+  for (const auto& pattern : patterns_) {
+    for (char c : pattern) {
+      literal[(uint8_t)c] = TokenOf(c) == Token::kLiteral;
+    }
+  }
+  std::map<std::vector<int>, uint8_t> signatures;
+  std::vector<uint8_t> samples;
+  for (int c = 0; c < 256; ++c) {
+    std::vector<int> signature{InLabel(c), InName(c), literal[c] ? c : -1};
+    auto it = signatures.find(signature);
+    if (it == signatures.end()) {
+      it = signatures.insert({signature, (uint8_t)samples.size()}).first;
+      samples.push_back((uint8_t)c);
+    }
+    class_[c] = it->second;
+  }
+  class_count_ = samples.size();
+
+  // Positions of all patterns in one NFA, end position of pattern p is
+  // base[p + 1] - 1. Moves of a position on a class are kLoop if the
+  // wildcard before it takes the class and kAdvance if the next character
+  // does. A position is plain if the rest of its pattern only takes bytes a
+  // trailing * takes.
+  enum : uint8_t { kLoop = 1, kAdvance = 2 };
+  std::vector<uint32_t> base{0};
+  std::vector<uint32_t> owner;
+  std::vector<uint8_t> moves;
+  std::vector<uint8_t> plain;
+  for (uint32_t p = 0; p < patterns_.size(); ++p) {
+    const std::string& pattern = patterns_[p];
+    base.push_back(base.back() + (uint32_t)pattern.size() + 1);
+    owner.resize(base.back(), p);
+    plain.resize(base.back(), true);
+    for (size_t k = 0; k <= pattern.size(); ++k) {
+      for (size_t c = 0; c < class_count_; ++c) {
+        uint8_t move = 0;
+        if (k > 0 && TokenOf(pattern[k - 1]) != Token::kLiteral &&
+            Accepts(TokenOf(pattern[k - 1]), pattern[k - 1], samples[c]))
+          move |= kLoop;
+        if (k < pattern.size() &&
+            Accepts(TokenOf(pattern[k]), pattern[k], samples[c]))
+          move |= kAdvance;
+        moves.push_back(move);
+      }
+    }
+    for (size_t k = pattern.size(); k-- > 0;) {
+      plain[base[p] + k] =
+          plain[base[p] + k + 1] &&
+          (InName(pattern[k]) || TokenOf(pattern[k]) != Token::kLiteral);
+    }
+  }
+  // Whether pattern q wins over pattern p wherever both match
+  auto beats = [this](uint32_t q, uint32_t p) {
+    bool better = false;
+    for (size_t lane = 0; lane < lanes_; ++lane) {
+      uint32_t lhs = values_[q * lanes_ + lane];
+      uint32_t rhs = values_[p * lanes_ + lane];
+      if (lhs > rhs)
+        return false;
+      better = better || lhs < rhs;
+    }
+    return better || q < p;
+  };
+
+  // Subset construction, positions of state i are from pool[offset[i]] to
+  // pool[offset[i + 1]], state 0 is the empty set. A set is made at the end
+  // of pool and dropped again if there is a state of it already.
+  std::vector<uint32_t> pool(base.begin(), base.end() - 1);
+  std::vector<uint32_t> offset{0, 0, (uint32_t)pool.size()};
+  auto hash = [&](uint32_t state) {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = offset[state]; i < offset[state + 1]; ++i) {
+      hash = (hash ^ pool[i]) * 1099511628211ull;
+    }
+    return (size_t)(hash ^ (hash >> 32));
+  };
+  auto equal = [&](uint32_t lhs, uint32_t rhs) {
+    return offset[lhs + 1] - offset[lhs] == offset[rhs + 1] - offset[rhs] &&
+           std::equal(pool.begin() + offset[lhs],
+                      pool.begin() + offset[lhs + 1],
+                      pool.begin() + offset[rhs]);
+  };
+  std::unordered_set<uint32_t, decltype(hash), decltype(equal)> ids(
+      16, hash, equal);
+  ids.insert(0);
+  ids.insert(1);
+  next_.clear();
+  output_.clear();
+  std::vector<uint32_t> winners;
+  for (uint32_t state = 0; state + 1 < offset.size(); ++state) {
+    for (size_t c = 0; c < class_count_; ++c) {
+      // Positions come in order, a loop never goes before an earlier
+      // advance, so set stays sorted
+      size_t begin = pool.size();
+      for (uint32_t i = offset[state]; i < offset[state + 1]; ++i) {
+        uint32_t position = pool[i];
+        uint8_t move = moves[position * class_count_ + c];
+        if ((move & kLoop) && (pool.size() == begin || pool.back() != position))
+          pool.push_back(position);
+        if (move & kAdvance)
+          pool.push_back(position + 1);
+      }
+
+      // A pattern ending in * which has matched keeps matching on any plain
+      // bytes, so positions it beats are of no use any more. Without this,
+      // patterns like *a* and *b* remember every combination matched.
+      winners.clear();
+      for (size_t i = begin; i < pool.size(); ++i) {
+        uint32_t p = owner[pool[i]];
+        if (pool[i] == base[p + 1] - 1 && patterns_[p].back() == '*')
+          winners.push_back(p);
+      }
+      if (!winners.empty()) {
+        pool.erase(std::remove_if(pool.begin() + begin, pool.end(),
+                                  [&](uint32_t position) {
+                                    uint32_t p = owner[position];
+                                    if (!plain[position])
+                                      return false;
+                                    for (uint32_t q : winners) {
+                                      if (q != p && beats(q, p))
+                                        return true;
+                                    }
+                                    return false;
+                                  }),
+                   pool.end());
+      }
+
+      offset.push_back((uint32_t)pool.size());
+      uint32_t set = (uint32_t)offset.size() - 2;
+      auto it = ids.find(set);
+      if (it != ids.end()) {
+        offset.pop_back();
+        pool.resize(begin);
+        next_.push_back(*it);
+        continue;
+      }
+      if (set >= std::min(max_states, kMaxStates))
+        return false;
+      ids.insert(set);
+      next_.push_back(set);
+    }
+
+    std::vector<uint32_t> output(lanes_, kNone);
+    for (uint32_t i = offset[state]; i < offset[state + 1]; ++i) {
+      uint32_t p = owner[pool[i]];
+      if (pool[i] != base[p + 1] - 1)
+        continue;
+      for (size_t lane = 0; lane < lanes_; ++lane) {
+        output[lane] = std::min(output[lane], values_[p * lanes_ + lane]);
+      }
+    }
+    output_.insert(output_.end(), output.begin(), output.end());
+  }
+
+  start_ = 1;
+  dead_ = 0;
+  state_count_ = offset.size() - 1;
+  Minimize();
+  next_table_ = MakeTable(next_);
+  output_table_ = MakeTable(output_);
+  return true;
+}
+
+void CrWildcardDFA::Minimize() {
+  // Hopcroft's algorithm, start from blocks of states with the same output
+  // and split blocks by predecessors of other blocks until none splits.
+  // States of a block are kept together in elements, marked ones first.
+  std::vector<uint32_t> group(state_count_);
+  std::vector<uint32_t> first, end;
+  {
+    std::unordered_map<std::vector<uint32_t>, uint32_t, SetHash> groups;
+    for (size_t state = 0; state < state_count_; ++state) {
+      std::vector<uint32_t> key(output_.begin() + state * lanes_,
+                                output_.begin() + (state + 1) * lanes_);
+      group[state] =
+          groups.insert({key, (uint32_t)groups.size()}).first->second;
+    }
+    first.assign(groups.size() + 1, 0);
+  }
+  for (size_t state = 0; state < state_count_; ++state) {
+    ++first[group[state] + 1];
+  }
+  for (size_t block = 1; block < first.size(); ++block) {
+    first[block] += first[block - 1];
+  }
+  first.pop_back();
+  end = first;
+  std::vector<uint32_t> elements(state_count_), location(state_count_);
+  for (uint32_t state = 0; state < state_count_; ++state) {
+    location[state] = end[group[state]]++;
+    elements[location[state]] = state;
+  }
+  std::vector<uint32_t> marked(first.size(), 0);
+
+  // Predecessors of state on class are at index of state * class_count_ +
+  // class in predecessors
+  size_t transitions = state_count_ * class_count_;
+  std::vector<uint32_t> index(transitions + 1, 0);
+  std::vector<uint32_t> predecessors(transitions);
+  for (size_t i = 0; i < transitions; ++i) {
+    ++index[next_[i] * class_count_ + i % class_count_ + 1];
+  }
+  for (size_t i = 1; i <= transitions; ++i) {
+    index[i] += index[i - 1];
+  }
+  {
+    std::vector<uint32_t> fill(index.begin(), index.end() - 1);
+    for (size_t i = 0; i < transitions; ++i) {
+      predecessors[fill[next_[i] * class_count_ + i % class_count_]++] =
+          (uint32_t)(i / class_count_);
+    }
+  }
+
+  // Blocks nothing enters on a class split no other block on it
+  auto entered = [&](uint32_t block, uint32_t c) {
+    for (uint32_t i = first[block]; i < end[block]; ++i) {
+      size_t slot = elements[i] * class_count_ + c;
+      if (index[slot] != index[slot + 1])
+        return true;
+    }
+    return false;
+  };
+  std::vector<std::pair<uint32_t, uint32_t>> work;
+  std::vector<uint8_t> in_work(first.size() * class_count_, 0);
+  for (uint32_t block = 0; block < first.size(); ++block) {
+    for (uint32_t c = 0; c < class_count_; ++c) {
+      if (entered(block, c)) {
+        in_work[block * class_count_ + c] = 1;
+        work.push_back({block, c});
+      }
+    }
+  }
+  std::vector<uint32_t> splitter, touched;
+  while (!work.empty()) {
+    uint32_t c = work.back().second;
+    uint32_t block = work.back().first;
+    work.pop_back();
+    in_work[block * class_count_ + c] = 0;
+
+    splitter.assign(elements.begin() + first[block],
+                    elements.begin() + end[block]);
+    touched.clear();
+    for (uint32_t target : splitter) {
+      size_t slot = target * class_count_ + c;
+      for (uint32_t i = index[slot]; i < index[slot + 1]; ++i) {
+        uint32_t state = predecessors[i];
+        uint32_t other = group[state];
+        uint32_t position = first[other] + marked[other];
+        if (location[state] < position)
+          continue;
+        if (marked[other]++ == 0)
+          touched.push_back(other);
+        elements[location[state]] = elements[position];
+        location[elements[position]] = location[state];
+        elements[position] = state;
+        location[state] = position;
+      }
+    }
+
+    for (uint32_t other : touched) {
+      uint32_t count = marked[other];
+      marked[other] = 0;
+      if (count == end[other] - first[other])
+        continue;
+      uint32_t split = (uint32_t)first.size();
+      first.push_back(first[other]);
+      end.push_back(first[other] + count);
+      marked.push_back(0);
+      first[other] += count;
+      for (uint32_t i = first[split]; i < end[split]; ++i) {
+        group[elements[i]] = split;
+      }
+      in_work.resize(first.size() * class_count_, 0);
+      uint32_t smaller =
+          count <= end[other] - first[other] ? split : other;
+      for (uint32_t k = 0; k < class_count_; ++k) {
+        uint32_t add = in_work[other * class_count_ + k] ? split : smaller;
+        if (!in_work[add * class_count_ + k] && entered(add, k)) {
+          in_work[add * class_count_ + k] = 1;
+          work.push_back({add, k});
+        }
+      }
+    }
+  }
+  size_t group_count = first.size();
+
+  std::vector<uint16_t> next(group_count * class_count_);
+  std::vector<uint32_t> output(group_count * lanes_);
+  for (size_t state = 0; state < state_count_; ++state) {
+    for (size_t c = 0; c < class_count_; ++c) {
+      next[group[state] * class_count_ + c] =
+          group[next_[state * class_count_ + c]];
+    }
+    std::copy(output_.begin() + state * lanes_,
+              output_.begin() + (state + 1) * lanes_,
+              output.begin() + group[state] * lanes_);
+  }
+  next_.swap(next);
+  output_.swap(output);
+  start_ = group[start_];
+  dead_ = group[dead_];
+  state_count_ = group_count;
+}
+
+void CrWildcardDFA::Save(const std::vector<CrWildcardDFA>& dfas,
+                         CrImageWriter& writer) {
+  std::vector<Meta> metas;
+  std::vector<uint16_t> next;
+  std::vector<uint32_t> output;
+  for (const auto& dfa : dfas) {
+    Meta meta;
+    meta.lanes = (uint32_t)dfa.lanes_;
+    meta.class_count = (uint32_t)dfa.class_count_;
+    meta.start = dfa.start_;
+    meta.dead = dfa.dead_;
+    meta.state_count = (uint32_t)dfa.state_count_;
+    meta.next = (uint32_t)next.size();
+    meta.output = (uint32_t)output.size();
+    ::memcpy(meta.class_, dfa.class_, sizeof(meta.class_));
+    metas.push_back(meta);
+    next.insert(next.end(), dfa.next_table_.begin(), dfa.next_table_.end());
+    output.insert(output.end(), dfa.output_table_.begin(),
+                  dfa.output_table_.end());
+  }
+  writer.Add(std::move(metas));
+  writer.Add(std::move(next));
+  writer.Add(std::move(output));
+}
+
+bool CrWildcardDFA::Map(const CrImage& image,
+                        size_t index,
+                        std::vector<CrWildcardDFA>& dfas) {
+  CrTable<Meta> metas;
+  CrTable<uint16_t> next;
+  CrTable<uint32_t> output;
+  if (!image.Get(index, metas) || !image.Get(index + 1, next) ||
+      !image.Get(index + 2, output))
+    return false;
+
+  std::vector<CrWildcardDFA> mapped;
+  for (const Meta& meta : metas) {
+    uint64_t next_size = (uint64_t)meta.state_count * meta.class_count;
+    uint64_t output_size = (uint64_t)meta.state_count * meta.lanes;
+    if (meta.start >= meta.state_count || meta.dead >= meta.state_count ||
+        meta.next + next_size > next.size ||
+        meta.output + output_size > output.size)
+      return false;
+
+    CrWildcardDFA dfa(meta.lanes);
+    dfa.class_count_ = meta.class_count;
+    ::memcpy(dfa.class_, meta.class_, sizeof(dfa.class_));
+    dfa.start_ = meta.start;
+    dfa.dead_ = meta.dead;
+    dfa.state_count_ = meta.state_count;
+    std::vector<uint16_t>().swap(dfa.next_);
+    std::vector<uint32_t>().swap(dfa.output_);
+    dfa.next_table_ = CrTable<uint16_t>{next.data + meta.next, next_size};
+    dfa.output_table_ =
+        CrTable<uint32_t>{output.data + meta.output, output_size};
+    mapped.push_back(std::move(dfa));
+  }
+  dfas.swap(mapped);
+  return true;
+}
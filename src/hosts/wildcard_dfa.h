@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_HOSTS_WILDCARD_DFA_H_
+#define _CR_HOSTS_WILDCARD_DFA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "../image.h"
+
+// Set of wildcard patterns compiled into one minimized DFA. In a pattern,
+// ? stands for one or more of [a-z0-9-] and * for one or more of
+// [a-z0-9-.], anything else is literal. Each pattern carries a value for
+// every lane, and each state of DFA knows the lowest value of each lane
+// among patterns it accepts, so a match is one pass without any check
+// afterwards.
+class CrWildcardDFA {
+ public:
+  static const uint32_t kNone = UINT32_MAX;
+  // States are numbered in 16 bits to keep transitions small
+  static const size_t kMaxStates = 1 << 16;
+  static const size_t kImageTables = 3;
+
+  explicit CrWildcardDFA(size_t lanes = 1);
+  // Tables may point into a mapped image
+  CrWildcardDFA(const CrWildcardDFA&) = delete;
+  CrWildcardDFA& operator=(const CrWildcardDFA&) = delete;
+  CrWildcardDFA(CrWildcardDFA&&) = default;
+  CrWildcardDFA& operator=(CrWildcardDFA&&) = default;
+
+  static bool InLabel(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-';
+  }
+  static bool InName(uint8_t c) { return InLabel(c) || c == '.'; }
+  // Matches a single pattern without building anything
+  static bool Match(const std::string& pattern, const char* text, size_t size);
+
+  // Patterns added after Build are not matched until it is called again
+  void Add(const std::string& pattern, const uint32_t* values);
+  // Returns false if DFA would have more than max_states states
+  bool Build(size_t max_states = kMaxStates);
+  size_t Size() const { return state_count_; }
+
+  // Lowest value of each lane among patterns matching text, kNone in lanes
+  // no pattern matches
+  const uint32_t* Match(const char* text, size_t size) const;
+
+  // Adds kImageTables tables holding every built DFA of dfas to writer, Map
+  // takes them from index on. Patterns are not kept, so a mapped DFA can
+  // not be built again.
+  static void Save(const std::vector<CrWildcardDFA>& dfas,
+                   CrImageWriter& writer);
+  static bool Map(const CrImage& image,
+                  size_t index,
+                  std::vector<CrWildcardDFA>& dfas);
+
+ private:
+  enum class Token : uint8_t { kLiteral, kLabel, kName };
+
+  // What an image keeps of a DFA, next and output are where its tables
+  // start in the ones shared by all
+  struct Meta {
+    uint32_t lanes;
+    uint32_t class_count;
+    uint32_t start;
+    uint32_t dead;
+    uint32_t state_count;
+    uint32_t next;
+    uint32_t output;
+    uint8_t class_[256];
+  };
+
+  size_t lanes_;
+  std::vector<std::string> patterns_;
+  std::vector<uint32_t> values_;
+
+  size_t class_count_;
+  uint8_t class_[256];
+  uint32_t start_;
+  uint32_t dead_;
+  size_t state_count_;
+  // Transition of state on class is at state * class_count_ + class
+  std::vector<uint16_t> next_;
+  // Values of state are at state * lanes_
+  std::vector<uint32_t> output_;
+  // Lookup goes through these, over the vectors or into an image
+  CrTable<uint16_t> next_table_;
+  CrTable<uint32_t> output_table_;
+
+  static Token TokenOf(char c);
+  static bool Accepts(Token token, char literal, uint8_t c);
+  void Minimize();
+};
+
+inline const uint32_t* CrWildcardDFA::Match(const char* text,
+                                            size_t size) const {
+  uint32_t state = start_;
+  for (size_t i = 0; i < size && state != dead_; ++i) {
+    state = next_table_[state * class_count_ + class_[(uint8_t)text[i]]];
+  }
+  return &output_table_[state * lanes_];
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "id_pool.h"
+
+#include <random>
+#include <utility>
+
+CrIDPool::CrIDPool(uint_fast32_t seed)
+    : head_(0), available_(kCapacity), ring_(new uint16_t[kCapacity]) {
+  for (size_t i = 0; i < kCapacity; ++i)
+    ring_[i] = (uint16_t)i;
+
+  // Fisher-Yates shuffle
+  std::minstd_rand mr(seed);
+  for (size_t i = kCapacity - 1; i > 0; --i) {
+    std::uniform_int_distribution<size_t> uid(0, i);
+    std::swap(ring_[i], ring_[uid(mr)]);
+  }
+}
+
+bool CrIDPool::Alloc(uint16_t& id) {
+  if (available_ == 0)
+    return false;
+  id = ring_[head_];
+  head_ = (head_ + 1) & (kCapacity - 1);
+  --available_;
+  return true;
+}
+
+void CrIDPool::Free(uint16_t id) {
+  ring_[(head_ + available_) & (kCapacity - 1)] = id;
+  ++available_;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_ID_POOL_H_
+#define _CR_ID_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Free list of 16 bits DNS IDs. IDs are handed out in the order of a random
+// permutation and recycled in FIFO order, so an ID in use is never handed
+// out twice, and a released ID stays cold for as long as possible.
+class CrIDPool {
+ public:
+  CrIDPool(uint_fast32_t seed);
+  ~CrIDPool() {}
+
+  static const size_t kCapacity = 1 << 16;
+
+  bool Alloc(uint16_t& id);
+  void Free(uint16_t id);
+  size_t Available() const { return available_; }
+
+ private:
+  size_t head_;
+  size_t available_;
+  std::unique_ptr<uint16_t[]> ring_;
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "image.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+const size_t CrImage::kMagicSize;
+const size_t CrImage::kAlign;
+const uint16_t CrImage::kByteOrder;
+
+int CrImageWriter::Save(const char* path,
+                        const char* magic,
+                        uint32_t version) const {
+  typedef CrImage::Header Header;
+  typedef CrImage::Table Table;
+
+  Header header = {};
+  ::memcpy(header.magic, magic, CrImage::kMagicSize);
+  header.version = version;
+  header.byte_order = CrImage::kByteOrder;
+  header.header_size = (uint16_t)CrImage::HeaderSize(tables_.size());
+  header.table_count = (uint32_t)tables_.size();
+
+  std::vector<Table> directory(tables_.size());
+  size_t offset = CrImage::Align(header.header_size);
+  for (size_t i = 0; i < tables_.size(); ++i) {
+    offset = CrImage::Align(offset, tables_[i].alignment);
+    directory[i] = {offset, (uint32_t)tables_[i].count,
+                    (uint32_t)tables_[i].element_size};
+    offset = CrImage::Align(offset +
+                            tables_[i].count * tables_[i].element_size);
+  }
+
+  // Padding stays zero, so it is covered by checksum as well
+  std::vector<uint8_t> image(offset, 0);
+  ::memcpy(image.data() + sizeof(Header), directory.data(),
+           directory.size() * sizeof(Table));
+  for (size_t i = 0; i < tables_.size(); ++i) {
+    if (tables_[i].count != 0)
+      ::memcpy(image.data() + directory[i].offset, tables_[i].data,
+               tables_[i].count * tables_[i].element_size);
+  }
+  header.checksum = CrImage::Checksum(image.data() + header.header_size,
+                                      image.size() - header.header_size);
+  ::memcpy(image.data(), &header, sizeof(header));
+
+  std::string tmp_path = std::string(path) + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file)
+    return -1;
+  bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+  if (fclose(file) != 0 || !written || rename(tmp_path.c_str(), path) != 0) {
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+bool CrImage::Sniff(int fd, const char* magic) {
+  char head[kMagicSize];
+  return pread(fd, head, sizeof(head), 0) == (ssize_t)sizeof(head) &&
+         ::memcmp(head, magic, sizeof(head)) == 0;
+}
+
+int CrImage::Map(int fd,
+                 const char* magic,
+                 uint32_t version,
+                 size_t table_count,
+                 const char* what,
+                 bool verify) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header))
+    return -1;
+
+  size_t size = st.st_size;
+  void* image = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    return -1;
+
+  const uint8_t* data = (const uint8_t*)image;
+  const Header* header = (const Header*)image;
+  const char* error = nullptr;
+  if (::memcmp(header->magic, magic, kMagicSize) != 0 ||
+      header->version != version || header->byte_order != kByteOrder ||
+      header->table_count != table_count ||
+      header->header_size != HeaderSize(table_count)) {
+    error = "unsupported version or architecture";
+  } else if (size < header->header_size) {
+    error = "malformed table";
+  } else if (verify &&
+             Checksum(data + header->header_size,
+                      size - header->header_size) != header->checksum) {
+    error = "checksum mismatch";
+  }
+  if (error) {
+    ERR << "Bad " << what << " image: " << error << ENDL;
+    munmap(image, size);
+    return -1;
+  }
+
+  Unmap();
+  data_ = data;
+  size_ = size;
+  table_count_ = table_count;
+  return 0;
+}
+
+void CrImage::Unmap() {
+  if (data_) {
+    munmap((void*)data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+    table_count_ = 0;
+  }
+}
+
+uint32_t CrImage::Checksum(const uint8_t* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
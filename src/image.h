@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_IMAGE_H_
+#define _CR_IMAGE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Read-only view of an array, either over a vector compiled in memory or
+// into a mapped image
+template <typename T>
+struct CrTable {
+  const T* data;
+  size_t size;
+
+  const T& operator[](size_t index) const { return data[index]; }
+  const T* begin() const { return data; }
+  const T* end() const { return data + size; }
+  bool empty() const { return size == 0; }
+};
+
+template <typename T>
+CrTable<T> MakeTable(const std::vector<T>& vector) {
+  return CrTable<T>{vector.data(), vector.size()};
+}
+
+// Binary image is a header, a directory of tables, then every table
+// aligned to kAlign, or further if its elements ask for it. Integers are in
+// host byte order and tables keep their in-memory layout, so an image only
+// loads on the kind of host which wrote it. Owners bump their version
+// whenever a table changes.
+class CrImageWriter {
+ public:
+  CrImageWriter() : tables_(), owned_() {}
+
+  // Tables are written in the order they are added, data is not copied
+  // and has to stay until Save
+  template <typename T>
+  void Add(const T* data, size_t count) {
+    tables_.push_back(Entry{data, count, sizeof(T), alignof(T)});
+  }
+  template <typename T>
+  void Add(const CrTable<T>& table) {
+    Add(table.data, table.size);
+  }
+  template <typename T>
+  void Add(const std::vector<T>& vector) {
+    Add(vector.data(), vector.size());
+  }
+  // Table made up only for the image is kept by writer
+  template <typename T>
+  void Add(std::vector<T>&& vector) {
+    auto owned = std::make_shared<std::vector<T>>(std::move(vector));
+    owned_.push_back(owned);
+    Add(owned->data(), owned->size());
+  }
+  // Running instances may have the old image mapped, so it is replaced
+  // instead of written over
+  int Save(const char* path, const char* magic, uint32_t version) const;
+
+ private:
+  struct Entry {
+    const void* data;
+    size_t count;
+    size_t element_size;
+    size_t alignment;
+  };
+
+  std::vector<Entry> tables_;
+  std::vector<std::shared_ptr<void>> owned_;
+};
+
+// Image mapped read-only and shared, so instances share it in page cache
+class CrImage {
+ public:
+  static const size_t kMagicSize = 8;
+  static const size_t kAlign = 16;
+
+  CrImage() : data_(nullptr), size_(0), table_count_(0) {}
+  ~CrImage() { Unmap(); }
+  CrImage(const CrImage&) = delete;
+  CrImage& operator=(const CrImage&) = delete;
+  // Views into the mapping stay valid as it moves
+  CrImage(CrImage&& other)
+      : data_(other.data_),
+        size_(other.size_),
+        table_count_(other.table_count_) {
+    other.data_ = nullptr;
+    other.size_ = other.table_count_ = 0;
+  }
+  CrImage& operator=(CrImage&& other) {
+    if (this != &other) {
+      Unmap();
+      data_ = other.data_;
+      size_ = other.size_;
+      table_count_ = other.table_count_;
+      other.data_ = nullptr;
+      other.size_ = other.table_count_ = 0;
+    }
+    return *this;
+  }
+
+  // Tells if file starts with magic
+  static bool Sniff(int fd, const char* magic);
+  // Maps image at fd after checking its header, Get checks each table fits
+  // in it. Reading the whole image for its checksum takes a while on a large
+  // one, it is done only with verify. An error is logged as bad image of
+  // what.
+  int Map(int fd,
+          const char* magic,
+          uint32_t version,
+          size_t table_count,
+          const char* what,
+          bool verify);
+  void Unmap();
+  bool Mapped() const { return data_ != nullptr; }
+
+  // Returns false if table at index does not hold elements of T
+  template <typename T>
+  bool Get(size_t index, CrTable<T>& table) const;
+
+ private:
+  struct Table {
+    uint64_t offset;
+    uint32_t count;
+    uint32_t element_size;
+  };
+
+  struct Header {
+    char magic[kMagicSize];
+    uint32_t version;
+    uint16_t byte_order;
+    uint16_t header_size;
+    // FNV-1a of everything after the header
+    uint32_t checksum;
+    uint32_t table_count;
+  };
+
+  friend class CrImageWriter;
+  static const uint16_t kByteOrder = 0x0102;
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t table_count_;
+
+  static size_t HeaderSize(size_t table_count) {
+    return sizeof(Header) + table_count * sizeof(Table);
+  }
+  static size_t Align(size_t offset, size_t alignment = kAlign) {
+    alignment = std::max(alignment, kAlign);
+    return (offset + alignment - 1) & ~(alignment - 1);
+  }
+  static uint32_t Checksum(const uint8_t* data, size_t size);
+  const Table& TableAt(size_t index) const {
+    return ((const Table*)(data_ + sizeof(Header)))[index];
+  }
+};
+
+template <typename T>
+bool CrImage::Get(size_t index, CrTable<T>& table) const {
+  if (index >= table_count_)
+    return false;
+  const Table& entry = TableAt(index);
+  if (entry.element_size != sizeof(T) || entry.offset % Align(1, alignof(T)) ||
+      entry.offset < HeaderSize(table_count_) || entry.offset > size_ ||
+      (size_ - entry.offset) / sizeof(T) < entry.count)
+    return false;
+  table.data = (const T*)(data_ + entry.offset);
+  table.size = entry.count;
+  return true;
+}
+
+#endif
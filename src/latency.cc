@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+
+void CrLatencyStats::Add(uint64_t rtt_in_ms) {
+  size_t index = rtt_in_ms / kBucketWidth;
+  if (index >= kBucketCount)
+    index = kBucketCount - 1;
+  ++buckets_[index];
+
+  if (++samples_ >= kDecayThreshold) {
+    samples_ = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+      buckets_[i] >>= 1;
+      samples_ += buckets_[i];
+    }
+  }
+}
+
+uint64_t CrLatencyStats::Percentile(unsigned int percent) const {
+  uint32_t rank = (uint64_t)samples_ * percent / 100, seen = 0;
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    seen += buckets_[i];
+    if (seen > rank)
+      return (i + 1) * kBucketWidth;
+  }
+  return kBucketCount * kBucketWidth;
+}
+
+void CrLatencyStats::Merge(const CrLatencyStats& other) {
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  samples_ += other.samples_;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_LATENCY_H_
+#define _CR_LATENCY_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Decaying histogram of upstream round trip time, in milliseconds
+class CrLatencyStats {
+ public:
+  CrLatencyStats() : samples_(0), buckets_() {}
+  ~CrLatencyStats() {}
+
+  void Add(uint64_t rtt_in_ms);
+  uint64_t Percentile(unsigned int percent) const;
+  // Adds samples of another histogram, as if they were added here
+  void Merge(const CrLatencyStats& other);
+  uint32_t Samples() const { return samples_; }
+
+ private:
+  // 8ms per bucket, the last bucket collects everything beyond 2 seconds
+  static const unsigned int kBucketWidth = 8;
+  static const size_t kBucketCount = 256;
+  // Halve the histogram once it holds this many samples, so it follows
+  // the recent network condition
+  static const uint32_t kDecayThreshold = 4096;
+
+  uint32_t samples_;
+  uint32_t buckets_[kBucketCount];
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "net_list.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+static inline bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static inline unsigned int count_leading_zeros(uint32_t value) {
+  return __builtin_clz(value);
+}
+
+static inline unsigned int count_leading_zeros(uint128_t value) {
+  uint64_t high = (uint64_t)(value >> 64);
+  return high != 0 ? __builtin_clzll(high)
+                   : 64 + __builtin_clzll((uint64_t)value);
+}
+
+static inline unsigned int count_trailing_zeros(uint32_t value) {
+  return __builtin_ctz(value);
+}
+
+static inline unsigned int count_trailing_zeros(uint128_t value) {
+  uint64_t low = (uint64_t)value;
+  return low != 0 ? __builtin_ctzll(low)
+                  : 64 + __builtin_ctzll((uint64_t)(value >> 64));
+}
+
+// Reads a.b.c.d[/mask], sscanf is the bottleneck of big lists
+static bool parse_route(const char* str, uint32_t& segment, uint8_t& mask) {
+  uint32_t addr = 0;
+  while (*str == ' ' || *str == '\t')
+    ++str;
+  for (int i = 0; i < 4; ++i) {
+    if (i != 0 && *str++ != '.')
+      return false;
+    if (!is_digit(*str))
+      return false;
+    unsigned int octet = 0;
+    for (int n = 0; n < 3 && is_digit(*str); ++n) {
+      octet = octet * 10 + (*str++ - '0');
+    }
+    if (octet > 255)
+      return false;
+    addr = (addr << 8) | octet;
+  }
+
+  unsigned int mask_bits = 32;
+  if (*str == '/') {
+    ++str;
+    if (!is_digit(*str))
+      return false;
+    mask_bits = 0;
+    for (int n = 0; n < 2 && is_digit(*str); ++n) {
+      mask_bits = mask_bits * 10 + (*str++ - '0');
+    }
+    if (mask_bits > 32)
+      return false;
+  }
+  segment = addr;
+  mask = (uint8_t)mask_bits;
+  return true;
+}
+
+static bool parse_route6(const char* str, uint128_t& segment, uint8_t& mask) {
+  char addr_str[INET6_ADDRSTRLEN];
+  unsigned int mask_bits = 128;
+  struct in6_addr addr;
+  if (sscanf(str, "%45[0-9A-Fa-f:.]/%u", addr_str, &mask_bits) < 1 ||
+      mask_bits > 128 || inet_pton(AF_INET6, addr_str, &addr) != 1)
+    return false;
+  uint64_t high, low;
+  ::memcpy(&high, addr.s6_addr, sizeof(high));
+  ::memcpy(&low, addr.s6_addr + 8, sizeof(low));
+  segment = ((uint128_t)be64toh(high) << 64) | be64toh(low);
+  mask = (uint8_t)mask_bits;
+  return true;
+}
+
+int CrNetList::LoadFile(const char* path) {
+  std::string line;
+  std::ifstream ifs(path);
+
+  if (!ifs)
+    return -1;
+
+  std::vector<Range<uint32_t>> ranges;
+  std::vector<Range<uint128_t>> ranges6;
+  while (std::getline(ifs, line)) {
+    uint8_t mask;
+    if (line.find(':') != std::string::npos) {
+      uint128_t segment;
+      if (parse_route6(line.c_str(), segment, mask))
+        Add(ranges6, segment, mask);
+    } else {
+      uint32_t segment;
+      if (parse_route(line.c_str(), segment, mask))
+        Add(ranges, segment, mask);
+    }
+  }
+  ifs.close();
+
+  Normalize(ranges);
+  Normalize(ranges6);
+  Union(ranges_, ranges);
+  Union(ranges6_, ranges6);
+  return 0;
+}
+
+void CrNetList::AddReserved() {
+  static const struct {
+    uint32_t segment;
+    uint8_t mask;
+  } kReserved[] = {
+      {0x00000000, 8},   // 0.0.0.0/8
+      {0x0a000000, 8},   // 10.0.0.0/8
+      {0x64400000, 10},  // 100.64.0.0/10
+      {0x7f000000, 8},   // 127.0.0.0/8
+      {0xa9fe0000, 16},  // 169.254.0.0/16
+      {0xac100000, 12},  // 172.16.0.0/12
+      {0xc0000000, 24},  // 192.0.0.0/24
+      {0xc0000200, 24},  // 192.0.2.0/24
+      {0xc0586300, 24},  // 192.88.99.0/24
+      {0xc0a80000, 16},  // 192.168.0.0/16
+      {0xc6120000, 15},  // 198.18.0.0/15
+      {0xc6336400, 24},  // 198.51.100.0/24
+      {0xcb007100, 24},  // 203.0.113.0/24
+      {0xe0000000, 4},   // 224.0.0.0/4
+      // {0xf0000000, 4},   // 240.0.0.0/4
+      {0xffffffff, 32},  // 255.255.255.255/32
+  };
+  static const char* kReserved6[] = {
+      "::/128",         // Unspecified address
+      "::1/128",        // Loopback address
+      "100::/64",       // Discard prefix
+      "2001:db8::/32",  // Documentation
+      "fc00::/7",       // Unique local address
+      "fe80::/10",      // Link-local address
+      "ff00::/8",       // Multicast
+  };
+
+  std::vector<Range<uint32_t>> ranges;
+  std::vector<Range<uint128_t>> ranges6;
+  for (const auto& entry : kReserved) {
+    Add(ranges, entry.segment, entry.mask);
+  }
+  for (const auto& entry : kReserved6) {
+    uint128_t segment;
+    uint8_t mask;
+    if (parse_route6(entry, segment, mask))
+      Add(ranges6, segment, mask);
+  }
+
+  Normalize(ranges);
+  Normalize(ranges6);
+  Union(ranges_, ranges);
+  Union(ranges6_, ranges6);
+}
+
+void CrNetList::Union(const CrNetList& other) {
+  Union(ranges_, other.ranges_);
+  Union(ranges6_, other.ranges6_);
+}
+
+void CrNetList::Subtract(const CrNetList& other) {
+  Subtract(ranges_, other.ranges_);
+  Subtract(ranges6_, other.ranges6_);
+}
+
+void CrNetList::Intersect(const CrNetList& other) {
+  Intersect(ranges_, other.ranges_);
+  Intersect(ranges6_, other.ranges6_);
+}
+
+void CrNetList::ForEachBlock(
+    const std::function<void(uint32_t, uint8_t)>& fn) const {
+  ForEachBlock(ranges_, fn);
+}
+
+void CrNetList::ForEachBlock6(
+    const std::function<void(uint128_t, uint8_t)>& fn) const {
+  ForEachBlock(ranges6_, fn);
+}
+
+template <typename T>
+void CrNetList::Add(std::vector<Range<T>>& ranges, T segment, uint8_t mask) {
+  // Host bits of segment are ignored
+  T host = mask == 0 ? ~(T)0 : ((T)1 << (sizeof(T) * 8 - mask)) - 1;
+  ranges.push_back({segment & ~host, segment | host});
+}
+
+template <typename T>
+void CrNetList::Normalize(std::vector<Range<T>>& ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+            [](const Range<T>& lhs, const Range<T>& rhs) {
+              return lhs.first < rhs.first;
+            });
+  Coalesce(ranges);
+}
+
+template <typename T>
+void CrNetList::Coalesce(std::vector<Range<T>>& ranges) {
+  // Merge overlapping and adjacent ranges in place
+  size_t size = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (size != 0 && (ranges[size - 1].last == ~(T)0 ||
+                      ranges[i].first <= ranges[size - 1].last + 1)) {
+      ranges[size - 1].last = std::max(ranges[size - 1].last, ranges[i].last);
+    } else {
+      ranges[size++] = ranges[i];
+    }
+  }
+  ranges.resize(size);
+  ranges.shrink_to_fit();
+}
+
+template <typename T>
+void CrNetList::Union(std::vector<Range<T>>& ranges,
+                      const std::vector<Range<T>>& other) {
+  if (other.empty())
+    return;
+  if (ranges.empty()) {
+    ranges = other;
+    return;
+  }
+
+  std::vector<Range<T>> merged(ranges.size() + other.size());
+  std::merge(ranges.begin(), ranges.end(), other.begin(), other.end(),
+             merged.begin(), [](const Range<T>& lhs, const Range<T>& rhs) {
+               return lhs.first < rhs.first;
+             });
+  Coalesce(merged);
+  ranges.swap(merged);
+}
+
+template <typename T>
+void CrNetList::Subtract(std::vector<Range<T>>& ranges,
+                         const std::vector<Range<T>>& other) {
+  std::vector<Range<T>> result;
+  size_t j = 0;
+  for (Range<T> range : ranges) {
+    while (j < other.size() && other[j].last < range.first)
+      ++j;
+    // Cut every range of other which overlaps off the front
+    size_t k = j;
+    bool left = true;
+    while (k < other.size() && other[k].first <= range.last) {
+      if (other[k].first > range.first)
+        result.push_back({range.first, (T)(other[k].first - 1)});
+      if (other[k].last >= range.last) {
+        left = false;
+        break;
+      }
+      range.first = other[k].last + 1;
+      ++k;
+    }
+    if (left)
+      result.push_back(range);
+  }
+  result.shrink_to_fit();
+  ranges.swap(result);
+}
+
+template <typename T>
+void CrNetList::Intersect(std::vector<Range<T>>& ranges,
+                          const std::vector<Range<T>>& other) {
+  std::vector<Range<T>> result;
+  size_t i = 0, j = 0;
+  while (i < ranges.size() && j < other.size()) {
+    T first = std::max(ranges[i].first, other[j].first);
+    T last = std::min(ranges[i].last, other[j].last);
+    if (first <= last)
+      result.push_back({first, last});
+    if (ranges[i].last < other[j].last)
+      ++i;
+    else
+      ++j;
+  }
+  result.shrink_to_fit();
+  ranges.swap(result);
+}
+
+template <typename T>
+void CrNetList::ForEachBlock(const std::vector<Range<T>>& ranges,
+                             const std::function<void(T, uint8_t)>& fn) {
+  const unsigned int kBits = sizeof(T) * 8;
+  for (const auto& range : ranges) {
+    T first = range.first;
+    for (;;) {
+      // Largest block aligned at first which does not pass the end
+      T span = range.last - first;
+      unsigned int align = first == 0 ? kBits : count_trailing_zeros(first);
+      unsigned int fit = span == ~(T)0
+                             ? kBits
+                             : kBits - 1 - count_leading_zeros((T)(span + 1));
+      unsigned int bits = std::min(align, fit);
+      fn(first, (uint8_t)(kBits - bits));
+
+      T host = bits == kBits ? ~(T)0 : ((T)1 << bits) - 1;
+      if (span == host)
+        break;
+      first += host + 1;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_NET_LIST_H_
+#define _CR_NET_LIST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+typedef unsigned __int128 uint128_t;
+
+// List of CIDR blocks, kept as sorted, disjoint and non-adjacent address
+// ranges. Blocks are sorted and merged in one pass after loading, set
+// operations walk two lists side by side, and the minimal list of blocks
+// is only produced at last, so nothing is allocated per address bit.
+class CrNetList {
+ public:
+  CrNetList() : ranges_(), ranges6_(){};
+
+  // Adds every IPv4 and IPv6 block in file, one per line
+  int LoadFile(const char* path);
+  // Adds reserved addresses, see
+  // https://en.wikipedia.org/wiki/Reserved_IP_addresses
+  void AddReserved();
+
+  void Union(const CrNetList& other);
+  void Subtract(const CrNetList& other);
+  void Intersect(const CrNetList& other);
+
+  // Calls fn with each block of the minimal list covering the same
+  // addresses, in ascending order
+  void ForEachBlock(const std::function<void(uint32_t, uint8_t)>& fn) const;
+  void ForEachBlock6(const std::function<void(uint128_t, uint8_t)>& fn) const;
+
+ private:
+  template <typename T>
+  struct Range {
+    T first;
+    T last;
+  };
+
+  std::vector<Range<uint32_t>> ranges_;
+  std::vector<Range<uint128_t>> ranges6_;
+
+  template <typename T>
+  static void Add(std::vector<Range<T>>& ranges, T segment, uint8_t mask);
+  template <typename T>
+  static void Normalize(std::vector<Range<T>>& ranges);
+  // Merges ranges which are sorted already
+  template <typename T>
+  static void Coalesce(std::vector<Range<T>>& ranges);
+  template <typename T>
+  static void Union(std::vector<Range<T>>& ranges,
+                    const std::vector<Range<T>>& other);
+  template <typename T>
+  static void Subtract(std::vector<Range<T>>& ranges,
+                       const std::vector<Range<T>>& other);
+  template <typename T>
+  static void Intersect(std::vector<Range<T>>& ranges,
+                        const std::vector<Range<T>>& other);
+  template <typename T>
+  static void ForEachBlock(const std::vector<Range<T>>& ranges,
+                           const std::function<void(T, uint8_t)>& fn);
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qname.h"
+
+#include <ostream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const uint64_t kHashMul = 0x9E3779B97F4A7C15ull;
+
+#ifdef __SSE2__
+static inline __m128i in_range(__m128i v, char lo, char hi) {
+  // Signed compare, bytes above 0x7F are negative and never in range
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+}
+#endif
+
+static inline bool is_hostname_char(uint8_t c) {
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' ||
+         c == '_';
+}
+
+bool CrQName::FromWire(const uint8_t* data, size_t size, size_t offset) {
+  Clear();
+
+  // Walk the labels first, only the boundaries are needed from wire
+  size_t cur = offset, wire_labels = 0;
+  while (cur < size && data[cur] != 0) {
+    uint8_t len = data[cur];
+    if ((len & 0xC0) != 0 || cur + 1 + len >= size)
+      return false;
+    cur += 1 + len;
+    ++wire_labels;
+  }
+  if (cur >= size || cur - offset > kMaxSize)
+    return false;
+  if (cur == offset)
+    return Finish();
+
+  // Length bytes become dots, the leading one is dropped
+  size_ = (uint8_t)(cur - offset - 1);
+  const uint8_t* labels = data + offset + 1;
+  ::memcpy(text_, labels, size_);
+  for (size_t pos = data[offset]; pos < size_; pos += 1 + labels[pos])
+    text_[pos] = '.';
+
+  // A dot in wire label shows up as an extra label here
+  return Finish() && label_count_ == wire_labels;
+}
+
+bool CrQName::Assign(const char* name, size_t size) {
+  return Copy(name, size) && Finish();
+}
+
+bool CrQName::AssignAnyBytes(const char* name, size_t size) {
+  return Copy(name, size) && Finish(false);
+}
+
+bool CrQName::Copy(const char* name, size_t size) {
+  Clear();
+  if (size > 0 && name[size - 1] == '.')
+    --size;
+  if (size > kMaxSize - 1)
+    return false;
+  size_ = (uint8_t)size;
+  ::memcpy(text_, name, size_);
+  return true;
+}
+
+void CrQName::Clear() {
+  size_ = 0;
+  label_count_ = 0;
+  hash_ = 0;
+  text_[0] = '\0';
+}
+
+// Lowercases the name in place, checks every byte unless told otherwise,
+// finds label boundaries and hashes the result, 16 bytes at a time where
+// SSE2 is available.
+bool CrQName::Finish(bool hostname_only) {
+  bool valid = true;
+  size_t dots = 0;
+  label_[0] = 0;
+
+#ifdef __SSE2__
+  const __m128i dot = _mm_set1_epi8('.');
+  for (size_t i = 0; i < size_; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(text_ + i));
+    __m128i upper = in_range(v, 'A', 'Z');
+    v = _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+    __m128i is_dot = _mm_cmpeq_epi8(v, dot);
+    __m128i ok = _mm_or_si128(
+        _mm_or_si128(in_range(v, 'a', 'z'), in_range(v, '0', '9')),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))),
+            is_dot));
+    _mm_storeu_si128((__m128i*)(text_ + i), v);
+
+    unsigned int tail = size_ - i < 16 ? (1u << (size_ - i)) - 1 : 0xFFFF;
+    if (hostname_only && (~_mm_movemask_epi8(ok) & tail) != 0)
+      valid = false;
+    unsigned int dot_mask = _mm_movemask_epi8(is_dot) & tail;
+    while (dot_mask != 0 && dots + 1 < kMaxLabels) {
+      label_[++dots] = (uint8_t)(i + __builtin_ctz(dot_mask) + 1);
+      dot_mask &= dot_mask - 1;
+    }
+  }
+#else
+  for (size_t i = 0; i < size_; ++i) {
+    uint8_t c = (uint8_t)text_[i];
+    if (c >= 'A' && c <= 'Z')
+      text_[i] = c = (uint8_t)(c + ('a' - 'A'));
+    if (c == '.') {
+      if (dots + 1 < kMaxLabels)
+        label_[++dots] = (uint8_t)(i + 1);
+    } else if (hostname_only && !is_hostname_char(c)) {
+      valid = false;
+    }
+  }
+#endif
+
+  // Clear what vector stores left past the end, the hash reads whole words
+  ::memset(text_ + size_, 0, sizeof(uint64_t));
+
+  label_count_ = size_ == 0 ? 0 : (uint8_t)(dots + 1);
+  for (size_t i = 1; valid && i < label_count_; ++i) {
+    valid = label_[i] - label_[i - 1] >= 2;
+  }
+  if (!valid || (size_ != 0 && (text_[0] == '.' || text_[size_ - 1] == '.'))) {
+    Clear();
+    return false;
+  }
+
+  uint64_t hash = size_ * kHashMul;
+  for (size_t i = 0; i < size_; i += sizeof(uint64_t)) {
+    uint64_t word;
+    ::memcpy(&word, text_ + i, sizeof(word));
+    hash = (hash ^ word) * kHashMul;
+    hash ^= hash >> 29;
+  }
+  // Finalizer of MurmurHash3
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+  hash_ = hash;
+  return true;
+}
+
+std::ostream& operator<<(std::ostream& out, const CrQName& name) {
+  return out.write(name.text_, name.size_);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_QNAME_H_
+#define _CR_QNAME_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+// Lowercased domain name in presentation format, with its label boundaries
+// and hash computed once. This is the key of every name lookup, it lives
+// inline so building one never touches the heap.
+class CrQName {
+ public:
+  static const size_t kMaxSize = 255;
+  static const size_t kMaxLabels = 128;
+
+  CrQName() : size_(0), label_count_(0), hash_(0) { text_[0] = '\0'; }
+
+  // Builds from an uncompressed wire name at offset. Returns false if the
+  // name is compressed, malformed, or has bytes that need escaping, caller
+  // should fall back to Assign with the presentation format then.
+  bool FromWire(const uint8_t* data, size_t size, size_t offset);
+  // Builds from a name in presentation format
+  bool Assign(const char* name, size_t size);
+  bool Assign(const std::string& name) {
+    return Assign(name.data(), name.size());
+  }
+  // Same as Assign, but keeps bytes outside of hostname characters as they
+  // are, such as escapes of CrDNSMessage::NameToString, so rules still see
+  // the rest of the name
+  bool AssignAnyBytes(const char* name, size_t size);
+  void Clear();
+
+  const char* Text() const { return text_; }
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+  uint64_t Hash() const { return hash_; }
+  size_t LabelCount() const { return label_count_; }
+  // Name from the label at index to the end, index 0 is the whole name
+  const char* Suffix(size_t index) const { return text_ + label_[index]; }
+  size_t SuffixSize(size_t index) const { return size_ - label_[index]; }
+  // Size of the label at index, without the dot
+  size_t LabelSize(size_t index) const {
+    return (index + 1 < label_count_ ? label_[index + 1] - 1 : size_) -
+           label_[index];
+  }
+  std::string ToString() const { return std::string(text_, size_); }
+
+  bool operator==(const CrQName& rhs) const {
+    return hash_ == rhs.hash_ && size_ == rhs.size_ &&
+           ::memcmp(text_, rhs.text_, size_) == 0;
+  }
+  bool operator!=(const CrQName& rhs) const { return !(*this == rhs); }
+
+  friend std::ostream& operator<<(std::ostream& out, const CrQName& name);
+
+ private:
+  // Vector loads run past the end of name, keep them inside the buffer
+  static const size_t kPadding = 16;
+
+  uint8_t size_;
+  uint8_t label_count_;
+  uint8_t label_[kMaxLabels];
+  uint64_t hash_;
+  char text_[kMaxSize + 1 + kPadding];
+
+  bool Finish(bool hostname_only = true);
+  bool Copy(const char* name, size_t size);
+};
+
+namespace std {
+template <>
+struct hash<CrQName> {
+  std::size_t operator()(const CrQName& name) const {
+    return (std::size_t)name.Hash();
+  }
+};
+}  // namespace std
+
+#endif
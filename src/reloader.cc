@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reloader.h"
+
+#include <csignal>
+
+#include "answer_cache.h"
+#include "crappydns.h"
+#include "hosts/hosts.h"
+#include "trusted_net.h"
+
+CrReloader::CrReloader(uv_loop_t* uv_loop)
+    : uv_loop_(uv_loop),
+      uv_signal_(new uv_signal_t),
+      work_(),
+      running_(false),
+      pending_(false),
+      failed_(false),
+      started_at_(0),
+      trusted_net_(nullptr),
+      hosts_(nullptr) {
+  uv_signal_init(uv_loop_, uv_signal_);
+  uv_signal_->data = this;
+  work_.data = this;
+}
+
+CrReloader::~CrReloader() {
+  uv_close((uv_handle_t*)uv_signal_,
+           [](uv_handle_t* handle) { delete (uv_signal_t*)handle; });
+}
+
+void CrReloader::Start() {
+  uv_signal_start(
+      uv_signal_,
+      [](uv_signal_t* handle, int signum) {
+        ((CrReloader*)handle->data)->Reload();
+      },
+      SIGHUP);
+  uv_unref((uv_handle_t*)uv_signal_);
+}
+
+void CrReloader::Reload() {
+  if (running_) {
+    pending_ = true;
+    return;
+  }
+
+  INFO << "[Reloader] Reloading" << ENDL;
+  running_ = true;
+  pending_ = false;
+  started_at_ = uv_hrtime();
+  uv_queue_work(uv_loop_, &work_,
+                [](uv_work_t* work) { ((CrReloader*)work->data)->Load(); },
+                [](uv_work_t* work, int status) {
+                  ((CrReloader*)work->data)->Publish();
+                });
+}
+
+// Runs on the thread pool, only touches its own objects and paths which
+// never change after startup
+void CrReloader::Load() {
+  failed_ = false;
+  trusted_net_ = nullptr;
+  hosts_ = nullptr;
+
+  bool trusted_net_failed = false, hosts_failed = false;
+  ParallelFor(2, [&](size_t job) {
+    if (job == 0 && CrConfig::trusted_net_path) {
+      trusted_net_ = std::make_shared<CrTrustedNet>();
+      trusted_net_failed =
+          trusted_net_->LoadFile(CrConfig::trusted_net_path) != 0;
+    } else if (job == 1 && CrConfig::hosts_path) {
+      hosts_ = std::make_shared<CrappyHosts>();
+      hosts_failed = hosts_->LoadFile(CrConfig::hosts_path) != 0;
+    }
+  });
+
+  if (trusted_net_failed) {
+    ERR << "[Reloader] Failed to open " << CrConfig::trusted_net_path << ENDL;
+  }
+  if (hosts_failed) {
+    ERR << "[Reloader] Failed to open " << CrConfig::hosts_path << ENDL;
+  }
+  failed_ = trusted_net_failed || hosts_failed;
+}
+
+void CrReloader::Publish() {
+  running_ = false;
+
+  // Keep serving with the old snapshots rather than a partial reload
+  if (failed_) {
+    WARN << "[Reloader] Reload aborted, nothing changed" << ENDL;
+  } else {
+    if (trusted_net_) {
+      std::atomic_store(&CrConfig::trusted_net,
+                        std::shared_ptr<const CrTrustedNet>(trusted_net_));
+      // Cached answers were picked with the old one
+      if (CrConfig::answer_cache != nullptr)
+        CrConfig::answer_cache->Invalidate();
+    }
+    if (hosts_)
+      std::atomic_store(&CrConfig::hosts,
+                        std::shared_ptr<const CrappyHosts>(hosts_));
+    INFO << "[Reloader] Reloaded in " << (uv_hrtime() - started_at_) / 1000000
+         << "ms" << ENDL;
+  }
+  trusted_net_ = nullptr;
+  hosts_ = nullptr;
+
+  if (pending_)
+    Reload();
+}
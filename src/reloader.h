@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_RELOADER_H_
+#define _CR_RELOADER_H_
+
+#include <memory>
+
+#include <uv.h>
+
+class CrappyHosts;
+class CrTrustedNet;
+
+// Reloads trusted net and hosts from their files on SIGHUP, and loads them
+// the first time with --early-start. Files are loaded on the libuv thread
+// pool, then the new snapshots replace the ones in CrConfig at once,
+// sessions in flight keep what they started with.
+class CrReloader {
+ public:
+  CrReloader(uv_loop_t* uv_loop);
+  ~CrReloader();
+
+  void Start();
+  void Reload();
+
+ private:
+  uv_loop_t* uv_loop_;
+  uv_signal_t* uv_signal_;
+  uv_work_t work_;
+  bool running_;
+  // Another reload was asked for while running, files may have changed
+  // after they were read
+  bool pending_;
+  bool failed_;
+  uint64_t started_at_;
+  std::shared_ptr<CrTrustedNet> trusted_net_;
+  std::shared_ptr<CrappyHosts> hosts_;
+
+  void Load();
+  void Publish();
+};
+
+#endif
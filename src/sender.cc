@@ -19,6 +19,9 @@
 
 #include "sender.h"
 
+#include <algorithm>
+#include <sstream>
+
 #include "session.h"
 #include "worker/tcp_worker.h"
 #include "worker/udp_worker.h"
@@ -26,23 +29,28 @@
 
 std::shared_ptr<CrWorker> CreateWorker(
     uv_loop_t* uv_loop,
+    CrTimerWheel* timer_wheel,
     std::shared_ptr<const CrDNSServer> server) {
   std::shared_ptr<CrWorker> worker;
   switch (server->proctol) {
     case CrDNSServer::Proctol::kUDP:
-      return std::make_shared<UDPWorker>(uv_loop, server);
+      return std::make_shared<UDPWorker>(uv_loop, timer_wheel, server);
       break;
     case CrDNSServer::Proctol::kTCP:
-      return std::make_shared<TCPWorker>(uv_loop, server);
+      return std::make_shared<TCPWorker>(uv_loop, timer_wheel, server);
       break;
     default:
       return nullptr;
   }
 }
 
+CrappySender::~CrappySender() {
+  timer_wheel_->Stop(&prune_timer_);
+}
+
 std::shared_ptr<CrWorker> CrappySender::RegisterDNSServer(
     std::shared_ptr<const CrDNSServer> server) {
-  auto worker = CreateWorker(uv_loop_, server);
+  auto worker = CreateWorker(uv_loop_, timer_wheel_, server);
   if (worker != nullptr) {
     worker->recv_cb_ = recv_cb_;
     worker->send_cb_ = send_cb_;
@@ -51,25 +59,141 @@ std::shared_ptr<CrWorker> CrappySender::RegisterDNSServer(
   return worker;
 }
 
-void CrappySender::Send(std::shared_ptr<CrSession> session) {
-  for (auto&& worker : worker_list_) {
-    worker->Send(session);
-    ++session->response_on_the_way_;
+void CrappySender::Send(CrSession* session) {
+  for (auto& worker : worker_list_) {
+    if (UNLIKELY(worker->Degraded()))
+      worker = Upgrade(worker);
+    targets_.push_back(worker);
   }
+  Deliver(session);
 }
 
-void CrappySender::SendTo(std::shared_ptr<CrSession> session,
-                          std::shared_ptr<const CrDNSServer> server) {
-  std::shared_ptr<CrWorker> worker = nullptr;
-  if (worker_map_.find(*server) != worker_map_.end()) {
-    worker = worker_map_[*server];
-  } else {
-    worker = CreateWorker(uv_loop_, server);
-    if (worker == nullptr)
-      return;
-    worker->recv_cb_ = recv_cb_;
-    worker->send_cb_ = send_cb_;
-    worker_map_.insert({*server, worker});
+void CrappySender::SendTo(
+    CrSession* session,
+    const std::list<std::shared_ptr<CrDNSServer>>& servers) {
+  for (const auto& server : servers) {
+    auto worker = WorkerFor(server);
+    if (worker != nullptr)
+      targets_.push_back(worker);
+  }
+  Deliver(session);
+}
+
+std::shared_ptr<CrWorker> CrappySender::WorkerFor(
+    std::shared_ptr<const CrDNSServer> server) {
+  auto it = worker_map_.find(*server);
+  if (it != worker_map_.end()) {
+    if (UNLIKELY(it->second->Degraded()))
+      it->second = Upgrade(it->second);
+    return it->second;
+  }
+
+  auto worker = CreateWorker(uv_loop_, timer_wheel_, server);
+  if (worker == nullptr)
+    return nullptr;
+  worker->recv_cb_ = recv_cb_;
+  worker->send_cb_ = send_cb_;
+  worker_map_.insert({*server, worker});
+  return worker;
+}
+
+void CrappySender::Deliver(CrSession* session) {
+  for (const auto& worker : targets_) {
+    carriers_.push_back(worker.get());
+  }
+  for (const auto& worker : targets_) {
+    if (Deliver(worker, session))
+      ++session->response_on_the_way_;
+  }
+  targets_.clear();
+  carriers_.clear();
+}
+
+void CrappySender::CollectStats(std::vector<std::string>& lines) const {
+  for (const auto& worker : worker_list_) {
+    std::ostringstream line;
+    worker->ReportStats(line);
+    lines.push_back(line.str());
+  }
+  for (const auto& worker_pair : worker_map_) {
+    std::ostringstream line;
+    worker_pair.second->ReportStats(line);
+    lines.push_back(line.str());
+  }
+}
+
+std::shared_ptr<CrWorker> CrappySender::Upgrade(
+    std::shared_ptr<CrWorker> worker) {
+  auto server = std::make_shared<CrDNSServer>(*worker->RemoteServer());
+  server->proctol = CrDNSServer::Proctol::kTCP;
+  auto upgraded = CreateWorker(uv_loop_, timer_wheel_, server);
+  upgraded->recv_cb_ = recv_cb_;
+  upgraded->send_cb_ = send_cb_;
+  worker->drained_cb_ = [this]() { timer_wheel_->Start(&prune_timer_, 0); };
+  retired_list_.push_back(worker);
+  // It may have nothing left in flight already
+  timer_wheel_->Start(&prune_timer_, 0);
+
+  WARN << "[Sender] " << *worker->RemoteServer() << " is lossy, switch to "
+       << *server << ENDL;
+  return upgraded;
+}
+
+void CrappySender::PruneRetired() {
+  retired_list_.remove_if([](const std::shared_ptr<CrWorker>& retired) {
+    return retired->InFlight() == 0 && retired->QueueDepth() == 0;
+  });
+}
+
+bool CrappySender::Deliver(std::shared_ptr<CrWorker> worker,
+                           CrSession* session) {
+  if (worker->Send(session) != UV_ENOBUFS)
+    return true;
+
+  if (CrConfig::overflow == CrConfig::Overflow::kReroute &&
+      Reroute(worker, session)) {
+    ++worker->GetStats().rerouted;
+    return true;
   }
-  worker->Send(session);
+
+  ++worker->GetStats().dropped_overflow;
+  VERB("[" << session->session_id_ << "][Sender] " << *worker->RemoteServer()
+           << " overflowed, query dropped");
+  return false;
+}
+
+bool CrappySender::Reroute(std::shared_ptr<CrWorker> worker,
+                           CrSession* session) {
+  // Look for an upstream with the same health which is not carrying this
+  // query, nor going to. Queries for a dedicated server group may fall back
+  // to the healthy upstreams.
+  auto health = worker->RemoteServer()->health;
+  std::shared_ptr<CrWorker> target = nullptr;
+  auto pick = [&](const std::shared_ptr<CrWorker>& candidate) {
+    auto candidate_health = candidate->RemoteServer()->health;
+    if ((candidate_health != health &&
+         !(health == CrDNSServer::Health::kTrusted &&
+           candidate_health == CrDNSServer::Health::kHealthy)) ||
+        !candidate->Acceptable() ||
+        std::find(carriers_.begin(), carriers_.end(), candidate.get()) !=
+            carriers_.end())
+      return;
+    if (target == nullptr ||
+        candidate->InFlight() + candidate->QueueDepth() <
+            target->InFlight() + target->QueueDepth())
+      target = candidate;
+  };
+
+  for (const auto& candidate : worker_list_)
+    pick(candidate);
+  for (const auto& worker_pair : worker_map_)
+    pick(worker_pair.second);
+
+  if (target == nullptr || target->Send(session) == UV_ENOBUFS)
+    return false;
+  carriers_.push_back(target.get());
+
+  VERB("[" << session->session_id_ << "][Sender] Rerouted from "
+           << *worker->RemoteServer() << " to " << *target->RemoteServer());
+  return true;
 }
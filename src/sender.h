@@ -22,37 +22,74 @@
 
 #include <functional>
 #include <list>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "crappydns.h"
+#include "timer_wheel.h"
 
 class CrSession;
 class CrWorker;
 
 class CrappySender {
  public:
-  CrappySender(uv_loop_t* uv_loop)
+  CrappySender(uv_loop_t* uv_loop, CrTimerWheel* timer_wheel)
       : recv_cb_(nullptr),
         send_cb_(nullptr),
         uv_loop_(uv_loop),
+        timer_wheel_(timer_wheel),
         worker_list_(),
-        worker_map_() {}
-  ~CrappySender() {}
+        worker_map_(),
+        retired_list_(),
+        prune_timer_(),
+        targets_(),
+        carriers_() {
+    prune_timer_.data = this;
+    prune_timer_.cb = [](CrTimer* timer) {
+      ((CrappySender*)timer->data)->PruneRetired();
+    };
+  }
+  ~CrappySender();
 
   std::function<void(CrPacket)> recv_cb_;
-  std::function<void(uint16_t, std::shared_ptr<const CrDNSServer>, int)>
+  std::function<void(uint32_t, std::shared_ptr<const CrDNSServer>, int)>
       send_cb_;
 
   std::shared_ptr<CrWorker> RegisterDNSServer(
       std::shared_ptr<const CrDNSServer> server);
-  void Send(std::shared_ptr<CrSession> session);
-  void SendTo(std::shared_ptr<CrSession> session,
-              std::shared_ptr<const CrDNSServer> server);
+  // Broadcasts to every upstream worker
+  void Send(CrSession* session);
+  // Sends to the workers of a dedicated server group
+  void SendTo(CrSession* session,
+              const std::list<std::shared_ptr<CrDNSServer>>& servers);
+  // Appends a line of stats for each upstream worker
+  void CollectStats(std::vector<std::string>& lines) const;
 
  private:
   uv_loop_t* uv_loop_;
+  CrTimerWheel* timer_wheel_;
   std::list<std::shared_ptr<CrWorker>> worker_list_;
   std::unordered_map<CrDNSServer, std::shared_ptr<CrWorker>> worker_map_;
+  // Replaced workers, kept until their in-flight queries are done
+  std::list<std::shared_ptr<CrWorker>> retired_list_;
+  // A worker can not be released from its own callback, the drained ones
+  // are pruned on the next tick
+  CrTimer prune_timer_;
+  // Workers of the query being sent, and every worker carrying it so far,
+  // a reroute never goes to one of those. Reused for every query.
+  std::vector<std::shared_ptr<CrWorker>> targets_;
+  std::vector<const CrWorker*> carriers_;
+
+  std::shared_ptr<CrWorker> Upgrade(std::shared_ptr<CrWorker> worker);
+  void PruneRetired();
+  std::shared_ptr<CrWorker> WorkerFor(
+      std::shared_ptr<const CrDNSServer> server);
+  void Deliver(CrSession* session);
+  bool Deliver(std::shared_ptr<CrWorker> worker,
+               CrSession* session);
+  bool Reroute(std::shared_ptr<CrWorker> worker,
+               CrSession* session);
 };
 
 #endif
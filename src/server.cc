@@ -19,6 +19,16 @@
 
 #include "server.h"
 
+#include <cerrno>
+#include <vector>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include "dns_message.h"
+
 #include "session.h"
 
 static void alloc_buffer(uv_handle_t* handle,
@@ -28,11 +38,19 @@ static void alloc_buffer(uv_handle_t* handle,
   buf->len = UDP_BUF_SIZE;
 }
 
+struct SendRequest {
+  uv_udp_send_t req;
+  CrappyServer* server;
+  // Keep response alive until it has been sent, the session may not
+  std::shared_ptr<const u8_vec> payload;
+};
+
 static void send_cb(uv_udp_send_t* req, int status) {
-  CrappyServer* self = (CrappyServer*)((uv_req_t*)req)->data;
+  SendRequest* send_req = (SendRequest*)((uv_req_t*)req)->data;
+  CrappyServer* self = send_req->server;
   if (self->send_cb_)
     self->send_cb_(status);
-  delete req;
+  delete send_req;
 }
 
 static void close_cb(uv_handle_t* handle) {
@@ -74,24 +92,116 @@ CrappyServer::~CrappyServer() {
   }
 }
 
-int CrappyServer::Serve(const struct sockaddr* addr, unsigned int flags) {
-  int rtn = uv_udp_bind(uv_udp_, addr, flags);
+int CrappyServer::Serve(const struct sockaddr* addr,
+                        unsigned int flags,
+                        bool reuse_port) {
+  int rtn =
+      reuse_port ? BindReusePort(addr) : uv_udp_bind(uv_udp_, addr, flags);
   if (rtn < 0)
     return rtn;
   return uv_udp_recv_start(uv_udp_, &alloc_buffer, &recv_cb);
 }
 
-int CrappyServer::Send(std::shared_ptr<const CrSession> session) {
-  uv_udp_send_t* req = new uv_udp_send_t;
-  ((uv_req_t*)req)->data = this;
-  uv_buf_t buf = uv_buf_init((char*)session->candidate_response_->data(),
-                             (uint)session->candidate_response_->size());
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+// Reuseport program picking a socket by FNV-1a hash of the question name,
+// ignoring case. Returning an index beyond the sockets makes the kernel fall
+// back to its own hash. Classic BPF has no loops, so each byte of the name
+// gets steps of its own, bounds checked against packet length.
+static std::vector<struct sock_filter> name_steering_program(
+    unsigned int count) {
+  static const uint32_t kFallback = UINT32_MAX;
+  static const uint32_t kFNVOffset = 2166136261u;
+  static const uint32_t kFNVPrime = 16777619u;
+  static const size_t kMaxNameSize = 255;
+  static const uint32_t kHeaderSize = CrDNSMessage::kHeaderSize;
+
+  std::vector<struct sock_filter> program;
+  std::vector<size_t> to_done, to_fallback;
+  auto emit = [&program](uint16_t code, uint32_t k, uint8_t jt, uint8_t jf) {
+    program.push_back(BPF_JUMP(code, k, jt, jf));
+  };
+  // Goes to a step patched in later unless the test holds
+  auto bail_unless = [&](uint16_t code, uint32_t k, std::vector<size_t>& to) {
+    emit(BPF_JMP | code | BPF_K, k, 1, 0);
+    to.push_back(program.size());
+    emit(BPF_JMP | BPF_JA, 0, 0, 0);
+  };
+
+  // A single question, with at least a byte of name
+  emit(BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+  bail_unless(BPF_JGT, kHeaderSize, to_fallback);
+  emit(BPF_LD | BPF_H | BPF_ABS, 4, 0, 0);
+  bail_unless(BPF_JEQ, 1, to_fallback);
+
+  emit(BPF_LDX | BPF_W | BPF_IMM, kFNVOffset, 0, 0);
+  for (uint32_t offset = kHeaderSize; offset < kHeaderSize + kMaxNameSize;
+       ++offset) {
+    emit(BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+    bail_unless(BPF_JGT, offset, to_fallback);
+    emit(BPF_LD | BPF_B | BPF_ABS, offset, 0, 0);
+    // Root label ends the name
+    emit(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+    to_done.push_back(program.size());
+    emit(BPF_JMP | BPF_JA, 0, 0, 0);
+    emit(BPF_ALU | BPF_OR | BPF_K, 0x20, 0, 0);
+    emit(BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0);
+    emit(BPF_ALU | BPF_MUL | BPF_K, kFNVPrime, 0, 0);
+    emit(BPF_MISC | BPF_TAX, 0, 0, 0);
+  }
+
+  // Low bits of FNV-1a are weak, mix them before taking the index
+  size_t done = program.size();
+  emit(BPF_MISC | BPF_TXA, 0, 0, 0);
+  emit(BPF_ALU | BPF_RSH | BPF_K, 16, 0, 0);
+  emit(BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0);
+  emit(BPF_ALU | BPF_MUL | BPF_K, 0x45d9f3b, 0, 0);
+  emit(BPF_MISC | BPF_TAX, 0, 0, 0);
+  emit(BPF_ALU | BPF_RSH | BPF_K, 16, 0, 0);
+  emit(BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0);
+  emit(BPF_ALU | BPF_MOD | BPF_K, count, 0, 0);
+  emit(BPF_RET | BPF_A, 0, 0, 0);
+  size_t fallback = program.size();
+  emit(BPF_RET | BPF_K, kFallback, 0, 0);
+
+  for (size_t at : to_done)
+    program[at].k = done - at - 1;
+  for (size_t at : to_fallback)
+    program[at].k = fallback - at - 1;
+  return program;
+}
+#endif
+
+int CrappyServer::SteerByName(unsigned int count) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  uv_os_fd_t fd;
+  int rtn = uv_fileno((uv_handle_t*)uv_udp_, &fd);
+  if (rtn != 0)
+    return rtn;
+
+  auto program = name_steering_program(count);
+  struct sock_fprog fprog = {(unsigned short)program.size(), program.data()};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog,
+                 sizeof(fprog)) != 0)
+    return -errno;
+  return 0;
+#else
+  return UV_ENOTSUP;
+#endif
+}
+
+int CrappyServer::Send(const CrSession* session) {
+  SendRequest* send_req = new SendRequest{
+      .req = {}, .server = this, .payload = session->candidate_response_};
+  uv_udp_send_t* req = &send_req->req;
+  ((uv_req_t*)req)->data = send_req;
+  uv_buf_t buf = uv_buf_init((char*)send_req->payload->data(),
+                             (uint)send_req->payload->size());
   int rtn =
       uv_udp_send(req, uv_udp_, &buf, 1,
                   (const struct sockaddr*)session->reply_to_.get(), &send_cb);
 
   if (rtn != 0) {
-    delete req;
+    delete send_req;
     Close();
   }
 
@@ -108,3 +218,27 @@ void CrappyServer::Close() {
     uv_udp_ = nullptr;
   }
 }
+
+// libuv only sets SO_REUSEADDR, which does not spread datagrams on Linux,
+// so bind the socket here and hand it over
+int CrappyServer::BindReusePort(const struct sockaddr* addr) {
+#ifdef SO_REUSEPORT
+  int fd = socket(addr->sa_family, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -errno;
+
+  int on = 1;
+  int rtn = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+      bind(fd, addr, get_sockaddr_size(addr)) != 0) {
+    rtn = -errno;
+  } else {
+    rtn = uv_udp_open(uv_udp_, fd);
+  }
+  if (rtn != 0)
+    ::close(fd);
+  return rtn;
+#else
+  return UV_ENOTSUP;
+#endif
+}
@@ -35,13 +35,23 @@ class CrappyServer {
   std::function<void(int)> send_cb_;
   std::function<void(CrPacket)> recv_cb_;
 
-  int Serve(const struct sockaddr* addr, unsigned int flags);
-  int Send(std::shared_ptr<const CrSession> session);
+  // With reuse_port, other servers may bind the same address and port, the
+  // kernel spreads requests among them
+  int Serve(const struct sockaddr* addr,
+            unsigned int flags,
+            bool reuse_port = false);
+  // Among count servers bound with reuse_port, in the order they were bound,
+  // sends every query for a name to the same one. Anything not looking like
+  // a query is left to the kernel to spread as before.
+  int SteerByName(unsigned int count);
+  int Send(const CrSession* session);
   int Shutdown();
   void Close();
 
  private:
   uv_udp_t* uv_udp_;
+
+  int BindReusePort(const struct sockaddr* addr);
 };
 
 #endif
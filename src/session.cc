@@ -19,114 +19,227 @@
 
 #include "session.h"
 
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
 #include <arpa/nameser_compat.h>
 
+#include "answer_cache.h"
 #include "hosts/hosts.h"
 #include "hosts/rule.h"
 #include "session_manager.h"
 #include "trusted_net.h"
 
-CrSession::CrSession(CrSessionManager* manager, CrPacket packet)
+CrSession::CrSession()
     : status_(Status::kInit),
-      manager_(manager),
+      manager_(nullptr),
       raw_id_(0),
       query_type_(0),
-      pipelined_id_(0),
+      answer_kind_(CrAnswerCache::kNone),
+      answer_generation_(0),
+      answer_name_size_(0),
+      session_id_(0),
       response_on_the_way_(0),
+      created_at_(0),
+      deadline_(0),
       query_name_(),
-      request_payload_(packet.payload),
+      request_payload_(nullptr),
       candidate_response_(nullptr),
       matched_rule_(nullptr),
-      reply_to_(packet.addr),
-      uv_timer_(nullptr) {
-  ns_msg msg;
-  if (ns_initparse((const unsigned char*)request_payload_->data(),
-                   request_payload_->size(), &msg) < 0) {
+      hosts_(nullptr),
+      trusted_net_(nullptr),
+      reply_to_(nullptr),
+      due_(0),
+      timer_(),
+      timer_wheel_(nullptr) {}
+
+CrSession::~CrSession() {
+  Close();
+}
+
+void CrSession::Open(CrSessionManager* manager,
+                     uint32_t session_id,
+                     CrPacket packet) {
+  status_ = Status::kInit;
+  manager_ = manager;
+  raw_id_ = 0;
+  query_type_ = 0;
+  answer_kind_ = CrAnswerCache::kNone;
+  answer_name_size_ = 0;
+  session_id_ = session_id;
+  response_on_the_way_ = 0;
+  created_at_ = deadline_ = due_ = 0;
+  request_payload_ = packet.payload;
+  reply_to_ = packet.addr;
+  // Before the trusted net, or an answer checked with a net reloaded since
+  // may be stored under the new generation
+  answer_generation_ = CrConfig::answer_cache != nullptr
+                           ? CrConfig::answer_cache->Generation()
+                           : 0;
+  trusted_net_ = std::atomic_load(&CrConfig::trusted_net);
+
+  CrDNSMessage msg;
+  if (!msg.Parse(request_payload_->data(), request_payload_->size())) {
     // TODO: Prompt dns parse error
     status_ = Status::kBadRequest;
     return;
   }
 
-  raw_id_ = ns_msg_id(msg);
-  pipelined_id_ = manager->GenPipelinedID();
+  raw_id_ = msg.Id();
 
-  ns_put16(pipelined_id_, (unsigned char*)request_payload_->data());
+  CrDNSMessage::RR rr;
+  auto questions = msg.Records(CrDNSMessage::kQuestion);
+  if (questions.Next(rr)) {
+    bool named = query_name_.FromWire(msg.Data(), msg.Size(), rr.name);
+    if (!named) {
+      // Compressed or escaped, rare enough to go through the slow path
+      char name[CrDNSMessage::kMaxNameSize];
+      size_t size = msg.NameToString(rr.name, name, sizeof(name));
+      named = size != 0 && query_name_.AssignAnyBytes(name, size);
+    }
+    query_type_ = rr.type;
+    answer_name_size_ = (uint16_t)msg.NameToWire(rr.name, answer_name_,
+                                                 sizeof(answer_name_));
+    if (msg.Count(CrDNSMessage::kQuestion) == 1 && answer_name_size_ != 0) {
+      answer_kind_ = CrAnswerCache::Kind(msg, rr);
+    }
 
-  ns_rr rr;
-  uint16_t qdcount = ns_msg_count(msg, ns_s_qd);
-  if (qdcount >= 1 && ns_parserr(&msg, ns_s_qd, 0, &rr) == 0 &&
-      (ns_rr_type(rr) == ns_t_a || ns_rr_type(rr) == ns_t_aaaa)) {
-    query_name_ = ns_rr_name(rr);
-    query_type_ = ns_rr_type(rr);
-    matched_rule_ = CrConfig::hosts.Match(query_name_, query_type_);
-    if (matched_rule_ != nullptr) {
-      status_ = Status::kDedicated;
+    hosts_ = std::atomic_load(&CrConfig::hosts);
+    auto action = named ? hosts_->Blocklist().Match(query_name_)
+                        : CrBlocklist::Action::kPass;
+    if (!named) {
+      // Too long once escaped, or malformed. An empty name would match as
+      // the root, so no rule applies and it goes upstream as it is.
+      VERB("[" << session_id_ << "] Query " << raw_id_
+               << " has a name no rule can match");
+    } else if (action != CrBlocklist::Action::kPass) {
+      candidate_response_ = CrBlocklist::Respond(
+          action, msg.Data(), questions.Offset(), query_type_);
+      status_ = Status::kBlocked;
+    } else if (rr.type == ns_t_a || rr.type == ns_t_aaaa) {
+      if (!manager_->MatchHosts(*hosts_, query_name_, query_type_,
+                                matched_rule_)) {
+        // A slow rule may match, dispatched once it is matched
+        status_ = Status::kMatching;
+      } else if (matched_rule_ != nullptr) {
+        status_ = Status::kDedicated;
+      }
     }
-    VERB("[" << pipelined_id_ << "] Query " << raw_id_ << ": " << query_name_);
+    VERB("[" << session_id_ << "] Query " << raw_id_ << ": " << query_name_);
   }
 }
 
-CrSession::~CrSession() {
-  if (uv_timer_ != nullptr) {
-    uv_timer_stop(uv_timer_);
-    uv_close((uv_handle_t*)uv_timer_,
-             [](uv_handle_t* handle) { delete handle; });
+void CrSession::Close() {
+  manager_ = nullptr;
+  if (timer_wheel_ != nullptr) {
+    timer_wheel_->Stop(&timer_);
+    timer_wheel_ = nullptr;
   }
+  query_name_.Clear();
+  request_payload_ = nullptr;
+  candidate_response_ = nullptr;
+  matched_rule_ = nullptr;
+  hosts_ = nullptr;
+  trusted_net_ = nullptr;
+  reply_to_ = nullptr;
 }
 
-void CrSession::SetTimer(uv_loop_t* uv_loop, uint64_t timeout) {
-  uv_timer_ = new uv_timer_t;
-  uv_timer_->data = this;
-  uv_timer_init(uv_loop, uv_timer_);
-  uv_timer_start(
-      uv_timer_,
-      [](uv_timer_t* handle) {
-        CrSession* session = (CrSession*)handle->data;
-        session->manager_->Resolve(session->pipelined_id_);
-      },
-      timeout, 0);
+void CrSession::SetTimer(CrTimerWheel* timer_wheel, uint64_t timeout) {
+  timer_wheel_ = timer_wheel;
+  created_at_ = timer_wheel_->Now();
+  deadline_ = created_at_ + timeout;
+
+  timer_.data = this;
+  timer_.cb = [](CrTimer* timer) { ((CrSession*)timer->data)->OnTimeout(); };
+
+  // In SLO mode, wake up at the target latency to see if there is any
+  // candidate could be returned
+  if (CrConfig::slo_in_ms != 0 && CrConfig::slo_in_ms < timeout) {
+    ArmTimer(created_at_ + CrConfig::slo_in_ms);
+  } else {
+    ArmTimer(deadline_);
+  }
 }
 
-void CrSession::Resolve(CrPacket& response, ns_msg& msg) {
+void CrSession::Expedite(uint64_t due) {
+  if (timer_wheel_ != nullptr && due < due_) {
+    VERB("[" << session_id_ << "] Deadline moved " << due_ - due
+             << "ms earlier");
+    ArmTimer(due);
+  }
+}
+
+void CrSession::ArmTimer(uint64_t due) {
+  uint64_t now = timer_wheel_->Now();
+  due_ = due;
+  timer_wheel_->Start(&timer_, due > now ? due - now : 0);
+}
+
+void CrSession::OnTimeout() {
+  if (candidate_response_ == nullptr && due_ < deadline_) {
+    ArmTimer(deadline_);
+    return;
+  }
+  manager_->Resolve(session_id_);
+}
+
+void CrSession::Resolve(CrPacket& response, const CrDNSMessage& msg) {
   --response_on_the_way_;
 
-  uint16_t rrmax = ns_msg_count(msg, ns_s_an);
-  if (rrmax == 0) {
+  if (msg.Count(CrDNSMessage::kAnswer) == 0) {
     candidate_response_ = response.payload;
   } else {
-    ns_rr rr;
-    for (uint16_t rrnum = 0; rrnum < rrmax; ++rrnum) {
-      if (ns_parserr(&msg, ns_s_an, rrnum, &rr) == 0) {
-        u_int type = ns_rr_type(rr);
-        const u_char* rd = ns_rr_rdata(rr);
-
-        bool from_healthy_dns =
-            response.dns_server->health == CrDNSServer::Health::kHealthy;
-
-        if (type == ns_t_a) {
-          bool in_trusted_net =
-              CrConfig::trusted_net.Contains(ntohl(*(uint32_t*)rd));
-          DEBUG("[" << pipelined_id_ << "][A]"
-                    << (from_healthy_dns ? "[HEALTHY]" : "[UNHEALTHY]")
-                    << (in_trusted_net ? "[TRUSTED]" : "[UNTRUSTED]") << " Got "
-                    << (int)*rd << "." << (int)*(rd + 1) << "."
-                    << (int)*(rd + 2) << "." << (int)*(rd + 3) << " from "
-                    << *response.dns_server);
-          Transit(in_trusted_net, from_healthy_dns, response.payload);
-        } else {
-          DEBUG("[" << pipelined_id_ << "][OTHER]"
-                    << (from_healthy_dns ? "[HEALTHY]" : "[UNHEALTHY]")
-                    << " Got response from " << *response.dns_server);
-          if (status_ == Status::kInit || status_ == Status::kWaitHealth) {
-            candidate_response_ = response.payload;
-          }
+    bool from_healthy_dns =
+        response.dns_server->health == CrDNSServer::Health::kHealthy;
+    uint32_t addrs[kMaxAddrBatch];
+    bool trusted[kMaxAddrBatch];
+    size_t addr_count = 0;
+
+    // A records are looked up in the trusted net together
+    auto transit_all = [&]() {
+      trusted_net_->Contains(addrs, addr_count, trusted);
+      for (size_t i = 0; i < addr_count; ++i) {
+        DEBUG("[" << session_id_ << "][A]"
+                  << (from_healthy_dns ? "[HEALTHY]" : "[UNHEALTHY]")
+                  << (trusted[i] ? "[TRUSTED]" : "[UNTRUSTED]") << " Got "
+                  << (addrs[i] >> 24) << "." << (addrs[i] >> 16 & 0xFF) << "."
+                  << (addrs[i] >> 8 & 0xFF) << "." << (addrs[i] & 0xFF)
+                  << " from " << *response.dns_server);
+        Transit(trusted[i], from_healthy_dns, response.payload);
+      }
+      addr_count = 0;
+    };
+
+    msg.ScanAnswers([&](uint16_t type, const uint8_t* rd, uint16_t rdlength) {
+      if (type == ns_t_a && rdlength == NS_INADDRSZ) {
+        if (addr_count == kMaxAddrBatch)
+          transit_all();
+        addrs[addr_count++] = ntohl(*(uint32_t*)rd);
+      } else if (type == ns_t_aaaa && rdlength == NS_IN6ADDRSZ) {
+        bool in_trusted_net =
+            trusted_net_->Contains(*(const struct in6_addr*)rd);
+        char addr_str[INET6_ADDRSTRLEN];
+        DEBUG("[" << session_id_ << "][AAAA]"
+                  << (from_healthy_dns ? "[HEALTHY]" : "[UNHEALTHY]")
+                  << (in_trusted_net ? "[TRUSTED]" : "[UNTRUSTED]") << " Got "
+                  << inet_ntop(AF_INET6, rd, addr_str, sizeof(addr_str))
+                  << " from " << *response.dns_server);
+        Transit(in_trusted_net, from_healthy_dns, response.payload);
+      } else {
+        DEBUG("[" << session_id_ << "][OTHER]"
+                  << (from_healthy_dns ? "[HEALTHY]" : "[UNHEALTHY]")
+                  << " Got response from " << *response.dns_server);
+        if (status_ == Status::kInit || status_ == Status::kWaitHealth) {
+          candidate_response_ = response.payload;
         }
       }
-    }
+    });
+    transit_all();
   }
 
   if (response_on_the_way_ == 0 || status_ == Status::kResolved) {
-    manager_->Resolve(pipelined_id_);
+    manager_->Resolve(session_id_);
+  } else if (status_ == Status::kWaitHealth || status_ == Status::kWaitFast) {
+    Expedite(manager_->StateDeadline(*this));
   }
 }
 
@@ -163,6 +276,9 @@ void CrSession::Transit(bool in_trusted_net,
       status_ = Status::kResolved;
       break;
     case Status::kBadRequest:
+    case Status::kBlocked:
+    case Status::kCached:
+    case Status::kMatching:
     case Status::kResolved:
       break;
   }
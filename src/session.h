@@ -20,18 +20,19 @@
 #ifndef _CR_SESSION_H_
 #define _CR_SESSION_H_
 
-#include <string>
-
-#include <arpa/nameser.h>
-
 #include "crappydns.h"
+#include "dns_message.h"
+#include "qname.h"
+#include "timer_wheel.h"
 
+class CrappyHosts;
 class HostsRule;
 class CrSessionManager;
+class CrTrustedNet;
 
 class CrSession {
  public:
-  CrSession(CrSessionManager* manager, CrPacket packet);
+  CrSession();
   ~CrSession();
 
   enum class Status {
@@ -40,7 +41,11 @@ class CrSession {
     kWaitHealth,
     kWaitFast,
     kResolved,
-    kDedicated
+    kDedicated,
+    kBlocked,
+    kCached,
+    // Waits for hosts to be matched off the loop
+    kMatching
   };
 
   Status status_;
@@ -48,23 +53,50 @@ class CrSession {
 
   uint16_t raw_id_;
   uint16_t query_type_;
-  uint16_t pipelined_id_;
+  // Key of the answer in CrAnswerCache along with answer_name_
+  uint32_t answer_kind_;
+  // Generation of CrAnswerCache the answer is checked for
+  uint32_t answer_generation_;
+  uint16_t answer_name_size_;
+  uint32_t session_id_;
   uint16_t response_on_the_way_;
 
-  std::string query_name_;
+  uint64_t created_at_;
+  uint64_t deadline_;
+
+  CrQName query_name_;
+  // Question name in lowercase wire format
+  uint8_t answer_name_[CrDNSMessage::kMaxWireNameSize + 1];
   std::shared_ptr<u8_vec> request_payload_;
   std::shared_ptr<u8_vec> candidate_response_;
   std::shared_ptr<const HostsRule> matched_rule_;
+  // Snapshots taken at Open, a reload does not change them
+  std::shared_ptr<const CrappyHosts> hosts_;
+  std::shared_ptr<const CrTrustedNet> trusted_net_;
   std::shared_ptr<struct sockaddr_storage> reply_to_;
 
-  void Resolve(CrPacket& response, ns_msg& msg);
-  void SetTimer(uv_loop_t* uv_loop, uint64_t timeout);
+  // Sessions are recycled by CrSessionManager, Open parses the request and
+  // Close releases everything but the reusable buffers
+  void Open(CrSessionManager* manager, uint32_t session_id, CrPacket packet);
+  void Close();
+  bool IsOpen() const { return manager_ != nullptr; }
+  void Resolve(CrPacket& response, const CrDNSMessage& msg);
+  void SetTimer(CrTimerWheel* timer_wheel, uint64_t timeout);
+  void Expedite(uint64_t due);
   void Transit(bool is_trusted_ip,
                bool is_healthy_dns,
                std::shared_ptr<u8_vec> rs);
 
  private:
-  uv_timer_t* uv_timer_;
+  // A records of a response looked up in trusted net at once
+  static const size_t kMaxAddrBatch = 32;
+
+  uint64_t due_;
+  CrTimer timer_;
+  CrTimerWheel* timer_wheel_;
+
+  void ArmTimer(uint64_t due);
+  void OnTimeout();
 };
 
 #endif
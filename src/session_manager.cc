@@ -19,6 +19,8 @@
 
 #include "session_manager.h"
 
+#include <algorithm>
+
 #include <arpa/nameser.h>
 
 #include "hosts/hosts.h"
@@ -29,65 +31,114 @@
 CrSessionManager::CrSessionManager(uv_loop_t* loop, CrappyServer* server)
     : timeout_(CrConfig::timeout_in_ms),
       uv_loop_(loop),
-      sender_(loop),
+      timer_wheel_(loop),
+      sender_(loop, &timer_wheel_),
       server_(server),
-      pool_() {
-  std::random_device rd;
-  counter_ = (uint16_t)rd();
-  mr_step_.seed(rd());
-
+      healthy_rtt_(),
+      poisoned_rtt_(),
+      hosts_memo_(),
+      answer_cache_(CrConfig::answer_cache),
+      live_count_(0),
+      blocked_count_(0),
+      cache_hits_(0),
+      cache_misses_(0),
+      next_index_(0),
+      free_ids_(),
+      chunks_() {
   PrepareServer();
   PrepareSender();
-  GenShuffleSequence(rd());
 }
 
-std::shared_ptr<CrSession> CrSessionManager::Create(CrPacket packet) {
-  auto session = std::make_shared<CrSession>(this, packet);
-  if (session->status_ != CrSession::Status::kBadRequest) {
-    session->SetTimer(uv_loop_, timeout_);
-    pool_[session->pipelined_id_] = session;
-    return session;
-  }
-  return nullptr;
+CrSessionManager::~CrSessionManager() {
+  // Sessions hold timers linked to the wheel, release them first
+  for (auto& chunk : chunks_)
+    chunk.reset();
 }
 
-std::shared_ptr<CrSession> CrSessionManager::Get(uint16_t pipelined_id) {
-  if (pool_.find(pipelined_id) != pool_.end()) {
-    return pool_[pipelined_id];
+CrSession* CrSessionManager::Create(CrPacket packet) {
+  uint32_t session_id;
+  if (!free_ids_.empty()) {
+    // Bump the generation of the recycled slot, 0 is never used so the
+    // first session in a slot is distinguishable from an unused one
+    session_id = free_ids_.back() + (kIndexMask + 1);
+    if ((session_id & ~kIndexMask) == 0)
+      session_id += kIndexMask + 1;
+    free_ids_.pop_back();
+  } else if (next_index_ <= kIndexMask) {
+    session_id = (kIndexMask + 1) | next_index_++;
+  } else {
+    WARN << "[Server] Too many sessions in flight, request dropped" << ENDL;
+    return nullptr;
   }
-  return nullptr;
-}
 
-bool CrSessionManager::Has(uint16_t pipelined_id) {
-  return pool_.find(pipelined_id) != pool_.end();
+  uint32_t index = session_id & kIndexMask;
+  auto& chunk = chunks_[index / kChunkSize];
+  if (UNLIKELY(chunk == nullptr))
+    chunk.reset(new CrSession[kChunkSize]);
+
+  CrSession* session = &chunk[index % kChunkSize];
+  session->Open(this, session_id, packet);
+  if (session->status_ == CrSession::Status::kBadRequest) {
+    session->Close();
+    free_ids_.push_back(session_id);
+    return nullptr;
+  }
+
+  session->SetTimer(&timer_wheel_, timeout_);
+  ++live_count_;
+  return session;
 }
 
-void CrSessionManager::Destory(uint16_t pipelined_id) {
-  pool_.erase(pipelined_id);
+void CrSessionManager::Destory(uint32_t session_id) {
+  CrSession* session = Get(session_id);
+  if (session == nullptr)
+    return;
+  session->Close();
+  --live_count_;
+  free_ids_.push_back(session_id);
 }
 
-bool CrSessionManager::Dispatch(uint16_t pipelined_id) {
-  auto session = Get(pipelined_id);
+bool CrSessionManager::Dispatch(uint32_t session_id) {
+  auto session = Get(session_id);
   if (session == nullptr)
     return false;
+  if (session->status_ == CrSession::Status::kBlocked) {
+    // Answered already, nothing goes upstream
+    ++blocked_count_;
+    Resolve(session_id);
+    return true;
+  }
+  if (session->status_ == CrSession::Status::kMatching) {
+    MatchOffLoop(session);
+    return true;
+  }
+  if (Cacheable(*session)) {
+    if (AnswerFromCache(session)) {
+      ++cache_hits_;
+      Resolve(session_id);
+      return true;
+    }
+    ++cache_misses_;
+  }
   if (session->status_ == CrSession::Status::kDedicated) {
     auto rule = session->matched_rule_;
     if (rule->dns_server_list_ != nullptr) {
-      for (const auto& server : *rule->dns_server_list_) {
-        sender_.SendTo(session, server);
-        ++session->response_on_the_way_;
-      }
+      sender_.SendTo(session, *rule->dns_server_list_);
       return true;
     }
 
     auto qtype = session->query_type_;
     if (LIKELY(qtype == ns_t_a && rule->ipv4_list_.size() != 0)) {
-      OnRemoteRecv(CrappyHosts::AssemblePacket(session->request_payload_,
-                                               rule->ipv4_list_));
+      auto response = CrappyHosts::AssemblePacket(session->request_payload_,
+                                                  rule->ipv4_list_);
+      response.session_id = session_id;
+      OnRemoteRecv(response);
       return true;
     } else if (qtype == ns_t_aaaa && rule->ipv6_list_.size() != 0) {
-      OnRemoteRecv(CrappyHosts::AssemblePacket(session->request_payload_,
-                                               rule->ipv6_list_));
+      auto response = CrappyHosts::AssemblePacket(session->request_payload_,
+                                                  rule->ipv6_list_);
+      response.session_id = session_id;
+      OnRemoteRecv(response);
       return true;
     }
   }
@@ -97,34 +148,239 @@ bool CrSessionManager::Dispatch(uint16_t pipelined_id) {
 }
 
 void CrSessionManager::OnRemoteRecv(CrPacket response) {
-  ns_msg msg;
+  CrDNSMessage msg;
 
-  if (ns_initparse((const unsigned char*)response.payload->data(),
-                   response.payload->size(), &msg) < 0) {
+  if (!msg.Parse(response.payload->data(), response.payload->size())) {
     INFO << "Packet from " << *response.dns_server << " parse error " << ENDL;
     return;
   }
 
-  uint16_t pipelined_id = ns_msg_id(msg);
-  VERB("[" << pipelined_id << "] Received response from "
+  uint32_t session_id = response.session_id;
+  VERB("[" << session_id << "] Received response from "
            << *response.dns_server);
-  auto session = Get(pipelined_id);
+  auto session = Get(session_id);
   if (session != nullptr) {
+    // Upstream IDs are only 16 bits, make sure it answers what was asked
+    CrDNSMessage request;
+    CrDNSMessage::RR asked, answered;
+    if (msg.Question(answered) &&
+        request.Parse(session->request_payload_->data(),
+                      session->request_payload_->size()) &&
+        request.Question(asked) &&
+        (asked.type != answered.type ||
+         !CrDNSMessage::NameEqual(request, asked.name, msg, answered.name))) {
+      VERB("[" << session_id << "] Response from " << *response.dns_server
+               << " mismatches the question, dropped");
+      return;
+    }
+
+    uint64_t rtt = uv_now(uv_loop_) - session->created_at_;
+    if (response.dns_server->health == CrDNSServer::Health::kHealthy) {
+      healthy_rtt_.Add(rtt);
+    } else if (response.dns_server->health == CrDNSServer::Health::kPoisoned) {
+      poisoned_rtt_.Add(rtt);
+    }
     session->Resolve(response, msg);
   }
 }
 
-void CrSessionManager::Resolve(uint16_t pipelined_id) {
-  auto session = Get(pipelined_id);
-  Destory(pipelined_id);
-  if (session == nullptr || session->candidate_response_ == nullptr ||
-      session->candidate_response_->size() <= 2) {
+uint64_t CrSessionManager::StateDeadline(const CrSession& session) const {
+  uint64_t cap = 0;
+  const CrLatencyStats* rtt = nullptr;
+  switch (session.status_) {
+    case CrSession::Status::kWaitHealth:
+      cap = CrConfig::wait_health_in_ms;
+      rtt = &healthy_rtt_;
+      break;
+    case CrSession::Status::kWaitFast:
+      cap = CrConfig::wait_fast_in_ms;
+      rtt = &poisoned_rtt_;
+      break;
+    default:
+      return session.deadline_;
+  }
+
+  uint64_t now = uv_now(uv_loop_);
+  uint64_t deadline = cap != 0 ? now + cap : session.deadline_;
+  if (rtt->Samples() >= kMinRTTSamples) {
+    // Most of responses would have arrived by then, stop waiting for the
+    // straggler since we already have a candidate in hand
+    uint64_t expected = session.created_at_ + rtt->Percentile(99) * 3 / 2 +
+                        kDeadlineSlack;
+    deadline = std::min(deadline, std::max(expected, now));
+  }
+  return std::min(deadline, session.deadline_);
+}
+
+void CrSessionManager::Resolve(uint32_t session_id) {
+  auto session = Get(session_id);
+  if (session == nullptr)
     return;
+  if (session->candidate_response_ != nullptr &&
+      session->candidate_response_->size() > 2) {
+    CrDNSMessage::Put16(session->candidate_response_->data(), session->raw_id_);
+    server_->Send(session);
+    VERB("[" << session_id << "] Session resolved");
+    if (session->status_ != CrSession::Status::kCached &&
+        Cacheable(*session)) {
+      answer_cache_->Store(session->answer_name_, session->answer_name_size_,
+                           session->answer_kind_, session->answer_generation_,
+                           session->candidate_response_->data(),
+                           session->candidate_response_->size(),
+                           uv_now(uv_loop_));
+    }
+  }
+  Destory(session_id);
+}
+
+// Answers of hosts rules and blocklist are made up locally, only upstream
+// answers are cached
+bool CrSessionManager::Cacheable(const CrSession& session) const {
+  return answer_cache_ != nullptr &&
+         session.answer_kind_ != CrAnswerCache::kNone &&
+         session.matched_rule_ == nullptr &&
+         session.status_ != CrSession::Status::kBlocked;
+}
+
+bool CrSessionManager::AnswerFromCache(CrSession* session) {
+  auto answer = std::make_shared<u8_vec>();
+  if (!answer_cache_->Lookup(session->answer_name_, session->answer_name_size_,
+                             session->answer_kind_, uv_now(uv_loop_), *answer))
+    return false;
+
+  // Echo the question as it was asked, clients may check its case
+  CrDNSMessage request, response;
+  CrDNSMessage::RR rr;
+  if (request.Parse(session->request_payload_->data(),
+                    session->request_payload_->size()) &&
+      response.Parse(answer->data(), answer->size())) {
+    auto asked = request.Records(CrDNSMessage::kQuestion);
+    auto answered = response.Records(CrDNSMessage::kQuestion);
+    if (asked.Next(rr) && answered.Next(rr) &&
+        asked.Offset() == answered.Offset()) {
+      std::copy(request.Data() + CrDNSMessage::kHeaderSize,
+                request.Data() + asked.Offset(),
+                answer->begin() + CrDNSMessage::kHeaderSize);
+    }
+  }
+
+  VERB("[" << session->session_id_ << "] Answered from cache");
+  session->candidate_response_ = answer;
+  session->status_ = CrSession::Status::kCached;
+  return true;
+}
+
+struct HostsMatchRequest {
+  uv_work_t req;
+  CrSessionManager* manager;
+  uint32_t session_id;
+  uint16_t type;
+  CrQName name;
+  std::shared_ptr<const CrappyHosts> hosts;
+  std::shared_ptr<const HostsRule> rule;
+};
+
+void CrSessionManager::MatchOffLoop(CrSession* session) {
+  HostsMatchRequest* request = new HostsMatchRequest{
+      .req = {},
+      .manager = this,
+      .session_id = session->session_id_,
+      .type = session->query_type_,
+      .name = session->query_name_,
+      .hosts = session->hosts_,
+      .rule = nullptr};
+  request->req.data = request;
+  VERB("[" << session->session_id_ << "] Matching hosts off loop");
+
+  int rtn = uv_queue_work(
+      uv_loop_, &request->req,
+      [](uv_work_t* req) {
+        HostsMatchRequest* request = (HostsMatchRequest*)req->data;
+        request->rule = request->hosts->Match(request->name, request->type);
+      },
+      [](uv_work_t* req, int status) {
+        HostsMatchRequest* request = (HostsMatchRequest*)req->data;
+        CrSessionManager* self = request->manager;
+        self->hosts_memo_.Put(*request->hosts, request->name, request->type,
+                              request->rule);
+        // Session may have timed out meanwhile
+        CrSession* session = self->Get(request->session_id);
+        if (session != nullptr &&
+            session->status_ == CrSession::Status::kMatching) {
+          session->matched_rule_ = request->rule;
+          session->status_ = request->rule != nullptr
+                                 ? CrSession::Status::kDedicated
+                                 : CrSession::Status::kInit;
+          self->Dispatch(request->session_id);
+        }
+        delete request;
+      });
+  if (rtn != 0) {
+    delete request;
+    Destory(session->session_id_);
+  }
+}
+
+void CrSessionManager::CollectStats(Stats& stats) const {
+  stats.live_count = live_count_;
+  stats.blocked_count = blocked_count_;
+  stats.memo_hits = hosts_memo_.Hits();
+  stats.memo_misses = hosts_memo_.Misses();
+  stats.memo_deferred = hosts_memo_.Deferred();
+  stats.cache_hits = cache_hits_;
+  stats.cache_misses = cache_misses_;
+  stats.healthy_rtt = healthy_rtt_;
+  stats.poisoned_rtt = poisoned_rtt_;
+  stats.workers.clear();
+  sender_.CollectStats(stats.workers);
+}
+
+void CrSessionManager::ReportStats() const {
+  Stats stats;
+  CollectStats(stats);
+  stats.Report("[Stats] ");
+}
+
+CrSessionManager::Stats::Stats()
+    : live_count(0),
+      blocked_count(0),
+      memo_hits(0),
+      memo_misses(0),
+      memo_deferred(0),
+      cache_hits(0),
+      cache_misses(0),
+      healthy_rtt(),
+      poisoned_rtt(),
+      workers() {}
+
+void CrSessionManager::Stats::Merge(const Stats& other) {
+  live_count += other.live_count;
+  blocked_count += other.blocked_count;
+  memo_hits += other.memo_hits;
+  memo_misses += other.memo_misses;
+  memo_deferred += other.memo_deferred;
+  cache_hits += other.cache_hits;
+  cache_misses += other.cache_misses;
+  healthy_rtt.Merge(other.healthy_rtt);
+  poisoned_rtt.Merge(other.poisoned_rtt);
+}
+
+void CrSessionManager::Stats::Report(const std::string& prefix) const {
+  INFO << prefix << live_count << " sessions in flight" << ENDL;
+  INFO << prefix << "RTT p50/p99: healthy " << healthy_rtt.Percentile(50)
+       << "/" << healthy_rtt.Percentile(99) << "ms, poisoned "
+       << poisoned_rtt.Percentile(50) << "/" << poisoned_rtt.Percentile(99)
+       << "ms" << ENDL;
+  INFO << prefix << blocked_count << " queries blocked" << ENDL;
+  INFO << prefix << "Hosts memo: " << memo_hits << " hits, " << memo_misses
+       << " misses, " << memo_deferred << " matched off loop" << ENDL;
+  if (CrConfig::answer_cache != nullptr) {
+    INFO << prefix << "Answer cache: " << cache_hits << " hits, "
+         << cache_misses << " misses" << ENDL;
+  }
+  for (const auto& line : workers) {
+    INFO << prefix << line << ENDL;
   }
-  ns_put16(session->raw_id_,
-           (unsigned char*)session->candidate_response_->data());
-  server_->Send(session);
-  VERB("[" << session->pipelined_id_ << "] Session resolved");
 }
 
 void CrSessionManager::PrepareServer() {
@@ -133,12 +389,12 @@ void CrSessionManager::PrepareServer() {
     auto session = this->Create(packet);
     if (session == nullptr)
       return;
-    this->Dispatch(session->pipelined_id_);
+    this->Dispatch(session->session_id_);
   };
 }
 
 void CrSessionManager::PrepareSender() {
-  sender_.send_cb_ = [this](uint16_t session_id,
+  sender_.send_cb_ = [this](uint32_t session_id,
                             std::shared_ptr<const CrDNSServer> server,
                             int status) {
     VERB("[" << session_id << "] Send to " << *server << ", "
@@ -161,42 +417,3 @@ void CrSessionManager::PrepareSender() {
     sender_.RegisterDNSServer(dns_server);
   }
 }
-
-void CrSessionManager::GenShuffleSequence(uint_fast32_t seed) {
-  std::minstd_rand mr(seed);
-  for (int i = 0; i < kShuffleTimes; ++i) {
-    std::uniform_int_distribution<> uid(i, kShuffleTimes);
-    shuffle_seq_[i] = uid(mr);
-  }
-
-  if (CrConfig::verbose_mode) {
-    uint8_t pokers[16];
-    for (size_t i = 0; i < 16; ++i)
-      pokers[i] = i;
-    for (size_t i = 0, j; i < kShuffleTimes; ++i) {
-      j = shuffle_seq_[i];
-      uint8_t val = pokers[i];
-      pokers[i] = pokers[j];
-      pokers[j] = val;
-    }
-    VERB_R("[Init] Shuffle: ");
-    for (size_t i = 0; i < 16; ++i)
-      VERB_S << unsigned(pokers[i]) << ",";
-    VERB_S << "\b " << ENDL;
-  }
-}
-
-uint16_t CrSessionManager::GenPipelinedID() {
-  counter_ += mr_step_() % 97 + 1;
-  uint16_t counter = counter_, mask = 0;
-
-  // magic to counter
-  for (size_t i = 0, j = 0; i < kShuffleTimes; ++i) {
-    j = shuffle_seq_[i];
-    mask = ((counter >> i) & 1) ^ ((counter >> j) & 1);
-    counter ^= (mask << i) | (mask << j);
-  }
-
-  VERB("[" << counter << "] Session ID generated from " << counter_);
-  return counter;
-}
@@ -20,49 +20,116 @@
 #ifndef _CR_SESSION_MANAGER_H_
 #define _CR_SESSION_MANAGER_H_
 
-#include <random>
-#include <unordered_map>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "answer_cache.h"
 #include "crappydns.h"
+#include "hosts/memo.h"
+#include "latency.h"
 #include "sender.h"
+#include "session.h"
+#include "timer_wheel.h"
 
-class CrSession;
 class CrappyServer;
 
 class CrSessionManager {
  public:
+  // Snapshot of what ReportStats prints, so managers on other loops can be
+  // summed up
+  struct Stats {
+    Stats();
+
+    size_t live_count;
+    uint64_t blocked_count;
+    uint64_t memo_hits;
+    uint64_t memo_misses;
+    uint64_t memo_deferred;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    CrLatencyStats healthy_rtt;
+    CrLatencyStats poisoned_rtt;
+    // A line for each upstream worker
+    std::vector<std::string> workers;
+
+    // Sums up counters, worker lines are left out
+    void Merge(const Stats& other);
+    void Report(const std::string& prefix) const;
+  };
+
   CrSessionManager(uv_loop_t* loop, CrappyServer* server);
-  ~CrSessionManager(){};
+  ~CrSessionManager();
 
-  std::shared_ptr<CrSession> Create(CrPacket packet);
-  std::shared_ptr<CrSession> Get(uint16_t pipelined_id);
-  bool Has(uint16_t pipelined_id);
-  void Destory(uint16_t pipelined_id);
+  CrSession* Create(CrPacket packet);
+  CrSession* Get(uint32_t session_id) const {
+    uint32_t index = session_id & kIndexMask;
+    const auto& chunk = chunks_[index / kChunkSize];
+    if (UNLIKELY(chunk == nullptr))
+      return nullptr;
+    CrSession* session = &chunk[index % kChunkSize];
+    return session->IsOpen() && session->session_id_ == session_id ? session
+                                                                   : nullptr;
+  }
+  bool Has(uint32_t session_id) const { return Get(session_id) != nullptr; }
+  void Destory(uint32_t session_id);
 
-  bool Dispatch(uint16_t pipelined_id);
+  bool Dispatch(uint32_t session_id);
   void OnRemoteRecv(CrPacket response);
-  void Resolve(uint16_t pipelined_id);
+  void Resolve(uint32_t session_id);
+  uint64_t StateDeadline(const CrSession& session) const;
+  // Returns false if a slow rule has to be matched off the loop first
+  bool MatchHosts(const CrappyHosts& hosts,
+                  const CrQName& name,
+                  uint16_t type,
+                  std::shared_ptr<const HostsRule>& rule) {
+    return hosts_memo_.Match(hosts, name, type, rule);
+  }
 
-  uint16_t GenPipelinedID();
+  void CollectStats(Stats& stats) const;
+  void ReportStats() const;
 
  private:
-  // shuffle times for uint16_t
-  static const uint8_t kShuffleTimes = 16 - 1;
+  // Session ID is a slot index in its low bits and a generation in the
+  // rest, so a late response never reaches the next session in the slot.
+  // Upstream workers map their own 16 bits DNS IDs back to session IDs.
+  static const unsigned int kIndexBits = 20;
+  static const uint32_t kIndexMask = (1u << kIndexBits) - 1;
+  // Sessions are indexed by slot directly, allocated lazily in chunks and
+  // recycled without going back to the heap
+  static const size_t kChunkSize = 256;
+  static const size_t kChunkCount = (kIndexMask + 1) / kChunkSize;
+  // RTT samples needed before trusting the percentiles
+  static const uint32_t kMinRTTSamples = 32;
+  // Extra waiting time beyond the observed RTT percentile
+  static const uint64_t kDeadlineSlack = 20;
 
   uint64_t timeout_;
   uv_loop_t* uv_loop_;
+  CrTimerWheel timer_wheel_;
   CrappySender sender_;
   CrappyServer* server_;
+  CrLatencyStats healthy_rtt_;
+  CrLatencyStats poisoned_rtt_;
+  CrHostsMemo hosts_memo_;
+  // Shared with managers of other loops, nullptr if disabled
+  std::shared_ptr<CrAnswerCache> answer_cache_;
 
-  uint16_t counter_;
-  std::minstd_rand mr_step_;
-  uint8_t shuffle_seq_[kShuffleTimes];
-
-  std::unordered_map<uint16_t, std::shared_ptr<CrSession>> pool_;
+  size_t live_count_;
+  uint64_t blocked_count_;
+  uint64_t cache_hits_;
+  uint64_t cache_misses_;
+  uint32_t next_index_;
+  std::vector<uint32_t> free_ids_;
+  std::unique_ptr<CrSession[]> chunks_[kChunkCount];
 
+  bool Cacheable(const CrSession& session) const;
+  bool AnswerFromCache(CrSession* session);
+  // Matches hosts for a kMatching session on the thread pool, then
+  // dispatches it again
+  void MatchOffLoop(CrSession* session);
   void PrepareServer();
   void PrepareSender();
-  void GenShuffleSequence(uint_fast32_t seed);
 };
 
 #endif
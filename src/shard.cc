@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "shard.h"
+
+#include <algorithm>
+#include <thread>
+
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "server.h"
+
+static bool pin_to_cpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+#else
+  return false;
+#endif
+}
+
+static std::string stats_prefix(size_t index) {
+  return "[Stats][Thread " + std::to_string(index) + "] ";
+}
+
+CrShard::CrShard(size_t index, uv_loop_t* main_loop)
+    : stats_cb_(nullptr),
+      index_(index),
+      cpu_(-1),
+      running_(false),
+      uv_loop_(),
+      thread_(),
+      server_(nullptr),
+      manager_(nullptr),
+      collect_async_(),
+      stop_async_(),
+      stats_async_(new uv_async_t),
+      stats_mutex_(),
+      stats_() {
+  uv_loop_init(&uv_loop_);
+  server_.reset(new CrappyServer(&uv_loop_));
+  manager_.reset(new CrSessionManager(&uv_loop_, server_.get()));
+
+  uv_async_init(&uv_loop_, &collect_async_, [](uv_async_t* handle) {
+    CrShard* self = (CrShard*)handle->data;
+    {
+      std::lock_guard<std::mutex> lock(self->stats_mutex_);
+      self->manager_->CollectStats(self->stats_);
+    }
+    uv_async_send(self->stats_async_);
+  });
+  collect_async_.data = this;
+  uv_unref((uv_handle_t*)&collect_async_);
+
+  uv_async_init(&uv_loop_, &stop_async_,
+                [](uv_async_t* handle) { uv_stop(handle->loop); });
+  uv_unref((uv_handle_t*)&stop_async_);
+
+  uv_async_init(main_loop, stats_async_, [](uv_async_t* handle) {
+    CrShard* self = (CrShard*)handle->data;
+    CrSessionManager::Stats stats;
+    {
+      std::lock_guard<std::mutex> lock(self->stats_mutex_);
+      stats = self->stats_;
+    }
+    if (self->stats_cb_)
+      self->stats_cb_(*self, stats);
+  });
+  stats_async_->data = this;
+  uv_unref((uv_handle_t*)stats_async_);
+}
+
+CrShard::~CrShard() {
+  if (running_) {
+    uv_async_send(&stop_async_);
+    uv_thread_join(&thread_);
+  }
+  uv_close((uv_handle_t*)stats_async_,
+           [](uv_handle_t* handle) { delete (uv_async_t*)handle; });
+
+  // Loop is ours again, let it close what is left
+  manager_.reset();
+  server_.reset();
+  uv_walk(&uv_loop_,
+          [](uv_handle_t* handle, void* arg) {
+            if (!uv_is_closing(handle))
+              uv_close(handle, nullptr);
+          },
+          nullptr);
+  uv_run(&uv_loop_, UV_RUN_DEFAULT);
+  uv_loop_close(&uv_loop_);
+}
+
+int CrShard::Serve(const struct sockaddr* addr) {
+  return server_->Serve(addr, 0, true);
+}
+
+int CrShard::Start(int cpu) {
+  cpu_ = cpu;
+  int rtn = uv_thread_create(&thread_,
+                             [](void* arg) { ((CrShard*)arg)->Run(); }, this);
+  running_ = rtn == 0;
+  return rtn;
+}
+
+void CrShard::CollectStats() {
+  uv_async_send(&collect_async_);
+}
+
+void CrShard::Run() {
+  if (cpu_ >= 0 && !pin_to_cpu(cpu_)) {
+    WARN << "[Server] Failed to pin thread " << index_ << " to CPU " << cpu_
+         << ENDL;
+  }
+  uv_run(&uv_loop_, UV_RUN_DEFAULT);
+}
+
+CrShardGroup::CrShardGroup(uv_loop_t* main_loop,
+                           const CrSessionManager* manager)
+    : main_loop_(main_loop),
+      manager_(manager),
+      shards_(),
+      pending_(0),
+      total_() {}
+
+int CrShardGroup::Serve(size_t count, const struct sockaddr* addr) {
+  for (size_t index = 1; index < count; ++index) {
+    std::unique_ptr<CrShard> shard(new CrShard(index, main_loop_));
+    int rtn = shard->Serve(addr);
+    if (rtn != 0)
+      return rtn;
+    shard->stats_cb_ = [this](const CrShard& shard,
+                              const CrSessionManager::Stats& stats) {
+      OnStats(shard.Index(), stats);
+    };
+    shards_.push_back(std::move(shard));
+  }
+  return 0;
+}
+
+int CrShardGroup::Start(bool pin) {
+  // Main loop is left alone, threads it starts later would be pinned along
+  // with it
+  size_t cpu_count = std::max(1u, std::thread::hardware_concurrency());
+  for (auto& shard : shards_) {
+    int rtn = shard->Start(pin ? (int)(shard->Index() % cpu_count) : -1);
+    if (rtn != 0)
+      return rtn;
+  }
+  return 0;
+}
+
+void CrShardGroup::ReportStats() {
+  if (shards_.empty()) {
+    manager_->ReportStats();
+    return;
+  }
+  // Still waiting for the last report
+  if (pending_ != 0)
+    return;
+
+  CrSessionManager::Stats stats;
+  manager_->CollectStats(stats);
+  stats.Report(stats_prefix(0));
+  total_ = CrSessionManager::Stats();
+  total_.Merge(stats);
+
+  pending_ = shards_.size();
+  for (auto& shard : shards_) {
+    shard->CollectStats();
+  }
+}
+
+void CrShardGroup::OnStats(size_t index,
+                           const CrSessionManager::Stats& stats) {
+  if (pending_ == 0)
+    return;
+  stats.Report(stats_prefix(index));
+  total_.Merge(stats);
+  if (--pending_ == 0)
+    total_.Report("[Stats][Total] ");
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CR_SHARD_H_
+#define _CR_SHARD_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "crappydns.h"
+#include "session_manager.h"
+
+class CrappyServer;
+
+// Extra event loop of --threads, with a listener, sessions and upstream
+// workers of its own. Nothing but hosts and trusted net, which are published
+// through CrConfig, is shared with other loops.
+class CrShard {
+ public:
+  CrShard(size_t index, uv_loop_t* main_loop);
+  ~CrShard();
+
+  // Runs on main loop with the stats asked for by CollectStats
+  std::function<void(const CrShard&, const CrSessionManager::Stats&)>
+      stats_cb_;
+
+  size_t Index() const { return index_; }
+  // Binds before the loop runs, so it is done before dropping privileges
+  int Serve(const struct sockaddr* addr);
+  // Runs the loop on a thread of its own, pinned to cpu unless negative
+  int Start(int cpu);
+  // Called on main loop, stats are taken on the thread of shard
+  void CollectStats();
+
+ private:
+  size_t index_;
+  int cpu_;
+  bool running_;
+  uv_loop_t uv_loop_;
+  uv_thread_t thread_;
+  std::unique_ptr<CrappyServer> server_;
+  std::unique_ptr<CrSessionManager> manager_;
+  // Wake up loop of shard
+  uv_async_t collect_async_;
+  uv_async_t stop_async_;
+  // Wakes up main loop once stats_ is taken
+  uv_async_t* stats_async_;
+  std::mutex stats_mutex_;
+  CrSessionManager::Stats stats_;
+
+  void Run();
+};
+
+// All loops serving with --threads. The first one is the main loop, which
+// also keeps signals and reloading to itself, the others are shards.
+class CrShardGroup {
+ public:
+  CrShardGroup(uv_loop_t* main_loop, const CrSessionManager* manager);
+  ~CrShardGroup() {}
+
+  // Adds count - 1 shards listening at addr besides the main loop, which
+  // has to be bound with reuse_port as well
+  int Serve(size_t count, const struct sockaddr* addr);
+  int Start(bool pin);
+  // Reports stats of each loop as they come in, then the sum of them
+  void ReportStats();
+
+ private:
+  uv_loop_t* main_loop_;
+  const CrSessionManager* manager_;
+  std::vector<std::unique_ptr<CrShard>> shards_;
+  // Shards yet to report
+  size_t pending_;
+  CrSessionManager::Stats total_;
+
+  void OnStats(size_t index, const CrSessionManager::Stats& stats);
+};
+
+#endif
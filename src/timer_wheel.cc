@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+
+static inline bool empty_slot(const CrTimer* head) {
+  return head->next == head;
+}
+
+static inline void unlink_timer(CrTimer* timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = nullptr;
+}
+
+CrTimerWheel::CrTimerWheel(uv_loop_t* uv_loop)
+    : uv_loop_(uv_loop),
+      uv_timer_(new uv_timer_t),
+      current_tick_(uv_now(uv_loop) / kTickInMs),
+      size_(0) {
+  for (size_t level = 0; level < kLevels; ++level) {
+    for (size_t slot = 0; slot < kSlots; ++slot) {
+      CrTimer* head = &slots_[level][slot];
+      head->prev = head->next = head;
+    }
+  }
+  uv_timer_init(uv_loop_, uv_timer_);
+  uv_timer_->data = this;
+}
+
+CrTimerWheel::~CrTimerWheel() {
+  uv_close((uv_handle_t*)uv_timer_, [](uv_handle_t* handle) { delete handle; });
+}
+
+void CrTimerWheel::Start(CrTimer* timer, uint64_t timeout) {
+  if (timer->Active()) {
+    unlink_timer(timer);
+  } else if (size_++ == 0) {
+    // Nothing was ticking while idle, catch up without walking the slots
+    current_tick_ = uv_now(uv_loop_) / kTickInMs;
+    uv_timer_start(
+        uv_timer_,
+        [](uv_timer_t* handle) {
+          auto self = (CrTimerWheel*)handle->data;
+          self->Advance(uv_now(handle->loop) / kTickInMs);
+        },
+        kTickInMs, kTickInMs);
+  }
+
+  // Round up, a timer never fires earlier than asked
+  uint64_t expire = (uv_now(uv_loop_) + timeout + kTickInMs - 1) / kTickInMs;
+  timer->expire = expire > current_tick_ ? expire : current_tick_ + 1;
+  Link(timer);
+}
+
+void CrTimerWheel::Stop(CrTimer* timer) {
+  if (!timer->Active())
+    return;
+  unlink_timer(timer);
+  if (--size_ == 0)
+    uv_timer_stop(uv_timer_);
+}
+
+void CrTimerWheel::Link(CrTimer* timer) {
+  uint64_t delta = timer->expire - current_tick_;
+  size_t level = 0;
+  while (level < kLevels - 1 && delta >= (1ull << (kSlotBits * (level + 1))))
+    ++level;
+
+  // Clamp the timers beyond the range to the farthest slot of top level
+  uint64_t expire = timer->expire;
+  if (delta >= (1ull << (kSlotBits * kLevels)))
+    expire = current_tick_ + (1ull << (kSlotBits * kLevels)) - 1;
+
+  size_t slot = (expire >> (kSlotBits * level)) & (kSlots - 1);
+  CrTimer* head = &slots_[level][slot];
+  timer->next = head;
+  timer->prev = head->prev;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void CrTimerWheel::Cascade(size_t level) {
+  size_t index = (current_tick_ >> (kSlotBits * level)) & (kSlots - 1);
+  if (index == 0 && level + 1 < kLevels)
+    Cascade(level + 1);
+
+  CrTimer* head = &slots_[level][index];
+  while (!empty_slot(head)) {
+    CrTimer* timer = head->next;
+    unlink_timer(timer);
+    Link(timer);
+  }
+}
+
+void CrTimerWheel::Advance(uint64_t tick) {
+  while (current_tick_ < tick && size_ != 0) {
+    ++current_tick_;
+    size_t index = current_tick_ & (kSlots - 1);
+    if (index == 0)
+      Cascade(1);
+
+    CrTimer* head = &slots_[0][index];
+    while (!empty_slot(head)) {
+      CrTimer* timer = head->next;
+      unlink_timer(timer);
+      if (--size_ == 0)
+        uv_timer_stop(uv_timer_);
+      timer->cb(timer);
+    }
+  }
+}
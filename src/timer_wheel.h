@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CR_TIMER_WHEEL_H_
+#define _CR_TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <uv.h>
+
+// Intrusive timer, embed it into the owner and link it to a CrTimerWheel
+struct CrTimer {
+  CrTimer()
+      : prev(nullptr), next(nullptr), expire(0), cb(nullptr), data(nullptr) {}
+
+  CrTimer* prev;
+  CrTimer* next;
+  uint64_t expire;
+  void (*cb)(CrTimer* timer);
+  void* data;
+
+  bool Active() const { return prev != nullptr; }
+};
+
+// Hierarchical timer wheel driven by a single uv_timer_t, O(1) to start
+// or stop a timer, expired timers are fired in batch for each tick
+class CrTimerWheel {
+ public:
+  CrTimerWheel(uv_loop_t* uv_loop);
+  ~CrTimerWheel();
+
+  static const uint64_t kTickInMs = 8;
+
+  void Start(CrTimer* timer, uint64_t timeout);
+  void Stop(CrTimer* timer);
+  uint64_t Now() const { return uv_now(uv_loop_); }
+  size_t Size() const { return size_; }
+
+ private:
+  static const unsigned int kSlotBits = 6;
+  static const size_t kSlots = 1 << kSlotBits;
+  static const size_t kLevels = 4;
+
+  uv_loop_t* uv_loop_;
+  uv_timer_t* uv_timer_;
+  uint64_t current_tick_;
+  size_t size_;
+  CrTimer slots_[kLevels][kSlots];
+
+  void Link(CrTimer* timer);
+  void Cascade(size_t level);
+  void Advance(uint64_t tick);
+};
+
+#endif
@@ -20,115 +20,309 @@
 #include "trusted_net.h"
 
 #include <algorithm>
-#include <cassert>
 #include <cstdio>
-#include <fstream>
-#include <string>
+#include <cstring>
 
 #include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-static bool cmp_route(const CrTrustedNet::RouteEntry& lhs,
-                      const CrTrustedNet::RouteEntry& rhs) {
-  uint8_t shift = 32 - std::min(lhs.mask, rhs.mask);
-  return (lhs.segment >> shift) < (rhs.segment >> shift);
-}
+#include "utils.h"
 
-int CrTrustedNet::LoadFile(const char* path, bool with_reserved) {
-  std::string line;
-  std::ifstream ifs(path);
-  std::shared_ptr<TreeNode> root = std::make_shared<TreeNode>(TreeNode{});
+const uint32_t CrTrustedNet::kMiss;
+const uint32_t CrTrustedNet::kHit;
+const uint32_t CrTrustedNet::kNode;
 
-  if (!ifs)
-    return -1;
+// Bump whenever a table changes, tables are in the order of Tables
+static const char kImageMagic[CrImage::kMagicSize] = {'C', 'R', 'T', 'N',
+                                                      'E', 'T', '\0', '\0'};
+static const uint32_t kImageVersion = 1;
+static const size_t kImageTableCount = 6;
+
+static inline bool test_bit(const uint64_t* bits, uint8_t index) {
+  return (bits[index >> 6] >> (index & 63)) & 1;
+}
 
-  if (with_reserved) {
-    // Add reserved IP address
-    // See https://en.wikipedia.org/wiki/Reserved_IP_addresses
-    AddLeaf(root, 0x00000000, 8);   // 0.0.0.0/8
-    AddLeaf(root, 0x0a000000, 8);   // 10.0.0.0/8
-    AddLeaf(root, 0x64400000, 10);  // 100.64.0.0/10
-    AddLeaf(root, 0x7f000000, 8);   // 127.0.0.0/8
-    AddLeaf(root, 0xa9fe0000, 16);  // 169.254.0.0/16
-    AddLeaf(root, 0xac100000, 12);  // 172.16.0.0/12
-    AddLeaf(root, 0xc0000000, 24);  // 192.0.0.0/24
-    AddLeaf(root, 0xc0000200, 24);  // 192.0.2.0/24
-    AddLeaf(root, 0xc0586300, 24);  // 192.88.99.0/24
-    AddLeaf(root, 0xc0a80000, 16);  // 192.168.0.0/16
-    AddLeaf(root, 0xc6120000, 15);  // 198.18.0.0/15
-    AddLeaf(root, 0xc6336400, 24);  // 198.51.100.0/24
-    AddLeaf(root, 0xcb007100, 24);  // 203.0.113.0/24
-    AddLeaf(root, 0xe0000000, 4);   // 224.0.0.0/4
-    // AddLeaf(root, 0xf0000000, 4);   // 240.0.0.0/4
-    AddLeaf(root, 0xffffffff, 32);  // 255.255.255.255/32
+static inline void set_bits(uint64_t* bits, unsigned int from, unsigned int n) {
+  for (unsigned int index = from; index < from + n; ++index) {
+    bits[index >> 6] |= 1ull << (index & 63);
   }
+}
 
-  while (std::getline(ifs, line)) {
-    uint8_t segment[4], mask = 32;
-    int rtn = sscanf(line.data(), "%hhu.%hhu.%hhu.%hhu/%hhu", &segment[0],
-                     &segment[1], &segment[2], &segment[3], &mask);
-    if (rtn == 4 || rtn == 5) {
-      AddLeaf(root, ntohl(*(uint32_t*)segment), mask);
-    }
+// Bits [pos, pos + len) of key, counted from the most significant one
+static inline uint32_t extract(uint128_t key, unsigned int pos, uint8_t len) {
+  return len == 0 ? 0 : (uint32_t)((key << pos) >> (128 - len));
+}
+
+static inline uint128_t to_uint128(const struct in6_addr& addr) {
+  uint64_t high, low;
+  ::memcpy(&high, addr.s6_addr, sizeof(high));
+  ::memcpy(&low, addr.s6_addr + 8, sizeof(low));
+  return ((uint128_t)be64toh(high) << 64) | be64toh(low);
+}
+
+int CrTrustedNet::LoadFile(const char* path, bool with_reserved) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (CrImage::Sniff(fd, kImageMagic)) {
+    int rtn = LoadImage(fd);
+    close(fd);
+    return rtn;
   }
-  ifs.close();
+  close(fd);
+
+  CrNetList list;
+  if (list.LoadFile(path) != 0)
+    return -1;
+  if (with_reserved)
+    list.AddReserved();
+  Build(list);
+  return 0;
+}
 
-  ShirnkTree(root);
-  PickLeaf(root, 0, 0);
+void CrTrustedNet::Build(const CrNetList& list) {
+  route_table_.clear();
+  list.ForEachBlock([this](uint32_t segment, uint8_t mask) {
+    route_table_.push_back({segment, mask});
+  });
   route_table_.shrink_to_fit();
+  Compile();
+
+  route_table6_.clear();
+  list.ForEachBlock6([this](uint128_t segment, uint8_t mask) {
+    route_table6_.push_back({segment, mask});
+  });
+  route_table6_.shrink_to_fit();
+  Compile6();
+
+  image_.Unmap();
+  tables_.route_table = MakeTable(route_table_);
+  tables_.route_table6 = MakeTable(route_table6_);
+  tables_.dir16 = MakeTable(dir16_);
+  tables_.nodes = MakeTable(nodes_);
+  tables_.leaves = MakeTable(leaves_);
+  tables_.trie6 = MakeTable(trie6_);
+}
+
+int CrTrustedNet::SaveImage(const char* path) const {
+  CrImageWriter writer;
+  writer.Add(tables_.route_table);
+  writer.Add(tables_.route_table6);
+  writer.Add(tables_.dir16);
+  writer.Add(tables_.nodes);
+  writer.Add(tables_.leaves);
+  writer.Add(tables_.trie6);
+  return writer.Save(path, kImageMagic, kImageVersion);
+}
+
+int CrTrustedNet::LoadImage(int fd) {
+  CrImage image;
+  if (image.Map(fd, kImageMagic, kImageVersion, kImageTableCount,
+                "trusted net", CrConfig::verify_images) != 0)
+    return -1;
 
+  Tables tables = {};
+  if (!image.Get(0, tables.route_table) ||
+      !image.Get(1, tables.route_table6) || !image.Get(2, tables.dir16) ||
+      !image.Get(3, tables.nodes) || !image.Get(4, tables.leaves) ||
+      !image.Get(5, tables.trie6) ||
+      (tables.dir16.size != 0 && tables.dir16.size != (1 << 16))) {
+    ERR << "Bad trusted net image: malformed table" << ENDL;
+    return -1;
+  }
+
+  image_ = std::move(image);
+  tables_ = tables;
+  route_table_.clear();
+  route_table6_.clear();
+  dir16_.clear();
+  nodes_.clear();
+  leaves_.clear();
+  trie6_.clear();
   return 0;
 }
 
 bool CrTrustedNet::Contains(uint32_t ip_addr) const {
-  return std::binary_search(route_table_.begin(), route_table_.end(),
-                            RouteEntry{.segment = ip_addr, .mask = 32},
-                            &cmp_route);
+  if (tables_.dir16.empty())
+    return false;
+
+  uint32_t entry = tables_.dir16[ip_addr >> 16];
+  if (entry < kNode)
+    return entry == kHit;
+
+  const Node& node = tables_.nodes[entry - kNode];
+  uint8_t block = (uint8_t)(ip_addr >> 8);
+  if (test_bit(node.hit, block))
+    return true;
+  if (!test_bit(node.child, block))
+    return false;
+
+  uint64_t lower = node.child[block >> 6] & ((1ull << (block & 63)) - 1);
+  const Leaf& leaf =
+      tables_.leaves[node.leaf_base[block >> 6] + __builtin_popcountll(lower)];
+  return test_bit(leaf.hit, (uint8_t)ip_addr);
+}
+
+void CrTrustedNet::Contains(const uint32_t* ip_addrs,
+                            size_t count,
+                            bool* results) const {
+  // Lookups are independent and branch free until the last level, a plain
+  // loop lets the CPU overlap them well. Explicit staging with prefetch
+  // measured slower.
+  for (size_t i = 0; i < count; ++i) {
+    results[i] = Contains(ip_addrs[i]);
+  }
+}
+
+bool CrTrustedNet::Contains(const struct in6_addr& ip_addr) const {
+  if (tables_.trie6.empty())
+    return false;
+
+  uint128_t key = to_uint128(ip_addr);
+  const TrieNode* node = &tables_.trie6[0];
+  unsigned int pos = node->skip;
+  while (node->branch != 0) {
+    uint32_t child = node->child + extract(key, pos, node->branch);
+    const TrieNode* next = &tables_.trie6[child];
+    pos += node->branch + next->skip;
+    node = next;
+  }
+
+  // Trie only knows the route which may contain the address
+  const auto& entry = tables_.route_table6[node->child];
+  return entry.mask == 0 || ((key ^ entry.segment) >> (128 - entry.mask)) == 0;
 }
 
 void CrTrustedNet::PrintRouteTable() const {
-  for (const auto& entry : route_table_) {
+  for (const auto& entry : tables_.route_table) {
     uint32_t segment = htonl(entry.segment);
     uint8_t* const seg = (uint8_t*)&segment;
     printf("%hhu.%hhu.%hhu.%hhu/%hhu\n", *seg, *(seg + 1), *(seg + 2),
            *(seg + 3), entry.mask);
   }
+  for (const auto& entry : tables_.route_table6) {
+    struct in6_addr addr;
+    char addr_str[INET6_ADDRSTRLEN];
+    for (int i = 0; i < 16; ++i) {
+      addr.s6_addr[i] = (uint8_t)(entry.segment >> (120 - i * 8));
+    }
+    inet_ntop(AF_INET6, &addr, addr_str, sizeof(addr_str));
+    printf("%s/%hhu\n", addr_str, entry.mask);
+  }
 }
 
-void CrTrustedNet::AddLeaf(std::shared_ptr<TreeNode> node,
-                           uint32_t segment,
-                           uint8_t mask) {
-  node->is_leaf_node = node->is_leaf_node || mask == 0;
-  if (node->is_leaf_node)
-    return;
+void CrTrustedNet::Compile() {
+  dir16_.assign(1 << 16, kMiss);
+  nodes_.clear();
+  leaves_.clear();
 
-  auto& child = (segment >> 31) ? node->one : node->zero;
-  if (!child)
-    child = std::make_shared<TreeNode>(TreeNode{});
-  return AddLeaf(child, segment << 1, mask - 1);
-}
+  // Routes are disjoint and sorted, so leaves of a node are appended in
+  // order of their blocks and stay contiguous
+  for (const auto& entry : route_table_) {
+    uint32_t high = entry.segment >> 16;
+    if (entry.mask <= 16) {
+      std::fill(dir16_.begin() + high,
+                dir16_.begin() + high + (1u << (16 - entry.mask)), kHit);
+      continue;
+    }
 
-void CrTrustedNet::ShirnkTree(std::shared_ptr<TreeNode> root) {
-  if (!root || root->is_leaf_node)
-    return;
-  ShirnkTree(root->zero);
-  ShirnkTree(root->one);
-  if (root->zero && root->one && root->zero->is_leaf_node &&
-      root->one->is_leaf_node) {
-    root->is_leaf_node = true;
+    if (dir16_[high] == kMiss) {
+      dir16_[high] = kNode + (uint32_t)nodes_.size();
+      nodes_.push_back(Node{});
+      nodes_.back().leaf_base[0] = (uint32_t)leaves_.size();
+    }
+    Node& node = nodes_[dir16_[high] - kNode];
+    uint8_t block = (uint8_t)(entry.segment >> 8);
+    if (entry.mask <= 24) {
+      set_bits(node.hit, block, 1u << (24 - entry.mask));
+      continue;
+    }
+
+    if (!test_bit(node.child, block)) {
+      set_bits(node.child, block, 1);
+      leaves_.push_back(Leaf{});
+    }
+    set_bits(leaves_.back().hit, (uint8_t)entry.segment,
+             1u << (32 - entry.mask));
+  }
+
+  for (auto& node : nodes_) {
+    uint32_t base = node.leaf_base[0];
+    for (int word = 0; word < 4; ++word) {
+      node.leaf_base[word] = base;
+      base += __builtin_popcountll(node.child[word]);
+    }
   }
+
+  nodes_.shrink_to_fit();
+  leaves_.shrink_to_fit();
 }
 
-void CrTrustedNet::PickLeaf(std::shared_ptr<TreeNode> root,
-                            uint32_t segment,
-                            uint8_t mask) {
-  if (!root)
+void CrTrustedNet::Compile6() {
+  trie6_.clear();
+  if (route_table6_.empty())
     return;
-  if (root->is_leaf_node) {
-    assert(mask > 0 && mask <= 32);
-    route_table_.push_back({.segment = segment << (32 - mask), .mask = mask});
+  trie6_.resize(1);
+  BuildTrie6(0, 0, route_table6_.size(), 0);
+  trie6_.shrink_to_fit();
+}
+
+void CrTrustedNet::BuildTrie6(size_t node,
+                              size_t first,
+                              size_t count,
+                              uint8_t pos) {
+  static const uint8_t kMaxBranch = 16;
+
+  if (count == 1) {
+    trie6_[node] = TrieNode{(uint32_t)first, 0, 0};
     return;
   }
 
-  PickLeaf(root->zero, segment << 1, mask + 1);
-  PickLeaf(root->one, (segment << 1) | 0x1, mask + 1);
+  // Routes are sorted and disjoint, bits shared by the first and the last
+  // one are shared by all of them, and skipped
+  uint128_t diff = (route_table6_[first].segment ^
+                    route_table6_[first + count - 1].segment)
+                   << pos;
+  uint64_t diff_high = (uint64_t)(diff >> 64);
+  uint8_t skip = diff_high != 0 ? __builtin_clzll(diff_high)
+                                : 64 + __builtin_clzll((uint64_t)diff);
+  uint8_t start = pos + skip;
+
+  // Widen the branch as long as at least half of children are not empty
+  uint8_t branch = 1;
+  while (branch < kMaxBranch && start + branch < 128) {
+    uint8_t wider = branch + 1;
+    size_t patterns = 1;
+    for (size_t i = first + 1; i < first + count; ++i) {
+      if (extract(route_table6_[i].segment, start, wider) !=
+          extract(route_table6_[i - 1].segment, start, wider))
+        ++patterns;
+    }
+    if (patterns * 2 < (1u << wider))
+      break;
+    branch = wider;
+  }
+
+  size_t child = trie6_.size();
+  trie6_[node] = TrieNode{(uint32_t)child, branch, skip};
+  trie6_.resize(child + (1u << branch));
+
+  // Route shorter than the branch spans several children, the empty ones
+  // after it point back to it
+  size_t i = first, end = first + count;
+  for (uint32_t pattern = 0; pattern < (1u << branch); ++pattern) {
+    size_t j = i;
+    while (j < end &&
+           extract(route_table6_[j].segment, start, branch) == pattern)
+      ++j;
+    if (j == i) {
+      uint32_t route = (uint32_t)(i == first ? i : i - 1);
+      trie6_[child + pattern] = TrieNode{route, 0, 0};
+    } else {
+      BuildTrie6(child + pattern, i, j - i, start + branch);
+    }
+    i = j;
+  }
 }
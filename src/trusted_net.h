@@ -20,36 +20,110 @@
 #ifndef _CR_TRUSTED_NET_H_
 #define _CR_TRUSTED_NET_H_
 
-#include <memory>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
+#include <netinet/in.h>
+
+#include "image.h"
+#include "net_list.h"
+
 class CrTrustedNet {
  public:
-  CrTrustedNet() : route_table_(){};
-  ~CrTrustedNet(){};
+  CrTrustedNet()
+      : route_table_(),
+        route_table6_(),
+        dir16_(),
+        nodes_(),
+        leaves_(),
+        trie6_(),
+        tables_(),
+        image_(){};
+  ~CrTrustedNet() {}
+  // Tables may point into a mapped image
+  CrTrustedNet(const CrTrustedNet&) = delete;
+  CrTrustedNet& operator=(const CrTrustedNet&) = delete;
 
   struct RouteEntry {
     uint32_t segment;
     uint8_t mask;
   };
 
+  struct RouteEntry6 {
+    uint128_t segment;
+    uint8_t mask;
+  };
+
+  // Loads a text list, or a binary image written by SaveImage
   int LoadFile(const char* path, bool with_reserved = true);
+  // Writes the compiled tables as a binary image, which LoadFile maps
+  // read-only instead of parsing, so instances share it in page cache
+  int SaveImage(const char* path) const;
+  // Compiles the tables from blocks of list
+  void Build(const CrNetList& list);
   bool Contains(uint32_t ip_addr) const;
+  // Looks up every address of a response at once
+  void Contains(const uint32_t* ip_addrs, size_t count, bool* results) const;
+  bool Contains(const struct in6_addr& ip_addr) const;
   void PrintRouteTable() const;
 
  private:
-  struct TreeNode {
-    bool is_leaf_node;
-    std::shared_ptr<TreeNode> zero;
-    std::shared_ptr<TreeNode> one;
+  // Route table is compiled into a DIR-16-8-8 table for lookup. dir16_ is
+  // indexed by the top 16 bits of address, and holds kMiss, kHit, or kNode
+  // plus the index of a node covering the /24 blocks underneath. Nodes and
+  // leaves keep bitmaps, children of a node are located by popcount.
+  static const uint32_t kMiss = 0;
+  static const uint32_t kHit = 1;
+  static const uint32_t kNode = 2;
+
+  struct Node {
+    // /24 blocks fully contained
+    uint64_t hit[4];
+    // /24 blocks partially contained, each has a leaf
+    uint64_t child[4];
+    // Index of the first leaf under each word of child
+    uint32_t leaf_base[4];
   };
 
-  std::vector<RouteEntry> route_table_;
+  struct Leaf {
+    uint64_t hit[4];
+  };
+
+  // IPv6 routes are too sparse for a direct table, they are compiled into a
+  // level compressed trie instead. Each node skips skip bits of address,
+  // then branches on the next branch bits into children from child. Leaves
+  // have branch 0 and child pointing to a route to be checked at last.
+  struct TrieNode {
+    uint32_t child;
+    uint8_t branch;
+    uint8_t skip;
+  };
 
-  static void AddLeaf(std::shared_ptr<TreeNode> nod, uint32_t seg, uint8_t msk);
-  static void ShirnkTree(std::shared_ptr<TreeNode> root);
+  // Lookup goes through tables, which point either to the vectors compiled
+  // from a text list, or into a mapped image
+  struct Tables {
+    CrTable<RouteEntry> route_table;
+    CrTable<RouteEntry6> route_table6;
+    CrTable<uint32_t> dir16;
+    CrTable<Node> nodes;
+    CrTable<Leaf> leaves;
+    CrTable<TrieNode> trie6;
+  };
+
+  std::vector<RouteEntry> route_table_;
+  std::vector<RouteEntry6> route_table6_;
+  std::vector<uint32_t> dir16_;
+  std::vector<Node> nodes_;
+  std::vector<Leaf> leaves_;
+  std::vector<TrieNode> trie6_;
+  Tables tables_;
+  CrImage image_;
 
-  void PickLeaf(std::shared_ptr<TreeNode> root, uint32_t segment, uint8_t mask);
+  int LoadImage(int fd);
+  void Compile();
+  void Compile6();
+  void BuildTrie6(size_t node, size_t first, size_t count, uint8_t pos);
 };
 
 #endif
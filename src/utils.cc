@@ -19,6 +19,11 @@
 
 #include "utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <uv.h>
 
 std::ostream __null_stream(nullptr);
@@ -145,3 +150,27 @@ std::ostream& operator<<(std::ostream& out, const SockAddr& addr) {
   }
   return out;
 }
+
+void ParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next(0);
+  std::function<void()> run = [&]() {
+    for (size_t index; (index = next++) < count;)
+      fn(index);
+  };
+
+  size_t thread_count = std::min<size_t>(
+      count, std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<uv_thread_t> threads(thread_count > 0 ? thread_count - 1 : 0);
+  size_t started = 0;
+  // Fewer threads than asked for only make it slower
+  while (started < threads.size() &&
+         uv_thread_create(
+             &threads[started],
+             [](void* arg) { (*(std::function<void()>*)arg)(); },
+             &run) == 0)
+    ++started;
+  run();
+  for (size_t i = 0; i < started; ++i) {
+    uv_thread_join(&threads[i]);
+  }
+}
@@ -38,9 +38,11 @@ extern std::ostream __null_stream;
 #define __LOG(stream, prefix)                                              \
   do {                                                                     \
     std::time_t __now;                                                     \
+    std::tm __tm;                                                          \
     std::time(&__now);                                                     \
     char __log_time_buf[10];                                               \
-    std::strftime(__log_time_buf, 10, "%H:%M:%S", std::localtime(&__now)); \
+    std::strftime(__log_time_buf, 10, "%H:%M:%S",                          \
+                  localtime_r(&__now, &__tm));                             \
     stream << "[" << (const char*)__log_time_buf << "]" << prefix          \
            << std::flush;                                                  \
   } while (0);                                                             \
@@ -175,6 +177,9 @@ bool ParseIPList(const char* str,
 bool ParseDNSList(const char* str,
                   CrDNSServer::Health healthy,
                   std::list<std::shared_ptr<CrDNSServer>>& result);
+// Calls fn(index) for every index below count, spread over as many threads
+// as there are cores, calling thread included. Returns once all are done.
+void ParallelFor(size_t count, const std::function<void(size_t)>& fn);
 
 struct UVError {
   int error;
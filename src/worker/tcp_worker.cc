@@ -19,17 +19,18 @@
 
 #include "tcp_worker.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iterator>
-
-#include "../session.h"
+#include <vector>
 
 TCPWorker::TCPWorker(uv_loop_t* uv_loop,
+                     CrTimerWheel* timer_wheel,
                      std::shared_ptr<const CrDNSServer> server)
-    : uv_tcp_(nullptr), recv_buffer_(), query_pool_() {
-  uv_loop_ = uv_loop;
-  remote_server_ = server;
-}
+    : CrWorker(uv_loop, timer_wheel, server),
+      uv_tcp_(nullptr),
+      recv_buffer_(),
+      query_pool_() {}
 
 TCPWorker::~TCPWorker() {
   if (uv_tcp_ != nullptr) {
@@ -58,16 +59,23 @@ void TCPWorker::OnInternalRecv(uv_stream_t* handle,
 
       auto pkt_end = std::next(pkt_cur, pkt_size);
       auto pkt = std::make_shared<u8_vec>(pkt_cur, pkt_end);
-      auto pkt_id = ntohs(*(uint16_t*)pkt->data());
+      auto pkt_id = pkt_size >= 2 ? ntohs(*(uint16_t*)pkt->data()) : 0;
+      auto it = pkt_size >= 2 ? query_pool_.find(pkt_id) : query_pool_.end();
 
-      if (query_pool_.find(pkt_id) != query_pool_.end()) {
+      if (it != query_pool_.end()) {
+        uint32_t session_id = it->second.session_id;
         if (send_cb_)
-          send_cb_(pkt_id, remote_server_, 0);
-        query_pool_.erase(pkt_id);
-        VERB("[" << pkt_id << "][TCP Worker][" << *remote_server_
+          send_cb_(session_id, remote_server_, 0);
+        query_pool_.erase(it);
+        id_pool_.Free(pkt_id);
+        ++stats_.received;
+        VERB("[" << session_id << "][TCP Worker][" << *remote_server_
                  << "] Session removed from pool");
         if (recv_cb_)
-          recv_cb_(CrPacket{.payload = pkt, .dns_server = remote_server_});
+          recv_cb_(CrPacket{.payload = pkt,
+                            .dns_server = remote_server_,
+                            .addr = nullptr,
+                            .session_id = session_id});
       } else {
         INFO << "[" << pkt_id << "][TCP Worker] Could not found session in ["
              << *remote_server_
@@ -75,6 +83,7 @@ void TCPWorker::OnInternalRecv(uv_stream_t* handle,
       }
       recv_buffer_.erase(recv_buffer_.begin(), pkt_end);
     }
+    Drain();
   } else {
     InternalClose();
   }
@@ -133,41 +142,54 @@ void TCPWorker::OnInternalSend(uv_stream_t* handle, int status) {
   }
 }
 
-int TCPWorker::RequestSend(Query* query) {
-  uv_buf_t *bufs, *buf_cur;
-  unsigned int bufs_count = 0;
-  uv_write_t* req = new uv_write_t;
+// A query may expire or be answered while its write is still pending, so
+// the write owns everything libuv reads from
+struct TCPSendRequest {
+  uv_write_t req;
+  // Size and upstream ID of each query
+  std::vector<uint16_t> headers;
+  std::vector<std::shared_ptr<const u8_vec>> payloads;
+};
+
+int TCPWorker::RequestSend(uint16_t id, const Query* query) {
+  TCPSendRequest* request = new TCPSendRequest;
+  request->req.data = request;
+
+  auto add = [request](uint16_t query_id, const Query& query_item) {
+    request->headers.push_back(htons(query_item.request->size()));
+    request->headers.push_back(htons(query_id));
+    request->payloads.push_back(query_item.request);
+  };
 
   if (query == nullptr) {
-    bufs_count = (unsigned int)query_pool_.size() * 2;
-    bufs = buf_cur = new uv_buf_t[bufs_count];
+    request->headers.reserve(query_pool_.size() * 2);
+    request->payloads.reserve(query_pool_.size());
     for (const auto& query_pair : query_pool_) {
-      auto& query_item = query_pair.second;
-      buf_cur->base = (char*)&query_item.size;
-      buf_cur->len = sizeof(uint16_t) / sizeof(char);
-      ++buf_cur;
-      buf_cur->base = (char*)query_item.request->data();
-      buf_cur->len = query_item.request->size();
-      ++buf_cur;
+      add(query_pair.first, query_pair.second);
     }
   } else {
-    bufs_count = 1 * 2;
-    bufs = new uv_buf_t[bufs_count];
-    bufs[0].base = (char*)&query->size;
-    bufs[0].len = sizeof(uint16_t) / sizeof(char);
-    bufs[1].base = (char*)query->request->data();
-    bufs[1].len = query->request->size();
+    add(id, *query);
+  }
+
+  unsigned int bufs_count = (unsigned int)request->payloads.size() * 2;
+  uv_buf_t* bufs = new uv_buf_t[bufs_count];
+  for (size_t i = 0; i < request->payloads.size(); ++i) {
+    const auto& payload = request->payloads[i];
+    bufs[i * 2].base = (char*)&request->headers[i * 2];
+    bufs[i * 2].len = sizeof(uint16_t) * 2;
+    bufs[i * 2 + 1].base = (char*)payload->data() + sizeof(uint16_t);
+    bufs[i * 2 + 1].len = payload->size() - sizeof(uint16_t);
   }
 
   int rtn = uv_write(
-      req, (uv_stream_t*)uv_tcp_, bufs, bufs_count,
+      &request->req, (uv_stream_t*)uv_tcp_, bufs, bufs_count,
       [](uv_write_t* req, int status) {
         ((TCPWorker*)req->handle->data)->OnInternalSend(req->handle, status);
-        delete req;
+        delete (TCPSendRequest*)req->data;
       });
 
   if (rtn != 0) {
-    delete req;
+    delete request;
     InternalClose();
   }
 
@@ -175,30 +197,45 @@ int TCPWorker::RequestSend(Query* query) {
   return rtn;
 }
 
-int TCPWorker::Send(std::shared_ptr<CrSession> session) {
+int TCPWorker::Transmit(uint32_t session_id,
+                        std::shared_ptr<const u8_vec> request) {
   if (uv_tcp_ == nullptr) {
     int rtn = RequestConnect();
-    VERB("[" << session->pipelined_id_ << "][TCPWorker] Connect to "
-             << *remote_server_ << ", " << *(UVError*)&rtn);
+    VERB("[" << session_id << "][TCPWorker] Connect to " << *remote_server_
+             << ", " << *(UVError*)&rtn);
     if (rtn < 0) {
+      // Reported like any other failure once the query is taken
+      Drop(session_id, rtn);
       return rtn;
     }
   }
 
-  if (query_pool_.find(session->pipelined_id_) != query_pool_.end()) {
-    ERR << "[" << session->pipelined_id_ << "][TCP Worker][" << *remote_server_
-        << "] Duplicated DNS pipelined ID detected! "
-        << "query_pool_ size: " << query_pool_.size() << ENDL;
-
-    assert(query_pool_.find(session->pipelined_id_) == query_pool_.end());
+  uint16_t id;
+  if (!id_pool_.Alloc(id)) {
+    // Saturated() covers the pool, callers never get here
+    assert(false);
+    return UV_ENOBUFS;
   }
 
-  query_pool_[session->pipelined_id_] =
-      Query{.retry_count = 0,
-            .size = htons(session->request_payload_->size()),
-            .request = session->request_payload_};
+  auto& query = query_pool_[id];
+  query = Query{.session_id = session_id,
+                .retry_count = 0,
+                .expire_at = ExpireAt(),
+                .request = request};
 
-  return RequestSend(&query_pool_[session->pipelined_id_]);
+  return RequestSend(id, &query);
+}
+
+void TCPWorker::Expire(uint64_t now) {
+  for (auto it = query_pool_.begin(); it != query_pool_.end();) {
+    if (it->second.expire_at <= now) {
+      ++stats_.dropped_expired;
+      id_pool_.Free(it->first);
+      it = query_pool_.erase(it);
+    } else {
+      ++it;
+    }
+  }
 }
 
 int TCPWorker::InternalClose() {
@@ -210,11 +247,13 @@ int TCPWorker::InternalClose() {
   for (auto it = query_pool_.begin(); it != query_pool_.end();) {
     auto& query = it->second;
     if (++query.retry_count > kRetryThreshold) {
-      /* TODO: Check SessionManager::Has(it->first) */
-      VERB("[" << it->first << "][TCP Worker] Session removed from ["
+      /* TODO: Check SessionManager::Has(query.session_id) */
+      VERB("[" << query.session_id << "][TCP Worker] Session removed from ["
                << *remote_server_ << "]'s pool due to retry overlimit");
+      ++stats_.dropped_error;
       if (send_cb_)
-        send_cb_(it->first, remote_server_, UV_ECONNABORTED);
+        send_cb_(query.session_id, remote_server_, UV_ECONNABORTED);
+      id_pool_.Free(it->first);
       it = query_pool_.erase(it);
     } else {
       ++it;
@@ -229,7 +268,7 @@ int TCPWorker::InternalClose() {
     if (rtn < 0) {
       return rtn;
     }
-    rtn = RequestSend(nullptr);
+    rtn = RequestSend(0, nullptr);
     if (rtn < 0) {
       return rtn;
     }
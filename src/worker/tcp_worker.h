@@ -27,10 +27,12 @@
 
 class TCPWorker : public CrWorker {
  public:
-  TCPWorker(uv_loop_t* uv_loop, std::shared_ptr<const CrDNSServer> server);
+  TCPWorker(uv_loop_t* uv_loop,
+            CrTimerWheel* timer_wheel,
+            std::shared_ptr<const CrDNSServer> server);
   ~TCPWorker();
 
-  int Send(std::shared_ptr<CrSession> session);
+  size_t InFlight() const { return query_pool_.size(); }
 
   void OnInternalConnect(uv_stream_t* handle, int status);
   void OnInternalSend(uv_stream_t* handle, int status);
@@ -39,9 +41,12 @@ class TCPWorker : public CrWorker {
  private:
   const static uint8_t kRetryThreshold = 1;
 
+  // Request goes out as its size and the upstream ID, followed by the rest
+  // of payload
   struct Query {
+    uint32_t session_id;
     uint8_t retry_count;
-    uint16_t size;
+    uint64_t expire_at;
     std::shared_ptr<const u8_vec> request;
   };
 
@@ -49,7 +54,10 @@ class TCPWorker : public CrWorker {
   std::list<uint8_t> recv_buffer_;
   std::unordered_map<uint16_t, Query> query_pool_;
 
-  int RequestSend(Query* query);
+  int Transmit(uint32_t session_id, std::shared_ptr<const u8_vec> request);
+  void Expire(uint64_t now);
+  // Writes query under id, or every query in pool if query is nullptr
+  int RequestSend(uint16_t id, const Query* query);
   int RequestConnect();
   int InternalClose();
 };
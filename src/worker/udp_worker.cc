@@ -19,69 +19,240 @@
 
 #include "udp_worker.h"
 
-#include "../session.h"
+#include <algorithm>
+#include <cassert>
+
+const uint64_t UDPWorker::kInitialRTO;
+const uint64_t UDPWorker::kMinRTO;
+const uint64_t UDPWorker::kMaxRTO;
+
+static void close_udp(uv_udp_t* handle) {
+  uv_close((uv_handle_t*)handle, [](uv_handle_t* handle) { delete handle; });
+}
 
 UDPWorker::UDPWorker(uv_loop_t* uv_loop,
+                     CrTimerWheel* timer_wheel,
                      std::shared_ptr<const CrDNSServer> server)
-    : uv_udp_(nullptr) {
-  uv_loop_ = uv_loop;
-  remote_server_ = server;
+    : CrWorker(uv_loop, timer_wheel, server),
+      uv_udp_(nullptr),
+      retry_timer_(),
+      retry_due_(0),
+      inflight_(),
+      srtt_(0),
+      rttvar_(0),
+      rto_(kInitialRTO),
+      window_sent_(0),
+      window_lost_(0),
+      lossy_windows_(0) {
+  retry_timer_.data = this;
+  retry_timer_.cb = [](CrTimer* timer) {
+    ((UDPWorker*)timer->data)->OnRetryTimer();
+  };
 }
 
 UDPWorker::~UDPWorker() {
+  for (auto it = inflight_.begin(); it != inflight_.end();) {
+    it = Forget(it);
+  }
+  timer_wheel_->Stop(&retry_timer_);
   if (uv_udp_ != nullptr) {
-    uv_close((uv_handle_t*)uv_udp_, [](uv_handle_t* handle) { delete handle; });
+    close_udp(uv_udp_);
   }
 }
 
 void UDPWorker::OnInternalSend(uv_udp_send_t* req, int status) {
   if (req->handle != uv_udp_)
     return;
+
+  auto query = (Query*)req->data;
   if (status != 0 && status != UV_ECANCELED) {
+    auto it = inflight_.find(query->id);
+    if (it != inflight_.end() && it->second.session_id == query->session_id)
+      Forget(it);
+    ++stats_.dropped_error;
     InternalClose();
   }
 
-  auto query = (Query*)req->data;
   if (send_cb_)
-    send_cb_(query->id, remote_server_, status);
+    send_cb_(query->session_id, remote_server_, status);
+}
+
+int UDPWorker::SendQuery(uv_udp_t* handle,
+                         uv_udp_send_t* req,
+                         uv_udp_send_cb cb) {
+  auto query = (Query*)req->data;
+  uv_buf_t bufs[2] = {
+      uv_buf_init((char*)&query->wire_id, sizeof(uint16_t)),
+      uv_buf_init((char*)query->request->data() + sizeof(uint16_t),
+                  (uint)(query->request->size() - sizeof(uint16_t)))};
+  return uv_udp_send(req, handle, bufs, 2,
+                     (const struct sockaddr*)remote_server_->addr.get(), cb);
 }
 
-int UDPWorker::Send(std::shared_ptr<CrSession> session) {
+int UDPWorker::Transmit(uint32_t session_id,
+                        std::shared_ptr<const u8_vec> request) {
+  uint16_t id;
+  if (!id_pool_.Alloc(id)) {
+    // Saturated() covers the pool, callers never get here
+    assert(false);
+    return UV_ENOBUFS;
+  }
+
   if (uv_udp_ == nullptr) {
     Restart();
   }
 
   uv_udp_send_t* req = new uv_udp_send_t;
-  req->data = new Query{.id = session->pipelined_id_,
-                        .request = session->request_payload_};
-  uv_buf_t buf = uv_buf_init((char*)session->request_payload_->data(),
-                             (uint)session->request_payload_->size());
-  int rtn = uv_udp_send(
-      req, uv_udp_, &buf, 1, (const struct sockaddr*)remote_server_->addr.get(),
-      [](uv_udp_send_t* req, int status) {
-        ((UDPWorker*)req->handle->data)->OnInternalSend(req, status);
-        delete (Query*)req->data;
-        delete req;
-      });
+  req->data = new Query{.id = id,
+                        .wire_id = htons(id),
+                        .session_id = session_id,
+                        .request = request};
+  int rtn = SendQuery(uv_udp_, req, [](uv_udp_send_t* req, int status) {
+    ((UDPWorker*)req->handle->data)->OnInternalSend(req, status);
+    delete (Query*)req->data;
+    delete req;
+  });
 
   if (rtn != 0) {
+    ++stats_.dropped_error;
+    id_pool_.Free(id);
     if (send_cb_)
-      send_cb_(session->pipelined_id_, remote_server_, rtn);
+      send_cb_(session_id, remote_server_, rtn);
     delete (Query*)req->data;
     delete req;
     InternalClose();
+  } else {
+    uint64_t now = uv_now(uv_loop_);
+    auto& query = inflight_[id];
+    query = InFlightQuery{.session_id = session_id,
+                          .retry_count = 0,
+                          .sent_at = now,
+                          .retry_at = now + rto_,
+                          .expire_at = ExpireAt(),
+                          .retry_udps = {},
+                          .request = request};
+    // Expiry goes through the same timer, so losses are counted in time
+    ArmRetryTimer(CrConfig::udp_retries != 0 ? query.retry_at
+                                             : query.expire_at);
   }
 
   return rtn;
 }
 
+int UDPWorker::Retransmit(uint16_t id, InFlightQuery& query) {
+  uv_udp_t* retry_udp = OpenSocket();
+  query.retry_udps.push_back(retry_udp);
+
+  uv_udp_send_t* req = new uv_udp_send_t;
+  req->data = new Query{.id = id,
+                        .wire_id = htons(id),
+                        .session_id = query.session_id,
+                        .request = query.request};
+  int rtn = SendQuery(retry_udp, req, [](uv_udp_send_t* req, int status) {
+    delete (Query*)req->data;
+    delete req;
+  });
+  if (rtn != 0) {
+    delete (Query*)req->data;
+    delete req;
+  }
+
+  VERB("[" << query.session_id << "][UDP Worker][" << *remote_server_
+           << "] Retransmit #"
+           << (int)query.retry_count << ", " << *(UVError*)&rtn);
+  return rtn;
+}
+
+void UDPWorker::Expire(uint64_t now) {
+  for (auto it = inflight_.begin(); it != inflight_.end();) {
+    if (it->second.expire_at <= now) {
+      ++stats_.dropped_expired;
+      CountLoss(true);
+      it = Forget(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void UDPWorker::OnRetryTimer() {
+  uint64_t now = uv_now(uv_loop_), next = UINT64_MAX;
+  Expire(now);
+
+  for (auto& query_pair : inflight_) {
+    auto& query = query_pair.second;
+    if (query.retry_at <= now && query.retry_count < CrConfig::udp_retries) {
+      ++query.retry_count;
+      ++stats_.retransmitted;
+      Retransmit(query_pair.first, query);
+      // Exponential backoff, but never beyond the session lifetime
+      query.retry_at = now + std::min(rto_ << query.retry_count, kMaxRTO);
+    }
+    next = std::min(next, query.retry_count < CrConfig::udp_retries
+                              ? query.retry_at
+                              : query.expire_at);
+  }
+
+  retry_due_ = 0;
+  if (next != UINT64_MAX)
+    ArmRetryTimer(next);
+  // Expired queries make room for the backlog
+  Drain();
+}
+
+void UDPWorker::ArmRetryTimer(uint64_t due) {
+  if (retry_due_ != 0 && retry_due_ <= due)
+    return;
+  uint64_t now = timer_wheel_->Now();
+  retry_due_ = due;
+  timer_wheel_->Start(&retry_timer_, due > now ? due - now : 0);
+}
+
+void UDPWorker::UpdateRTO(uint64_t rtt) {
+  if (srtt_ == 0 && rttvar_ == 0) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    uint64_t delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (rttvar_ * 3 + delta) / 4;
+    srtt_ = (srtt_ * 7 + rtt) / 8;
+  }
+  rto_ = std::min(std::max(srtt_ + std::max<uint64_t>(1, rttvar_ * 4), kMinRTO),
+                  kMaxRTO);
+}
+
+void UDPWorker::CountLoss(bool lost) {
+  if (lost)
+    ++window_lost_;
+  if (++window_sent_ < kLossWindow)
+    return;
+
+  if (window_lost_ * kLossRatio > window_sent_) {
+    if (lossy_windows_ < kLossyWindows && ++lossy_windows_ == kLossyWindows) {
+      WARN << "[UDP Worker][" << *remote_server_ << "] Lost " << window_lost_
+           << " of last " << window_sent_ << " queries" << ENDL;
+    }
+  } else {
+    lossy_windows_ = 0;
+  }
+  window_sent_ = window_lost_ = 0;
+}
+
+std::unordered_map<uint16_t, UDPWorker::InFlightQuery>::iterator
+UDPWorker::Forget(
+    std::unordered_map<uint16_t, UDPWorker::InFlightQuery>::iterator it) {
+  for (auto retry_udp : it->second.retry_udps) {
+    close_udp(retry_udp);
+  }
+  id_pool_.Free(it->first);
+  return inflight_.erase(it);
+}
+
 void UDPWorker::OnInternalRecv(uv_udp_t* handle,
                                ssize_t nread,
                                const uv_buf_t* buf,
                                const struct sockaddr* addr,
                                unsigned flags) {
-  if (handle != uv_udp_)
-    return;
   if ((flags & UV_UDP_PARTIAL) != 0) {
     INFO << "[UDP Worker] Met UV_UDP_PARTIAL from " << *(SockAddr*)addr << ENDL;
     return;
@@ -89,21 +260,40 @@ void UDPWorker::OnInternalRecv(uv_udp_t* handle,
 
   auto remote_addr = (const struct sockaddr*)remote_server_->addr.get();
   if (nread >= 0 && addr != nullptr && cmp_sockaddr(remote_addr, addr) == 0) {
-    if (recv_cb_) {
-      auto pkt = std::make_shared<u8_vec>(buf->base, buf->base + nread);
-      recv_cb_(CrPacket{.payload = pkt, .dns_server = remote_server_});
+    // Response of any attempt matches by the same upstream ID
+    auto it = nread >= 2 ? inflight_.find(ntohs(*(uint16_t*)buf->base))
+                         : inflight_.end();
+    if (it != inflight_.end()) {
+      // Karn's algorithm, RTT of retransmitted query is ambiguous
+      if (it->second.retry_count == 0)
+        UpdateRTO(uv_now(uv_loop_) - it->second.sent_at);
+      CountLoss(false);
+      uint32_t session_id = it->second.session_id;
+      Forget(it);
+      ++stats_.received;
+      if (recv_cb_) {
+        auto pkt = std::make_shared<u8_vec>(buf->base, buf->base + nread);
+        recv_cb_(CrPacket{.payload = pkt,
+                          .dns_server = remote_server_,
+                          .addr = nullptr,
+                          .session_id = session_id});
+      }
+    } else {
+      VERB("[UDP Worker][" << *remote_server_
+                           << "] Dropped response of unknown query");
     }
-  } else if (nread != 0) {
+    Drain();
+  } else if (nread != 0 && handle == uv_udp_) {
     InternalClose();
   }
 }
 
-int UDPWorker::Restart() {
-  uv_udp_ = new uv_udp_t;
-  uv_udp_init(uv_loop_, uv_udp_);
-  uv_udp_->data = this;
-  return uv_udp_recv_start(
-      uv_udp_,
+uv_udp_t* UDPWorker::OpenSocket() {
+  uv_udp_t* handle = new uv_udp_t;
+  uv_udp_init(uv_loop_, handle);
+  handle->data = this;
+  uv_udp_recv_start(
+      handle,
       [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
         buf->base = new char[UDP_BUF_SIZE];
         buf->len = UDP_BUF_SIZE;
@@ -114,10 +304,27 @@ int UDPWorker::Restart() {
             ->OnInternalRecv(handle, nread, buf, addr, flags);
         delete[] buf->base;
       });
+  return handle;
+}
+
+int UDPWorker::Restart() {
+  uv_udp_ = OpenSocket();
+  return 0;
 }
 
 int UDPWorker::InternalClose() {
-  uv_close((uv_handle_t*)uv_udp_, [](uv_handle_t* handle) { delete handle; });
+  close_udp(uv_udp_);
   uv_udp_ = nullptr;
+
+  // Responses to the closed socket could never arrive
+  auto aborted = std::move(inflight_);
+  inflight_.clear();
+  for (auto& query : aborted) {
+    for (auto retry_udp : query.second.retry_udps) {
+      close_udp(retry_udp);
+    }
+    id_pool_.Free(query.first);
+    Drop(query.second.session_id, UV_ECONNABORTED);
+  }
   return 0;
 }
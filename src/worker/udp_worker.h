@@ -22,12 +22,19 @@
 
 #include "worker.h"
 
+#include <unordered_map>
+#include <vector>
+
 class UDPWorker : public CrWorker {
  public:
-  UDPWorker(uv_loop_t* uv_loop, std::shared_ptr<const CrDNSServer> server);
+  UDPWorker(uv_loop_t* uv_loop,
+            CrTimerWheel* timer_wheel,
+            std::shared_ptr<const CrDNSServer> server);
   ~UDPWorker();
 
-  int Send(std::shared_ptr<CrSession> session);
+  size_t InFlight() const { return inflight_.size(); }
+  bool Degraded() const { return lossy_windows_ >= kLossyWindows; }
+
   void OnInternalSend(uv_udp_send_t* req, int status);
   void OnInternalRecv(uv_udp_t* handle,
                       ssize_t nread,
@@ -36,12 +43,62 @@ class UDPWorker : public CrWorker {
                       unsigned flags);
 
  private:
+  // RTO bounds and initial value, see RFC 6298. DNS is far more latency
+  // sensitive than TCP, so the minimal RTO is much lower than 1 second.
+  static const uint64_t kInitialRTO = 500;
+  static const uint64_t kMinRTO = 100;
+  static const uint64_t kMaxRTO = 2000;
+  // Loss rate is sampled for every kLossWindow queries, the upstream will
+  // be considered as degraded after kLossyWindows windows in a row losing
+  // more than 1/kLossRatio queries. A query is lost only if none of its
+  // attempts is answered before it expires.
+  static const uint32_t kLossWindow = 64;
+  static const uint32_t kLossRatio = 4;
+  static const uint8_t kLossyWindows = 2;
+
+  // Request goes out as the upstream ID followed by the rest of payload
   struct Query {
     uint16_t id;
+    uint16_t wire_id;
+    uint32_t session_id;
+    std::shared_ptr<const u8_vec> request;
+  };
+
+  struct InFlightQuery {
+    uint32_t session_id;
+    uint8_t retry_count;
+    uint64_t sent_at;
+    uint64_t retry_at;
+    uint64_t expire_at;
+    // Each retransmission goes through a new socket, so a new source port.
+    // Sockets of earlier attempts keep receiving, a late answer still counts.
+    std::vector<uv_udp_t*> retry_udps;
     std::shared_ptr<const u8_vec> request;
   };
 
   uv_udp_t* uv_udp_;
+  CrTimer retry_timer_;
+  uint64_t retry_due_;
+  std::unordered_map<uint16_t, InFlightQuery> inflight_;
+
+  uint64_t srtt_;
+  uint64_t rttvar_;
+  uint64_t rto_;
+  uint32_t window_sent_;
+  uint32_t window_lost_;
+  uint8_t lossy_windows_;
+
+  int Transmit(uint32_t session_id, std::shared_ptr<const u8_vec> request);
+  int Retransmit(uint16_t id, InFlightQuery& query);
+  int SendQuery(uv_udp_t* handle, uv_udp_send_t* req, uv_udp_send_cb cb);
+  void Expire(uint64_t now);
+  void OnRetryTimer();
+  void ArmRetryTimer(uint64_t due);
+  void UpdateRTO(uint64_t rtt);
+  void CountLoss(bool lost);
+  std::unordered_map<uint16_t, InFlightQuery>::iterator Forget(
+      std::unordered_map<uint16_t, InFlightQuery>::iterator it);
+  uv_udp_t* OpenSocket();
   int Restart();
   int InternalClose();
 };
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2018  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of CrappyDNS.
+ *
+ * CrappyDNS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * CrappyDNS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "worker.h"
+
+#include <algorithm>
+#include <random>
+
+#include "../session.h"
+
+CrWorker::CrWorker(uv_loop_t* uv_loop,
+                   CrTimerWheel* timer_wheel,
+                   std::shared_ptr<const CrDNSServer> server)
+    : send_cb_(nullptr),
+      recv_cb_(nullptr),
+      drained_cb_(nullptr),
+      uv_loop_(uv_loop),
+      timer_wheel_(timer_wheel),
+      remote_server_(server),
+      backlog_(),
+      stats_(),
+      id_pool_(std::random_device()()) {}
+
+int CrWorker::Send(CrSession* session) {
+  uint32_t session_id = session->session_id_;
+
+  if (Saturated()) {
+    Expire(uv_now(uv_loop_));
+  }
+
+  if (!Saturated() && backlog_.empty()) {
+    ++stats_.sent;
+    return Transmit(session_id, session->request_payload_);
+  }
+
+  if (backlog_.size() >= CrConfig::max_queue) {
+    return UV_ENOBUFS;
+  }
+
+  backlog_.push_back(Pending{.session_id = session_id,
+                             .expire_at = ExpireAt(),
+                             .request = session->request_payload_});
+  ++stats_.queued;
+  stats_.max_queue_depth = std::max(stats_.max_queue_depth, backlog_.size());
+  VERB("[" << session_id << "][Worker][" << *remote_server_
+           << "] Queued, depth "
+           << backlog_.size() << ", in-flight " << InFlight());
+  return 0;
+}
+
+bool CrWorker::Acceptable() const {
+  return !Saturated() || backlog_.size() < CrConfig::max_queue;
+}
+
+void CrWorker::ReportStats(std::ostream& out) const {
+  out << *remote_server_ << ": in-flight " << InFlight() << ", queued "
+      << backlog_.size() << " (peak " << stats_.max_queue_depth << "), sent "
+      << stats_.sent << ", received " << stats_.received << ", retransmitted "
+      << stats_.retransmitted << ", rerouted " << stats_.rerouted
+      << ", dropped " << stats_.dropped_overflow << " overflow / "
+      << stats_.dropped_expired << " expired / " << stats_.dropped_error
+      << " error";
+}
+
+uint64_t CrWorker::ExpireAt() const {
+  return uv_now(uv_loop_) + CrConfig::timeout_in_ms;
+}
+
+void CrWorker::Drain() {
+  uint64_t now = uv_now(uv_loop_);
+  while (!backlog_.empty() && !Saturated()) {
+    Pending pending = backlog_.front();
+    backlog_.pop_front();
+    if (pending.expire_at <= now) {
+      Drop(pending.session_id, UV_ETIMEDOUT);
+      continue;
+    }
+    ++stats_.sent;
+    // Other failures are reported by Transmit, the next one may do better
+    if (Transmit(pending.session_id, pending.request) == UV_ENOBUFS) {
+      Drop(pending.session_id, UV_ENOBUFS);
+      break;
+    }
+  }
+  if (drained_cb_ && backlog_.empty() && InFlight() == 0)
+    drained_cb_();
+}
+
+void CrWorker::Drop(uint32_t session_id, int reason) {
+  switch (reason) {
+    case UV_ENOBUFS:
+      ++stats_.dropped_overflow;
+      break;
+    case UV_ETIMEDOUT:
+      // The session has timed out already, nobody is waiting for it
+      ++stats_.dropped_expired;
+      return;
+    default:
+      ++stats_.dropped_error;
+      break;
+  }
+  VERB("[" << session_id << "][Worker][" << *remote_server_ << "] Dropped, "
+           << *(UVError*)&reason);
+  if (send_cb_)
+    send_cb_(session_id, remote_server_, reason);
+}
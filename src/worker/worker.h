@@ -20,25 +20,90 @@
 #ifndef _CR_WORKER_H_
 #define _CR_WORKER_H_
 
+#include <deque>
 #include <functional>
+#include <ostream>
 
 #include "../crappydns.h"
+#include "../id_pool.h"
+#include "../timer_wheel.h"
 
 class CrSession;
 
 class CrWorker {
  public:
+  CrWorker(uv_loop_t* uv_loop,
+           CrTimerWheel* timer_wheel,
+           std::shared_ptr<const CrDNSServer> server);
   virtual ~CrWorker(){};
 
-  std::function<void(uint16_t, std::shared_ptr<const CrDNSServer>, int)>
+  struct Stats {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t queued;
+    uint64_t rerouted;
+    uint64_t retransmitted;
+    uint64_t dropped_overflow;
+    uint64_t dropped_expired;
+    uint64_t dropped_error;
+    size_t max_queue_depth;
+  };
+
+  std::function<void(uint32_t, std::shared_ptr<const CrDNSServer>, int)>
       send_cb_;
   std::function<void(CrPacket)> recv_cb_;
+  // Called once nothing is in flight or queued any more
+  std::function<void()> drained_cb_;
+
+  // Sends the query at once, or parks it in the bounded backlog while the
+  // worker is saturated. Returns UV_ENOBUFS when the backlog is full too, in
+  // that case the query is left untouched for caller to reroute or drop.
+  int Send(CrSession* session);
 
-  virtual int Send(std::shared_ptr<CrSession> session) = 0;
+  virtual size_t InFlight() const = 0;
+  size_t QueueDepth() const { return backlog_.size(); }
+  bool Acceptable() const;
+  // Upstream is too lossy for this transport
+  virtual bool Degraded() const { return false; }
+
+  std::shared_ptr<const CrDNSServer> RemoteServer() const {
+    return remote_server_;
+  }
+  Stats& GetStats() { return stats_; }
+  void ReportStats(std::ostream& out) const;
 
  protected:
+  struct Pending {
+    uint32_t session_id;
+    uint64_t expire_at;
+    std::shared_ptr<const u8_vec> request;
+  };
+
   uv_loop_t* uv_loop_;
+  CrTimerWheel* timer_wheel_;
   std::shared_ptr<const CrDNSServer> remote_server_;
+  std::deque<Pending> backlog_;
+  Stats stats_;
+  // DNS IDs on the wire are allocated per upstream, every worker owns a
+  // single connection or socket set so they never collide with each other
+  CrIDPool id_pool_;
+
+  // Worker can not take another query without queuing
+  bool Saturated() const {
+    return InFlight() >= CrConfig::max_inflight || id_pool_.Available() == 0;
+  }
+
+  // Sends a query on a worker that is not saturated. Failures are reported
+  // through send_cb_, except UV_ENOBUFS which is only returned and left to
+  // the caller.
+  virtual int Transmit(uint32_t session_id,
+                       std::shared_ptr<const u8_vec> request) = 0;
+  // Drops in-flight queries whose session must have already timed out
+  virtual void Expire(uint64_t now) = 0;
+
+  uint64_t ExpireAt() const;
+  void Drain();
+  void Drop(uint32_t session_id, int reason);
 };
 
 #endif